@@ -28,6 +28,10 @@
 
 #include "pools.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct
 {
     void* (*alloc) (void *allocator_data, size_t size);
@@ -44,4 +48,8 @@ void init_pools_allocator (allocator_t *allocator, pools_t *pools);
 
 char* allocator_strdup (allocator_t *allocator, const char *str);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
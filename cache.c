@@ -0,0 +1,394 @@
+/*
+ * cache.c
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include <reload.h>
+#include <cache.h>
+
+#ifdef __linux__
+#define WATCH_MASK        (IN_CLOSE_WRITE | IN_MOVED_TO)
+#endif
+
+struct _lisp_snapshot_t
+{
+    int refcount;
+    unsigned long version;
+    lisp_forms_t *forms;
+};
+
+typedef struct _cache_entry_t
+{
+    char *path;
+    const char *name;		/* the file name part of path */
+    int wd;
+    int loading;		/* the first snapshot is being loaded */
+    int changed;		/* the file changed while it was loading */
+    lisp_snapshot_t *current;
+    struct _cache_entry_t *next;
+} cache_entry_t;
+
+struct _lisp_cache_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;	/* an entry has finished loading */
+    cache_entry_t *entries;
+    int inotify_fd;
+    int wake_fds[2];
+    pthread_t thread;
+};
+
+static lisp_snapshot_t*
+snapshot_load (const char *path, unsigned long version)
+{
+    lisp_snapshot_t *snapshot = (lisp_snapshot_t*)malloc(sizeof(lisp_snapshot_t));
+
+    if (snapshot == 0)
+	return 0;
+
+    snapshot->forms = lisp_forms_load(path);
+    if (snapshot->forms == 0)
+    {
+	free(snapshot);
+	return 0;
+    }
+
+    snapshot->refcount = 1;
+    snapshot->version = version;
+
+    return snapshot;
+}
+
+#ifdef __linux__
+/* Re-reads the file called name in the directory watched by wd, if it
+   is in the cache.  Readers keep the old snapshot until the new one is
+   complete, and if the new contents cannot be read, e.g., because the
+   file is only partially written, the old snapshot stays current. */
+static void
+cache_reload (lisp_cache_t *cache, int wd, const char *name)
+{
+    cache_entry_t *entry;
+    lisp_snapshot_t *snapshot, *old;
+
+    pthread_mutex_lock(&cache->lock);
+    for (entry = cache->entries; entry != 0; entry = entry->next)
+	if (entry->wd == wd && strcmp(entry->name, name) == 0)
+	    break;
+    /* the thread loading the entry reads the file again */
+    if (entry != 0 && entry->loading)
+    {
+	entry->changed = 1;
+	entry = 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    /* loaded entries are only removed by lisp_cache_free, which waits
+       for this thread to finish */
+    if (entry == 0)
+	return;
+
+    snapshot = snapshot_load(entry->path, 0);
+    if (snapshot == 0)
+	return;
+
+    pthread_mutex_lock(&cache->lock);
+    old = entry->current;
+    snapshot->version = old->version + 1;
+    entry->current = snapshot;
+    pthread_mutex_unlock(&cache->lock);
+
+    lisp_snapshot_unref(old);
+}
+
+static void*
+cache_watch (void *data)
+{
+    lisp_cache_t *cache = (lisp_cache_t*)data;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    for (;;)
+    {
+	struct pollfd fds[2];
+	ssize_t length;
+	char *p;
+
+	fds[0].fd = cache->inotify_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = cache->wake_fds[0];
+	fds[1].events = POLLIN;
+
+	if (poll(fds, 2, -1) < 0)
+	    continue;
+	if (fds[1].revents != 0)
+	    return 0;
+
+	length = read(cache->inotify_fd, buf, sizeof(buf));
+	if (length <= 0)
+	    continue;
+
+	for (p = buf; p < buf + length; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len)
+	{
+	    struct inotify_event *event = (struct inotify_event*)p;
+
+	    if ((event->mask & WATCH_MASK) && event->len > 0)
+		cache_reload(cache, event->wd, event->name);
+	}
+    }
+}
+#endif
+
+lisp_cache_t*
+lisp_cache_new (void)
+{
+    lisp_cache_t *cache = (lisp_cache_t*)malloc(sizeof(lisp_cache_t));
+
+    if (cache == 0)
+	return 0;
+
+    pthread_mutex_init(&cache->lock, 0);
+    pthread_cond_init(&cache->loaded, 0);
+    cache->entries = 0;
+    cache->inotify_fd = -1;
+
+#ifdef __linux__
+    /* without inotify the cache still shares the snapshots, but does
+       not notice changes */
+    cache->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (cache->inotify_fd != -1)
+    {
+	if (pipe(cache->wake_fds) == -1)
+	{
+	    close(cache->inotify_fd);
+	    cache->inotify_fd = -1;
+	}
+	else if (pthread_create(&cache->thread, 0, cache_watch, cache) != 0)
+	{
+	    close(cache->wake_fds[0]);
+	    close(cache->wake_fds[1]);
+	    close(cache->inotify_fd);
+	    cache->inotify_fd = -1;
+	}
+    }
+#endif
+
+    return cache;
+}
+
+void
+lisp_cache_free (lisp_cache_t *cache)
+{
+    cache_entry_t *entry, *next;
+
+#ifdef __linux__
+    if (cache->inotify_fd != -1)
+    {
+	char c = 0;
+
+	while (write(cache->wake_fds[1], &c, 1) == -1)
+	    ;
+	pthread_join(cache->thread, 0);
+
+	close(cache->wake_fds[0]);
+	close(cache->wake_fds[1]);
+	close(cache->inotify_fd);
+    }
+#endif
+
+    for (entry = cache->entries; entry != 0; entry = next)
+    {
+	next = entry->next;
+	lisp_snapshot_unref(entry->current);
+	free(entry->path);
+	free(entry);
+    }
+
+    pthread_cond_destroy(&cache->loaded);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+#ifdef __linux__
+/* Removes the watch of an entry which could not be loaded, unless
+   another entry is in the same directory. */
+static void
+unwatch (lisp_cache_t *cache, int wd)
+{
+    cache_entry_t *entry;
+
+    if (wd == -1)
+	return;
+
+    for (entry = cache->entries; entry != 0; entry = entry->next)
+	if (entry->wd == wd)
+	    return;
+
+    inotify_rm_watch(cache->inotify_fd, wd);
+}
+#endif
+
+lisp_snapshot_t*
+lisp_cache_get (lisp_cache_t *cache, const char *path)
+{
+    cache_entry_t *entry, **link;
+    lisp_snapshot_t *snapshot = 0;
+    char *slash;
+
+    pthread_mutex_lock(&cache->lock);
+
+ again:
+    for (entry = cache->entries; entry != 0; entry = entry->next)
+	if (strcmp(entry->path, path) == 0)
+	{
+	    /* only callers of the same path wait for a load, and if it
+	       fails, try again themselves */
+	    if (entry->loading)
+	    {
+		pthread_cond_wait(&cache->loaded, &cache->lock);
+		goto again;
+	    }
+	    snapshot = lisp_snapshot_ref(entry->current);
+	    goto done;
+	}
+
+    entry = (cache_entry_t*)malloc(sizeof(cache_entry_t));
+    if (entry == 0)
+	goto done;
+    entry->path = strdup(path);
+    if (entry->path == 0)
+    {
+	free(entry);
+	goto done;
+    }
+
+    slash = strrchr(entry->path, '/');
+    entry->name = slash != 0 ? slash + 1 : entry->path;
+    entry->wd = -1;
+
+#ifdef __linux__
+    if (cache->inotify_fd != -1)
+    {
+	/* the directory is watched, because many programs replace files
+	   by renaming new ones over them */
+	if (slash == 0)
+	    entry->wd = inotify_add_watch(cache->inotify_fd, ".", WATCH_MASK);
+	else if (slash == entry->path)
+	    entry->wd = inotify_add_watch(cache->inotify_fd, "/", WATCH_MASK);
+	else
+	{
+	    *slash = '\0';
+	    entry->wd = inotify_add_watch(cache->inotify_fd, entry->path, WATCH_MASK);
+	    *slash = '/';
+	}
+    }
+#endif
+
+    /* the entry is in place before the file is loaded, without the
+       lock, so that a change while loading cannot be missed */
+    entry->loading = 1;
+    entry->current = 0;
+    entry->next = cache->entries;
+    cache->entries = entry;
+
+    for (;;)
+    {
+	entry->changed = 0;
+	pthread_mutex_unlock(&cache->lock);
+
+	snapshot = snapshot_load(path, 1);
+
+	pthread_mutex_lock(&cache->lock);
+	if (snapshot == 0)
+	    break;
+	if (entry->current != 0)
+	    lisp_snapshot_unref(entry->current);
+	entry->current = snapshot;
+	if (!entry->changed)
+	    break;
+    }
+
+    entry->loading = 0;
+    pthread_cond_broadcast(&cache->loaded);
+
+    if (entry->current == 0)
+    {
+	for (link = &cache->entries; *link != entry; link = &(*link)->next)
+	    ;
+	*link = entry->next;
+#ifdef __linux__
+	unwatch(cache, entry->wd);
+#endif
+	free(entry->path);
+	free(entry);
+	goto done;
+    }
+
+    snapshot = lisp_snapshot_ref(entry->current);
+
+ done:
+    pthread_mutex_unlock(&cache->lock);
+
+    return snapshot;
+}
+
+lisp_snapshot_t*
+lisp_snapshot_ref (lisp_snapshot_t *snapshot)
+{
+    __sync_add_and_fetch(&snapshot->refcount, 1);
+
+    return snapshot;
+}
+
+void
+lisp_snapshot_unref (lisp_snapshot_t *snapshot)
+{
+    if (__sync_sub_and_fetch(&snapshot->refcount, 1) > 0)
+	return;
+
+    lisp_forms_free(snapshot->forms);
+    free(snapshot);
+}
+
+unsigned long
+lisp_snapshot_version (lisp_snapshot_t *snapshot)
+{
+    return snapshot->version;
+}
+
+long
+lisp_snapshot_length (lisp_snapshot_t *snapshot)
+{
+    return lisp_forms_length(snapshot->forms);
+}
+
+lisp_object_t*
+lisp_snapshot_nth (lisp_snapshot_t *snapshot, long n)
+{
+    return lisp_forms_nth(snapshot->forms, n);
+}
@@ -0,0 +1,50 @@
+/*
+ * cache.h
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "lispreader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _lisp_cache_t lisp_cache_t;
+typedef struct _lisp_snapshot_t lisp_snapshot_t;
+
+lisp_cache_t* lisp_cache_new (void);
+void lisp_cache_free (lisp_cache_t *cache);
+lisp_snapshot_t* lisp_cache_get (lisp_cache_t *cache, const char *path);
+
+lisp_snapshot_t* lisp_snapshot_ref (lisp_snapshot_t *snapshot);
+void lisp_snapshot_unref (lisp_snapshot_t *snapshot);
+unsigned long lisp_snapshot_version (lisp_snapshot_t *snapshot);
+long lisp_snapshot_length (lisp_snapshot_t *snapshot);
+lisp_object_t* lisp_snapshot_nth (lisp_snapshot_t *snapshot, long n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
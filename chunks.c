@@ -0,0 +1,198 @@
+/*
+ * chunks.c
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <chunks.h>
+
+/* A buffer is split into chunks which start at lines beginning with an
+   open paren.  The chunks are read independently, and afterwards the
+   chunks whose starts turn out not to be the starts of top-level
+   expressions are read again from where the previous chunk ended. */
+
+/* A chunk which does not start at an expression can contain many open
+   parens in strings or comments, so its lists are only read up to this
+   depth. */
+#define MAX_CHUNK_DEPTH     256
+
+/* Splits the length bytes at buf into chunks.  Returns the number of
+   chunks, or 0 if the buffer is too small to be split. */
+int
+lisp_chunks_split (const char *buf, size_t length, lisp_chunk_t **chunks)
+{
+    long start = 0;
+    int num_chunks = 0, capacity = length / LISP_CHUNK_SIZE;
+
+    if (capacity < 2)
+	return 0;
+
+    *chunks = (lisp_chunk_t*)malloc(capacity * sizeof(lisp_chunk_t));
+    if (*chunks == 0)
+	return 0;
+
+    while (num_chunks < capacity)
+    {
+	long end = (long)length;
+
+	if (num_chunks + 1 < capacity && start + LISP_CHUNK_SIZE < (long)length)
+	{
+	    const char *p = buf + start + LISP_CHUNK_SIZE;
+
+	    while ((p = (const char*)memchr(p, '\n', buf + length - p)) != 0 && p + 1 < buf + length && p[1] != '(')
+		++p;
+	    if (p != 0 && p + 1 < buf + length)
+		end = p + 1 - buf;
+	}
+
+	(*chunks)[num_chunks].start = start;
+	(*chunks)[num_chunks].end = end;
+	(*chunks)[num_chunks].stop = start;
+	(*chunks)[num_chunks].status = LISP_CHUNK_REREAD;
+	++num_chunks;
+
+	if (end == (long)length)
+	    break;
+	start = end;
+    }
+
+    if (num_chunks < 2)
+    {
+	free(*chunks);
+	return 0;
+    }
+
+    return num_chunks;
+}
+
+static int
+skip_too_deep (int depth, int index, void *data)
+{
+    if (depth <= MAX_CHUNK_DEPTH)
+	return 0;
+
+    *(int*)data = 1;
+
+    return 1;
+}
+
+/* Reads the expressions of stream which start before offset end, or up
+   to its end if end is negative, calls form for each, and stores the
+   offset where the next one starts in stop.  On a parse error, stop is
+   where the broken expression starts.  Chunks are only read up to
+   MAX_CHUNK_DEPTH. */
+int
+lisp_chunks_read (allocator_t *allocator, lisp_stream_t *stream, long end, int is_chunk,
+		  void (*form) (lisp_object_t *obj, void *data), void *data, long *stop)
+{
+    int too_deep = 0;
+
+    for (;;)
+    {
+	lisp_object_t *obj;
+	long pos;
+	int more;
+
+	more = lisp_skip_space(stream);
+	pos = lisp_stream_tell(stream);
+	*stop = pos;
+	if (!more || (end >= 0 && pos >= end))
+	    return LISP_CHUNK_OK;
+
+	if (is_chunk)
+	    obj = lisp_read_skipping_with_allocator(allocator, stream, skip_too_deep, &too_deep);
+	else
+	    obj = lisp_read_with_allocator(allocator, stream);
+	if (lisp_type(obj) == LISP_TYPE_PARSE_ERROR || lisp_type(obj) == LISP_TYPE_EOF)
+	    return LISP_CHUNK_PARSE_ERROR;
+	if (too_deep)
+	    return LISP_CHUNK_REREAD;
+
+	form(obj, data);
+    }
+}
+
+static int
+read_range (allocator_t *allocator, const char *buf, size_t length, long start, long end,
+	    const lisp_chunk_funcs_t *funcs, void *data, long *stop)
+{
+    lisp_stream_t stream;
+
+    lisp_stream_init_buffer(&stream, buf, length);
+    lisp_stream_seek(&stream, start);
+
+    return lisp_chunks_read(allocator, &stream, end, 0, funcs->form, data, stop);
+}
+
+/* Walks the chunks of the buffer in order, taking those which were
+   read from the start of an expression and reading the text of the
+   others again with allocator.  Returns the status of the first parse
+   error, if any, and stores its offset in error. */
+int
+lisp_chunks_merge (const char *buf, size_t length, lisp_chunk_t *chunks, int num_chunks,
+		   allocator_t *allocator, const lisp_chunk_funcs_t *funcs, void *data, long *error)
+{
+    long expected = 0;
+    int status = LISP_CHUNK_OK;
+    int i = 0;
+
+    while (status == LISP_CHUNK_OK && expected < (long)length)
+    {
+	lisp_chunk_t *chunk = i < num_chunks ? &chunks[i] : 0;
+
+	if (chunk != 0 && funcs->wait != 0)
+	    funcs->wait(i, data);
+
+	if (chunk != 0 && chunk->start < expected)
+	{
+	    /* the previous expression reaches into the chunk */
+	    if (funcs->release != 0)
+		funcs->release(i, data);
+	    ++i;
+	}
+	else if (chunk != 0 && chunk->start == expected && chunk->status != LISP_CHUNK_REREAD)
+	{
+	    /* the chunk was read from the start of an expression, so its
+	       forms are right and a parse error in it is real */
+	    funcs->take(i, data);
+	    status = chunk->status;
+	    *error = chunk->stop;
+	    expected = chunk->stop;
+	    if (funcs->release != 0)
+		funcs->release(i, data);
+	    ++i;
+	}
+	else
+	{
+	    /* the text up to the next chunk was not read from the start
+	       of an expression, or too deeply nested, so it is read
+	       again */
+	    long end = chunk == 0 ? (long)length : chunk->start > expected ? chunk->start : chunk->end;
+
+	    status = read_range(allocator, buf, length, expected, end, funcs, data, &expected);
+	    *error = expected;
+	}
+    }
+
+    return status;
+}
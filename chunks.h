@@ -0,0 +1,77 @@
+/*
+ * chunks.h
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Splitting large buffers into chunks which are read in parallel, as
+   done by lisp_load_many and lispgrep.  This interface is internal and
+   may change. */
+
+#ifndef __CHUNKS_H__
+#define __CHUNKS_H__
+
+#include "lispreader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LISP_CHUNK_SIZE           (1024 * 1024)
+
+#define LISP_CHUNK_OK             0
+#define LISP_CHUNK_PARSE_ERROR    1
+/* the chunk's lists are nested too deeply, or it was not read at all,
+   so its text must be read again */
+#define LISP_CHUNK_REREAD         2
+
+typedef struct
+{
+    long start;
+    long end;			/* the start of the next chunk */
+    long stop;			/* where the first expression at or after end
+				   starts, or the broken one on a parse error */
+    int status;
+} lisp_chunk_t;
+
+typedef struct
+{
+    /* called for each expression of the text which is read again */
+    void (*form) (lisp_object_t *obj, void *data);
+    /* called before a chunk is looked at, may be null */
+    void (*wait) (int index, void *data);
+    /* called for a chunk which was read from the start of an
+       expression, and whose forms therefore follow the previous ones */
+    void (*take) (int index, void *data);
+    /* called once a chunk is done with, may be null */
+    void (*release) (int index, void *data);
+} lisp_chunk_funcs_t;
+
+int lisp_chunks_split (const char *buf, size_t length, lisp_chunk_t **chunks);
+int lisp_chunks_read (allocator_t *allocator, lisp_stream_t *stream, long end, int is_chunk,
+		      void (*form) (lisp_object_t *obj, void *data), void *data, long *stop);
+int lisp_chunks_merge (const char *buf, size_t length, lisp_chunk_t *chunks, int num_chunks,
+		       allocator_t *allocator, const lisp_chunk_funcs_t *funcs, void *data, long *error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,428 @@
+/*
+ * compress.c
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <assert.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <lispreader.h>
+
+/* Compressed streams are block streams whose blocks are decompressed
+   by a helper thread.  While the reader works on one block, the thread
+   fills the other. */
+
+#define BLOCK_SIZE         (256 * 1024)
+#define INPUT_SIZE         (128 * 1024)
+#define NUM_BLOCKS         2
+
+#define FORMAT_PLAIN       0
+#define FORMAT_GZIP        1
+#define FORMAT_ZSTD        2
+
+typedef struct
+{
+    int fd;
+    int close_fd;
+    int format;
+
+    char *input;
+    size_t input_pos;
+    size_t input_length;
+    int input_eof;
+    int in_stream;		/* a gzip member or zstd frame is not complete */
+    int failed;
+
+#ifdef HAVE_ZLIB
+    z_stream zlib;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+
+    char *blocks[NUM_BLOCKS];
+    size_t lengths[NUM_BLOCKS];
+    int head;			/* the next block to fill */
+    int tail;			/* the next block to read */
+    int num_full;
+    int reader_holds_block;	/* the block before tail is still being read */
+    int done;
+    int stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} compressed_t;
+
+/* Appends what can be read at once to the unread input.  Returns 0 on
+   a read error. */
+static int
+read_input (compressed_t *c)
+{
+    ssize_t length;
+
+    if (c->input_pos == c->input_length)
+	c->input_pos = c->input_length = 0;
+
+    do
+	length = read(c->fd, c->input + c->input_length, INPUT_SIZE - c->input_length);
+    while (length == -1 && errno == EINTR);
+
+    if (length < 0)
+	return 0;
+
+    c->input_length += length;
+    c->input_eof = length == 0;
+
+    return 1;
+}
+
+/* Decompresses at most size bytes into buf and returns their number.
+   At the end of the data, and after an error, which ends the stream,
+   the result is 0.  Input which ends in the middle of a gzip member or
+   zstd frame is an error. */
+static size_t
+decompress (compressed_t *c, char *buf, size_t size)
+{
+    size_t length = 0;
+
+    while (length < size && !c->failed)
+    {
+	size_t old_pos, old_length = length;
+
+	if (c->input_pos == c->input_length && !c->input_eof && !read_input(c))
+	{
+	    c->failed = 1;
+	    break;
+	}
+	/* the decompressor may still hold output without more input */
+	if (c->input_pos == c->input_length && !c->in_stream)
+	    break;
+	old_pos = c->input_pos;
+
+	switch (c->format)
+	{
+	    case FORMAT_PLAIN :
+	    {
+		size_t n = c->input_length - c->input_pos;
+
+		if (n > size - length)
+		    n = size - length;
+		memcpy(buf + length, c->input + c->input_pos, n);
+		c->input_pos += n;
+		length += n;
+		break;
+	    }
+
+#ifdef HAVE_ZLIB
+	    case FORMAT_GZIP :
+	    {
+		int result;
+
+		c->zlib.next_in = (Bytef*)c->input + c->input_pos;
+		c->zlib.avail_in = c->input_length - c->input_pos;
+		c->zlib.next_out = (Bytef*)buf + length;
+		c->zlib.avail_out = size - length;
+
+		result = inflate(&c->zlib, Z_NO_FLUSH);
+
+		c->input_pos = c->input_length - c->zlib.avail_in;
+		length = size - c->zlib.avail_out;
+
+		/* concatenated gzip files are one stream */
+		if (result == Z_STREAM_END)
+		{
+		    inflateReset(&c->zlib);
+		    c->in_stream = 0;
+		}
+		else if (result == Z_OK || result == Z_BUF_ERROR)
+		    c->in_stream = 1;
+		else
+		    c->failed = 1;
+		break;
+	    }
+#endif
+
+#ifdef HAVE_ZSTD
+	    case FORMAT_ZSTD :
+	    {
+		ZSTD_inBuffer in = { c->input, c->input_length, c->input_pos };
+		ZSTD_outBuffer out = { buf, size, length };
+		size_t result = ZSTD_decompressStream(c->zstd, &out, &in);
+
+		/* 0 means that a frame is complete */
+		if (ZSTD_isError(result))
+		    c->failed = 1;
+		else
+		    c->in_stream = result != 0;
+
+		c->input_pos = in.pos;
+		length = out.pos;
+		break;
+	    }
+#endif
+
+	    default :
+		assert(0);
+	}
+
+	/* the input ended before the member or frame */
+	if (c->in_stream && c->input_eof && c->input_pos == c->input_length
+	    && c->input_pos == old_pos && length == old_length)
+	    c->failed = 1;
+    }
+
+    return length;
+}
+
+static void*
+decompress_blocks (void *data)
+{
+    compressed_t *c = (compressed_t*)data;
+
+    for (;;)
+    {
+	size_t length;
+	int block;
+
+	pthread_mutex_lock(&c->lock);
+	while (!c->stop && c->num_full + c->reader_holds_block == NUM_BLOCKS)
+	    pthread_cond_wait(&c->cond, &c->lock);
+	block = c->head;
+	if (c->stop)
+	{
+	    pthread_mutex_unlock(&c->lock);
+	    return 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	length = decompress(c, c->blocks[block], BLOCK_SIZE);
+
+	pthread_mutex_lock(&c->lock);
+	if (length > 0)
+	{
+	    c->lengths[block] = length;
+	    c->head = (block + 1) % NUM_BLOCKS;
+	    ++c->num_full;
+	}
+	else
+	    c->done = 1;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+
+	if (length == 0)
+	    return 0;
+    }
+}
+
+static int
+compressed_fill (void *data, char **buf, size_t *length)
+{
+    compressed_t *c = (compressed_t*)data;
+    int block;
+
+    pthread_mutex_lock(&c->lock);
+
+    if (c->reader_holds_block)
+    {
+	c->reader_holds_block = 0;
+	pthread_cond_broadcast(&c->cond);
+    }
+
+    while (c->num_full == 0 && !c->done)
+	pthread_cond_wait(&c->cond, &c->lock);
+
+    if (c->num_full == 0)
+    {
+	int failed = c->failed;
+
+	pthread_mutex_unlock(&c->lock);
+	return failed ? -1 : 0;
+    }
+
+    block = c->tail;
+    c->tail = (block + 1) % NUM_BLOCKS;
+    --c->num_full;
+    c->reader_holds_block = 1;
+
+    pthread_mutex_unlock(&c->lock);
+
+    *buf = c->blocks[block];
+    *length = c->lengths[block];
+
+    return 1;
+}
+
+static void
+compressed_free (compressed_t *c)
+{
+    int i;
+
+#ifdef HAVE_ZLIB
+    if (c->format == FORMAT_GZIP)
+	inflateEnd(&c->zlib);
+#endif
+#ifdef HAVE_ZSTD
+    if (c->format == FORMAT_ZSTD)
+	ZSTD_freeDCtx(c->zstd);
+#endif
+
+    for (i = 0; i < NUM_BLOCKS; ++i)
+	free(c->blocks[i]);
+    free(c->input);
+
+    if (c->close_fd)
+	close(c->fd);
+
+    free(c);
+}
+
+static void
+compressed_close (void *data)
+{
+    compressed_t *c = (compressed_t*)data;
+
+    pthread_mutex_lock(&c->lock);
+    c->stop = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+
+    pthread_join(c->thread, 0);
+
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+
+    compressed_free(c);
+}
+
+static lisp_stream_t*
+init_compressed (lisp_stream_t *stream, int fd, int close_fd)
+{
+    compressed_t *c = (compressed_t*)malloc(sizeof(compressed_t));
+    const unsigned char *magic;
+    int i;
+
+    if (c == 0)
+	return 0;
+
+    memset(c, 0, sizeof(compressed_t));
+    c->fd = fd;
+    c->close_fd = close_fd;
+    c->format = FORMAT_PLAIN;
+
+    c->input = (char*)malloc(INPUT_SIZE);
+    for (i = 0; i < NUM_BLOCKS; ++i)
+	c->blocks[i] = (char*)malloc(BLOCK_SIZE);
+    if (c->input == 0 || c->blocks[0] == 0 || c->blocks[1] == 0)
+	goto error;
+
+    /* the format is recognized by the first bytes */
+    while (c->input_length < 4 && !c->input_eof)
+	if (!read_input(c))
+	    goto error;
+    magic = (const unsigned char*)c->input;
+
+    if (c->input_length >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    {
+#ifdef HAVE_ZLIB
+	/* 32 makes zlib accept gzip headers */
+	if (inflateInit2(&c->zlib, 15 + 32) != Z_OK)
+	    goto error;
+	c->format = FORMAT_GZIP;
+#else
+	goto error;
+#endif
+    }
+    else if (c->input_length >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+    {
+#ifdef HAVE_ZSTD
+	c->zstd = ZSTD_createDCtx();
+	if (c->zstd == 0)
+	    goto error;
+	c->format = FORMAT_ZSTD;
+#else
+	goto error;
+#endif
+    }
+
+    pthread_mutex_init(&c->lock, 0);
+    pthread_cond_init(&c->cond, 0);
+
+    if (pthread_create(&c->thread, 0, decompress_blocks, c) != 0)
+    {
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	goto error;
+    }
+
+    return lisp_stream_init_blocks(stream, c, compressed_fill, compressed_close);
+
+ error:
+    compressed_free(c);
+
+    return 0;
+}
+
+lisp_stream_t*
+lisp_stream_init_compressed_path (lisp_stream_t *stream, const char *path)
+{
+    int fd = open(path, O_RDONLY, 0);
+
+    if (fd == -1)
+	return 0;
+
+    return init_compressed(stream, fd, 1);
+}
+
+lisp_stream_t*
+lisp_stream_init_compressed_fd (lisp_stream_t *stream, int fd)
+{
+    return init_compressed(stream, fd, 0);
+}
+
+static int
+has_suffix (const char *path, const char *suffix)
+{
+    size_t length = strlen(path), suffix_length = strlen(suffix);
+
+    return length >= suffix_length && strcmp(path + length - suffix_length, suffix) == 0;
+}
+
+lisp_stream_t*
+lisp_stream_init_input_path (lisp_stream_t *stream, const char *path)
+{
+    if (has_suffix(path, ".gz") || has_suffix(path, ".zst"))
+	return lisp_stream_init_compressed_path(stream, path);
+
+    return lisp_stream_init_path(stream, path);
+}
@@ -0,0 +1,432 @@
+/*
+ * formindex.c
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <formindex.h>
+#include <pools.h>
+
+/* An index file consists of the header, the key spec padded to a
+   multiple of 8 bytes, the offsets of all forms and, if there is a
+   key spec, the key hashes sorted by hash.  All numbers are stored
+   in host byte order. */
+
+#define INDEX_MAGIC      "LRINDEX1"
+
+typedef struct
+{
+    char magic[8];
+    uint64_t num_forms;
+    uint64_t data_size;
+    int64_t data_mtime;
+    uint64_t key_spec_length;
+} index_header_t;
+
+typedef struct
+{
+    uint64_t hash;
+    uint64_t number;
+} index_key_t;
+
+struct _lisp_index_t
+{
+    index_header_t header;
+    char *key_spec;
+    lisp_path_t *key_path;
+    uint64_t *offsets;
+    index_key_t *keys;
+
+    /* if the index was loaded from a file, all the data above lives
+       in this buffer */
+    void *buf;
+    size_t buf_size;
+    int is_mapped;
+};
+
+#define PADDED(n)        (((n) + 7) & ~(size_t)7)
+
+static lisp_index_t*
+index_new (void)
+{
+    lisp_index_t *index = (lisp_index_t*)malloc(sizeof(lisp_index_t));
+
+    if (index == 0)
+	return 0;
+
+    memset(index, 0, sizeof(lisp_index_t));
+    memcpy(index->header.magic, INDEX_MAGIC, 8);
+
+    return index;
+}
+
+static int
+compare_keys (const void *_a, const void *_b)
+{
+    const index_key_t *a = (const index_key_t*)_a, *b = (const index_key_t*)_b;
+
+    if (a->hash != b->hash)
+	return a->hash < b->hash ? -1 : 1;
+    if (a->number != b->number)
+	return a->number < b->number ? -1 : 1;
+    return 0;
+}
+
+lisp_index_t*
+lisp_index_build (const char *data_path, const char *key_spec)
+{
+    lisp_index_t *index;
+    lisp_stream_t stream;
+    struct stat sb;
+    pools_t pools;
+    allocator_t allocator;
+    size_t size = 0;
+    int ok = 1;
+
+    if (stat(data_path, &sb) == -1)
+	return 0;
+
+    index = index_new();
+    if (index == 0)
+	return 0;
+
+    index->header.data_size = sb.st_size;
+    index->header.data_mtime = sb.st_mtime;
+
+    /* a blank key spec has no steps, so there are no keys */
+    if (key_spec != 0 && key_spec[strspn(key_spec, " \t\n\r\f\v")] == '\0')
+	key_spec = 0;
+
+    if (key_spec != 0)
+    {
+	index->header.key_spec_length = strlen(key_spec);
+	index->key_spec = strdup(key_spec);
+	index->key_path = lisp_path_compile(key_spec);
+	if (index->key_spec == 0 || index->key_path == 0)
+	{
+	    lisp_index_free(index);
+	    return 0;
+	}
+    }
+
+    if (lisp_stream_init_path(&stream, data_path) == 0)
+    {
+	lisp_index_free(index);
+	return 0;
+    }
+
+    if (!init_pools(&pools))
+    {
+	lisp_stream_free_path(&stream);
+	lisp_index_free(index);
+	return 0;
+    }
+    init_pools_allocator(&allocator, &pools);
+
+    while (lisp_skip_space(&stream))
+    {
+	uint64_t n = index->header.num_forms;
+
+	if (n == size)
+	{
+	    uint64_t *offsets;
+
+	    size = size == 0 ? 1024 : size * 2;
+	    offsets = (uint64_t*)realloc(index->offsets, size * sizeof(uint64_t));
+	    if (offsets == 0)
+	    {
+		ok = 0;
+		break;
+	    }
+	    index->offsets = offsets;
+
+	    if (index->key_path != 0)
+	    {
+		index_key_t *keys = (index_key_t*)realloc(index->keys, size * sizeof(index_key_t));
+
+		if (keys == 0)
+		{
+		    ok = 0;
+		    break;
+		}
+		index->keys = keys;
+	    }
+	}
+
+	index->offsets[n] = lisp_stream_tell(&stream);
+
+	if (index->key_path != 0)
+	{
+	    lisp_object_t *key;
+
+	    reset_pools(&pools);
+	    key = lisp_read_path_with_allocator(&allocator, &stream, index->key_path);
+	    if (lisp_type(key) == LISP_TYPE_PARSE_ERROR || lisp_type(key) == LISP_TYPE_EOF)
+	    {
+		ok = 0;
+		break;
+	    }
+
+	    index->keys[n].hash = lisp_hash(key);
+	    index->keys[n].number = n;
+	}
+	else if (lisp_skip(&stream) <= 0)
+	{
+	    ok = 0;
+	    break;
+	}
+
+	++index->header.num_forms;
+    }
+
+    free_pools(&pools);
+    lisp_stream_free_path(&stream);
+
+    if (!ok)
+    {
+	lisp_index_free(index);
+	return 0;
+    }
+
+    if (index->keys != 0)
+	qsort(index->keys, index->header.num_forms, sizeof(index_key_t), compare_keys);
+
+    return index;
+}
+
+int
+lisp_index_write (lisp_index_t *index, const char *path)
+{
+    static const char padding[8];
+    size_t spec_length = index->header.key_spec_length;
+    size_t n = index->header.num_forms;
+    FILE *out;
+    int ok;
+
+    out = fopen(path, "wb");
+    if (out == 0)
+	return 0;
+
+    ok = fwrite(&index->header, sizeof(index_header_t), 1, out) == 1
+	&& fwrite(index->key_spec, 1, spec_length, out) == spec_length
+	&& fwrite(padding, 1, PADDED(spec_length) - spec_length, out) == PADDED(spec_length) - spec_length
+	&& (n == 0 || fwrite(index->offsets, sizeof(uint64_t), n, out) == n)
+	&& (index->keys == 0 || n == 0 || fwrite(index->keys, sizeof(index_key_t), n, out) == n);
+
+    if (fclose(out) != 0)
+	ok = 0;
+
+    return ok;
+}
+
+lisp_index_t*
+lisp_index_load (const char *path)
+{
+    lisp_index_t *index;
+    struct stat sb;
+    size_t spec_length, expected_size;
+    char *p;
+    int fd;
+
+    fd = open(path, O_RDONLY, 0);
+    if (fd == -1)
+	return 0;
+
+    if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(index_header_t)
+	|| (index = index_new()) == 0)
+    {
+	close(fd);
+	return 0;
+    }
+
+    index->buf_size = sb.st_size;
+
+#ifndef __MINGW32__
+    index->buf = mmap(0, index->buf_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (index->buf != (void*)-1)
+	index->is_mapped = 1;
+    else
+#endif
+    {
+	index->buf = malloc(index->buf_size);
+	if (index->buf == 0
+	    || read(fd, index->buf, index->buf_size) != (ssize_t)index->buf_size)
+	{
+	    close(fd);
+	    lisp_index_free(index);
+	    return 0;
+	}
+    }
+
+    close(fd);
+
+    memcpy(&index->header, index->buf, sizeof(index_header_t));
+    spec_length = index->header.key_spec_length;
+
+    expected_size = sizeof(index_header_t) + PADDED(spec_length)
+	+ index->header.num_forms * (sizeof(uint64_t) + (spec_length > 0 ? sizeof(index_key_t) : 0));
+    if (memcmp(index->header.magic, INDEX_MAGIC, 8) != 0 || expected_size != index->buf_size)
+    {
+	lisp_index_free(index);
+	return 0;
+    }
+
+    p = (char*)index->buf + sizeof(index_header_t);
+
+    if (spec_length > 0)
+    {
+	index->key_spec = (char*)malloc(spec_length + 1);
+	if (index->key_spec == 0)
+	{
+	    lisp_index_free(index);
+	    return 0;
+	}
+	memcpy(index->key_spec, p, spec_length);
+	index->key_spec[spec_length] = '\0';
+
+	index->key_path = lisp_path_compile(index->key_spec);
+	if (index->key_path == 0)
+	{
+	    lisp_index_free(index);
+	    return 0;
+	}
+    }
+    p += PADDED(spec_length);
+
+    index->offsets = (uint64_t*)p;
+    p += index->header.num_forms * sizeof(uint64_t);
+
+    if (spec_length > 0)
+	index->keys = (index_key_t*)p;
+
+    return index;
+}
+
+void
+lisp_index_free (lisp_index_t *index)
+{
+    if (index->buf != 0)
+    {
+#ifndef __MINGW32__
+	if (index->is_mapped)
+	    munmap(index->buf, index->buf_size);
+	else
+#endif
+	    free(index->buf);
+    }
+    else
+    {
+	free(index->offsets);
+	free(index->keys);
+    }
+
+    if (index->key_path != 0)
+	lisp_path_free(index->key_path);
+    free(index->key_spec);
+    free(index);
+}
+
+int
+lisp_index_is_current (lisp_index_t *index, const char *data_path)
+{
+    struct stat sb;
+
+    if (stat(data_path, &sb) == -1)
+	return 0;
+
+    return sb.st_size == index->header.data_size
+	&& sb.st_mtime == index->header.data_mtime;
+}
+
+long
+lisp_index_length (lisp_index_t *index)
+{
+    return index->header.num_forms;
+}
+
+long
+lisp_index_offset (lisp_index_t *index, long n)
+{
+    if (n < 0 || n >= index->header.num_forms)
+	return -1;
+
+    return index->offsets[n];
+}
+
+int
+lisp_index_seek (lisp_index_t *index, lisp_stream_t *in, long n)
+{
+    long offset = lisp_index_offset(index, n);
+
+    if (offset < 0)
+	return 0;
+
+    return lisp_stream_seek(in, offset);
+}
+
+long
+lisp_index_find_key (lisp_index_t *index, lisp_stream_t *in, lisp_object_t *key)
+{
+    uint64_t hash = lisp_hash(key);
+    size_t lo = 0, hi = index->header.num_forms;
+
+    if (index->keys == 0)
+	return -1;
+
+    while (lo < hi)
+    {
+	size_t mid = lo + (hi - lo) / 2;
+
+	if (index->keys[mid].hash < hash)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    /* different keys can have the same hash, so we have to check */
+    for (; lo < index->header.num_forms && index->keys[lo].hash == hash; ++lo)
+    {
+	long n = index->keys[lo].number;
+	lisp_object_t *obj;
+	int equal;
+
+	if (!lisp_index_seek(index, in, n))
+	    return -1;
+
+	obj = lisp_read_path(in, index->key_path);
+	equal = lisp_equal(obj, key);
+	lisp_free(obj);
+
+	if (equal)
+	    return lisp_index_seek(index, in, n) ? n : -1;
+    }
+
+    return -1;
+}
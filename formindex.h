@@ -0,0 +1,51 @@
+/*
+ * formindex.h
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __FORMINDEX_H__
+#define __FORMINDEX_H__
+
+#include "lispreader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _lisp_index_t lisp_index_t;
+
+lisp_index_t* lisp_index_build (const char *data_path, const char *key_spec);
+int lisp_index_write (lisp_index_t *index, const char *path);
+lisp_index_t* lisp_index_load (const char *path);
+void lisp_index_free (lisp_index_t *index);
+
+int lisp_index_is_current (lisp_index_t *index, const char *data_path);
+long lisp_index_length (lisp_index_t *index);
+long lisp_index_offset (lisp_index_t *index, long n);
+
+int lisp_index_seek (lisp_index_t *index, lisp_stream_t *in, long n);
+long lisp_index_find_key (lisp_index_t *index, lisp_stream_t *in, lisp_object_t *key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,40 +20,100 @@
  */
 
 #include <stdio.h>
-#include <assert.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <lispreader.h>
 #include <pools.h>
+#include <pipeline.h>
+
+static void
+report_error (long offset, void *data)
+{
+    int *num_errors = (int*)data;
+
+    fprintf(stderr, "parse error at byte %ld\n", offset);
+    ++*num_errors;
+}
+
+static int
+usage (void)
+{
+    fprintf(stderr, "usage: lispcat [--null] [--recover] [--stats] [file]\n");
+    return 1;
+}
+
+static void
+print_stats (void)
+{
+    lisp_stats_t stats;
+    unsigned long long total = 0;
+    int i;
+
+    if (!lisp_get_stats(&stats))
+    {
+	fprintf(stderr, "statistics are not available, compile with -DLISP_PROFILE\n");
+	return;
+    }
+
+    for (i = 0; i < LISP_NUM_PHASES; ++i)
+	total += stats.cycles[i];
+
+    fprintf(stderr, "%llu bytes, %llu expressions, %llu cycles\n", stats.bytes, stats.calls, total);
+
+    fprintf(stderr, "\ncycles by phase:\n");
+    for (i = 0; i < LISP_NUM_PHASES; ++i)
+	fprintf(stderr, "  %-20s %15llu %5.1f%%\n", lisp_stats_phase_name(i), stats.cycles[i],
+		total > 0 ? 100.0 * stats.cycles[i] / total : 0.0);
+
+    fprintf(stderr, "\ntokens:\n");
+    for (i = 0; i < LISP_STATS_NUM_TOKENS; ++i)
+	if (stats.tokens[i] > 0)
+	    fprintf(stderr, "  %-20s %15llu\n", lisp_stats_token_name(i), stats.tokens[i]);
+
+    fprintf(stderr, "\ncycles per expression:\n");
+    for (i = 0; i < LISP_STATS_LATENCY_BUCKETS; ++i)
+	if (stats.latency[i] > 0)
+	    fprintf(stderr, "  < 2^%-2d %15llu\n", i + 1, stats.latency[i]);
+}
 
 int 
 main (int argc, char *argv[])
 {
     lisp_object_t *obj;
     lisp_stream_t stream;
+    lisp_pipeline_t *pipeline = 0;
     pools_t pools;
     allocator_t allocator;
+    int arena;
     int do_dump = 1;
+    int recover = 0;
+    int stats = 0;
+    int num_errors = 0;
     char *filename = 0;
+    int i;
 
-    assert(argc == 1 || argc == 2 || argc == 3);
-
-    if (argc > 1 && strcmp(argv[1], "--null") == 0)
+    for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; ++i)
     {
-	do_dump = 0;
-	if (argc > 2)
-	    filename = argv[2];
-    }
-    else
-    {
-	assert(argc < 3);
-	if (argc == 2)
-	    filename = argv[1];
+	if (strcmp(argv[i], "--null") == 0)
+	    do_dump = 0;
+	else if (strcmp(argv[i], "--recover") == 0)
+	    recover = 1;
+	else if (strcmp(argv[i], "--stats") == 0)
+	    stats = 1;
+	else
+	    return usage();
     }
 
+    if (i < argc)
+	filename = argv[i++];
+    if (i < argc)
+	return usage();
+
     if (filename == 0)
     {
-	if (lisp_stream_init_file(&stream, stdin) == 0)
+	/* also decompresses gzip and zstd input */
+	if (lisp_stream_init_compressed_fd(&stream, 0) == 0)
 	{
 	    fprintf(stderr, "could not init file stream\n");
 	    return 1;
@@ -61,20 +121,37 @@ main (int argc, char *argv[])
     }
     else
     {
-	if (lisp_stream_init_path(&stream, filename) == 0)
+	/* gzip and zstd files are recognized by their suffix */
+	if (lisp_stream_init_input_path(&stream, filename) == 0)
 	{
 	    fprintf(stderr, "could not init path stream\n");
 	    return 1;
 	}
     }
 
-    init_pools(&pools);
-    init_pools_allocator(&allocator, &pools);
+    /* with more than one processor, parsing runs in a thread of its
+       own while the expressions are printed, but statistics are
+       only collected for the reading thread */
+    if (!recover && !stats && sysconf(_SC_NPROCESSORS_ONLN) > 1)
+	pipeline = lisp_pipeline_new(&stream, 4, 256);
+    if (pipeline == 0)
+    {
+	init_pools(&pools);
+	init_pools_allocator(&allocator, &pools);
+    }
 
     for (;;)
     {
-	reset_pools(&pools);
-	obj = lisp_read_with_allocator(&allocator, &stream);
+	if (pipeline != 0)
+	    obj = lisp_pipeline_next(pipeline, &arena);
+	else
+	{
+	    reset_pools(&pools);
+	    if (recover)
+		obj = lisp_read_recovering_with_allocator(&allocator, &stream, report_error, &num_errors);
+	    else
+		obj = lisp_read_with_allocator(&allocator, &stream);
+	}
 
 	switch (lisp_type(obj))
 	{
@@ -83,7 +160,11 @@ main (int argc, char *argv[])
 
 	    case LISP_TYPE_PARSE_ERROR :
 		fprintf(stderr, "parse error\n");
-		return 1;
+		++num_errors;
+		/* the pipeline and the stream are freed as at the end */
+		if (pipeline != 0)
+		    lisp_pipeline_release(pipeline, arena);
+		goto done;
 
 	    default :
 		if (do_dump)
@@ -91,14 +172,21 @@ main (int argc, char *argv[])
 		    lisp_dump(obj, stdout);
 		    fputc('\n', stdout);
 		}
+		if (pipeline != 0)
+		    lisp_pipeline_release(pipeline, arena);
 	}
     }
 
  done:
-    free_pools(&pools);
+    if (pipeline != 0)
+	lisp_pipeline_free(pipeline);
+    else
+	free_pools(&pools);
+
+    lisp_stream_free_path(&stream);
 
-    if (filename != 0)
-	lisp_stream_free_path(&stream);
+    if (stats)
+	print_stats();
 
-    return 0;
+    return num_errors > 0;
 }
@@ -0,0 +1,483 @@
+/*
+ * lispgrep.c
+ *
+ * Copyright (C) 2026 Mark Probst <schani@complang.tuwien.ac.at>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <lispreader.h>
+#include <pools.h>
+#include <chunks.h>
+
+/* Large memory mapped files are split into chunks like in
+   lisp_load_many (see chunks.c): each chunk is filtered by one of the
+   worker threads into a buffer of its own.  The main thread prints the
+   buffers in order, and filters again, by itself, the text of chunks
+   which turn out not to start at a top-level expression. */
+
+/* chunks per worker which may be filtered ahead of the printed one */
+#define CHUNKS_AHEAD        4
+
+typedef struct
+{
+    lisp_object_t *pattern;
+    int num_subs;
+    int invert;
+    int count_only;
+    int *extract;		/* the variables to print instead of the expression */
+    int num_extract;
+} grep_t;
+
+/* The state of one thread filtering expressions. */
+typedef struct
+{
+    grep_t *grep;
+    pools_t pools;
+    allocator_t allocator;
+    lisp_object_t **vars;
+    const char *prefix;
+    FILE *out;
+    long count;
+} matcher_t;
+
+/* The output of a chunk filtered by a worker. */
+typedef struct
+{
+    long count;
+    char *output;
+    size_t output_length;
+    int done;
+} output_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;	/* a chunk was filtered */
+    pthread_cond_t space;	/* chunks were queued or printed */
+    grep_t *grep;
+    const char *buf;
+    size_t length;
+    const char *prefix;
+    lisp_chunk_t *chunks;
+    output_t *outputs;
+    int num_chunks;
+    int next;			/* the next chunk to be filtered */
+    int printed;		/* the number of chunks printed */
+    int ahead;
+    int quit;
+    matcher_t *matcher;		/* filters the text of misaligned chunks */
+} queue_t;
+
+static int
+usage (void)
+{
+    fprintf(stderr,
+	    "usage: lispgrep [--count] [--invert] [--extract N]... [--jobs N] PATTERN [file]...\n");
+    return 2;
+}
+
+static void
+init_matcher (matcher_t *matcher, grep_t *grep, FILE *out)
+{
+    matcher->grep = grep;
+    init_pools(&matcher->pools);
+    init_pools_allocator(&matcher->allocator, &matcher->pools);
+    matcher->vars = (lisp_object_t**)malloc((grep->num_subs + 1) * sizeof(lisp_object_t*));
+    matcher->prefix = 0;
+    matcher->out = out;
+    matcher->count = 0;
+}
+
+static void
+free_matcher (matcher_t *matcher)
+{
+    free(matcher->vars);
+    free_pools(&matcher->pools);
+}
+
+static void
+match_form (lisp_object_t *obj, void *data)
+{
+    matcher_t *matcher = (matcher_t*)data;
+    grep_t *grep = matcher->grep;
+    int i;
+
+    if (lisp_match_pattern(grep->pattern, obj, matcher->vars, grep->num_subs) == grep->invert)
+    {
+	reset_pools(&matcher->pools);
+	return;
+    }
+
+    ++matcher->count;
+    if (grep->count_only)
+    {
+	reset_pools(&matcher->pools);
+	return;
+    }
+
+    if (matcher->prefix != 0)
+	fprintf(matcher->out, "%s:", matcher->prefix);
+    if (grep->num_extract == 0)
+	lisp_dump(obj, matcher->out);
+    else
+	for (i = 0; i < grep->num_extract; ++i)
+	{
+	    if (i > 0)
+		fputc(' ', matcher->out);
+	    lisp_dump(matcher->vars[grep->extract[i]], matcher->out);
+	}
+    fputc('\n', matcher->out);
+
+    reset_pools(&matcher->pools);
+}
+
+static void
+filter_chunk (matcher_t *matcher, queue_t *queue, int index)
+{
+    lisp_chunk_t *chunk = &queue->chunks[index];
+    output_t *output = &queue->outputs[index];
+    lisp_stream_t stream;
+
+    matcher->out = open_memstream(&output->output, &output->output_length);
+    if (matcher->out == 0)
+    {
+	/* the main thread filters the chunk again */
+	output->output = 0;
+	chunk->status = LISP_CHUNK_REREAD;
+	return;
+    }
+
+    matcher->prefix = queue->prefix;
+    matcher->count = 0;
+    lisp_stream_init_buffer(&stream, queue->buf, queue->length);
+    lisp_stream_seek(&stream, chunk->start);
+    chunk->status = lisp_chunks_read(&matcher->allocator, &stream, chunk->end, 1,
+				     match_form, matcher, &chunk->stop);
+    output->count = matcher->count;
+
+    fclose(matcher->out);
+    matcher->out = 0;
+}
+
+static void*
+grep_worker (void *data)
+{
+    queue_t *queue = (queue_t*)data;
+    matcher_t matcher;
+
+    init_matcher(&matcher, queue->grep, 0);
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;)
+    {
+	int index;
+
+	while (!queue->quit
+	       && (queue->next >= queue->num_chunks || queue->next >= queue->printed + queue->ahead))
+	    pthread_cond_wait(&queue->space, &queue->lock);
+	if (queue->quit)
+	    break;
+
+	index = queue->next++;
+	pthread_mutex_unlock(&queue->lock);
+
+	filter_chunk(&matcher, queue, index);
+
+	pthread_mutex_lock(&queue->lock);
+	queue->outputs[index].done = 1;
+	pthread_cond_broadcast(&queue->done);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    free_matcher(&matcher);
+
+    return 0;
+}
+
+static void
+wait_chunk (int index, void *data)
+{
+    queue_t *queue = (queue_t*)data;
+
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->outputs[index].done)
+	pthread_cond_wait(&queue->done, &queue->lock);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void
+print_chunk (int index, void *data)
+{
+    queue_t *queue = (queue_t*)data;
+    output_t *output = &queue->outputs[index];
+
+    fwrite(output->output, 1, output->output_length, stdout);
+    queue->matcher->count += output->count;
+}
+
+static void
+release_chunk (int index, void *data)
+{
+    queue_t *queue = (queue_t*)data;
+
+    free(queue->outputs[index].output);
+    queue->outputs[index].output = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    ++queue->printed;
+    pthread_cond_broadcast(&queue->space);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void
+match_again (lisp_object_t *obj, void *data)
+{
+    match_form(obj, ((queue_t*)data)->matcher);
+}
+
+static const lisp_chunk_funcs_t grep_funcs = { match_again, wait_chunk, print_chunk, release_chunk };
+
+/* Lets the workers filter the chunks of the buffer and prints their
+   output in order.  Text which was not filtered from the start of an
+   expression is filtered again by matcher, which prints to stdout.
+   Returns the status of the first parse error, if any, and its offset
+   in error. */
+static int
+grep_chunks (queue_t *queue, matcher_t *matcher, const char *buf, size_t length,
+	     lisp_chunk_t *chunks, output_t *outputs, int num_chunks, long *error)
+{
+    int status, i, last;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->buf = buf;
+    queue->length = length;
+    queue->prefix = matcher->prefix;
+    queue->chunks = chunks;
+    queue->outputs = outputs;
+    queue->num_chunks = num_chunks;
+    queue->next = 0;
+    queue->printed = 0;
+    queue->matcher = matcher;
+    pthread_cond_broadcast(&queue->space);
+    pthread_mutex_unlock(&queue->lock);
+
+    status = lisp_chunks_merge(buf, length, chunks, num_chunks, &matcher->allocator, &grep_funcs, queue, error);
+
+    /* no more chunks are handed out, but those being filtered must be
+       waited for */
+    pthread_mutex_lock(&queue->lock);
+    last = queue->next;
+    queue->num_chunks = 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    for (i = 0; i < last; ++i)
+    {
+	wait_chunk(i, queue);
+	free(outputs[i].output);
+    }
+
+    return status;
+}
+
+static int
+grep_file (queue_t *queue, matcher_t *matcher, const char *filename)
+{
+    lisp_stream_t stream;
+    const char *name = filename == 0 ? "(standard input)" : filename;
+    lisp_chunk_t *chunks = 0;
+    output_t *outputs = 0;
+    int num_chunks = 0;
+    int status;
+    long error;
+
+    if (filename == 0)
+    {
+	/* also decompresses gzip and zstd input */
+	if (lisp_stream_init_compressed_fd(&stream, 0) == 0)
+	{
+	    fprintf(stderr, "could not init file stream\n");
+	    return 0;
+	}
+    }
+    else
+    {
+	/* gzip and zstd files are recognized by their suffix */
+	if (lisp_stream_init_input_path(&stream, filename) == 0)
+	{
+	    fprintf(stderr, "%s: could not init path stream\n", filename);
+	    return 0;
+	}
+    }
+
+    if (queue != 0 && stream.type == LISP_STREAM_MMAP_FILE)
+	num_chunks = lisp_chunks_split(stream.v.mmap.buf, stream.v.mmap.end - stream.v.mmap.buf, &chunks);
+    if (num_chunks > 0)
+    {
+	outputs = (output_t*)calloc(num_chunks, sizeof(output_t));
+	if (outputs == 0)
+	{
+	    free(chunks);
+	    num_chunks = 0;
+	}
+    }
+
+    matcher->count = 0;
+    if (num_chunks > 0)
+    {
+	status = grep_chunks(queue, matcher, stream.v.mmap.buf, stream.v.mmap.end - stream.v.mmap.buf,
+			     chunks, outputs, num_chunks, &error);
+	free(outputs);
+	free(chunks);
+    }
+    else
+	status = lisp_chunks_read(&matcher->allocator, &stream, -1, 0, match_form, matcher, &error);
+
+    lisp_stream_free_path(&stream);
+
+    if (matcher->grep->count_only)
+    {
+	if (matcher->prefix != 0)
+	    printf("%s:", matcher->prefix);
+	printf("%ld\n", matcher->count);
+    }
+
+    if (status != LISP_CHUNK_OK)
+    {
+	fflush(stdout);
+	if (error >= 0)
+	    fprintf(stderr, "%s: parse error at byte %ld\n", name, error);
+	else
+	    fprintf(stderr, "%s: parse error\n", name);
+	return 0;
+    }
+
+    return 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+    grep_t grep;
+    queue_t queue;
+    matcher_t matcher;
+    pthread_t *threads = 0;
+    lisp_object_t *pattern;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_files, num_errors = 0;
+    long total = 0;
+    int i, j;
+
+    grep.invert = 0;
+    grep.count_only = 0;
+    grep.extract = (int*)malloc(argc * sizeof(int));
+    grep.num_extract = 0;
+
+    for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; ++i)
+    {
+	if (strcmp(argv[i], "--count") == 0)
+	    grep.count_only = 1;
+	else if (strcmp(argv[i], "--invert") == 0)
+	    grep.invert = 1;
+	else if (strcmp(argv[i], "--extract") == 0 && i + 1 < argc)
+	    grep.extract[grep.num_extract++] = atoi(argv[++i]);
+	else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+	    num_threads = atol(argv[++i]);
+	else
+	    return usage();
+    }
+
+    if (i >= argc || (grep.invert && grep.num_extract > 0))
+	return usage();
+
+    pattern = lisp_read_from_string(argv[i++]);
+    if (lisp_type(pattern) == LISP_TYPE_EOF || lisp_type(pattern) == LISP_TYPE_PARSE_ERROR
+	|| !lisp_compile_pattern(&pattern, &grep.num_subs))
+    {
+	fprintf(stderr, "invalid pattern\n");
+	return 2;
+    }
+    grep.pattern = pattern;
+
+    for (j = 0; j < grep.num_extract; ++j)
+	if (grep.extract[j] < 0 || grep.extract[j] >= grep.num_subs)
+	{
+	    fprintf(stderr, "the pattern has no variable %d\n", grep.extract[j]);
+	    return 2;
+	}
+
+    /* the main thread prints and filters misaligned chunks, so one
+       worker is started per processor */
+    if (num_threads > 1)
+    {
+	pthread_mutex_init(&queue.lock, 0);
+	pthread_cond_init(&queue.done, 0);
+	pthread_cond_init(&queue.space, 0);
+	queue.grep = &grep;
+	queue.num_chunks = 0;
+	queue.next = 0;
+	queue.printed = 0;
+	queue.ahead = CHUNKS_AHEAD * num_threads;
+	queue.quit = 0;
+
+	threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+	for (j = 0; j < num_threads; ++j)
+	    if (pthread_create(&threads[j], 0, grep_worker, &queue) != 0)
+		break;
+	num_threads = j;
+    }
+
+    init_matcher(&matcher, &grep, stdout);
+
+    num_files = argc - i;
+    if (num_files == 0)
+    {
+	if (!grep_file(0, &matcher, 0))
+	    ++num_errors;
+	total += matcher.count;
+    }
+    for (; i < argc; ++i)
+    {
+	matcher.prefix = num_files > 1 ? argv[i] : 0;
+	if (!grep_file(num_threads > 1 ? &queue : 0, &matcher, argv[i]))
+	    ++num_errors;
+	total += matcher.count;
+    }
+
+    if (threads != 0)
+    {
+	pthread_mutex_lock(&queue.lock);
+	queue.quit = 1;
+	pthread_cond_broadcast(&queue.space);
+	pthread_mutex_unlock(&queue.lock);
+
+	for (j = 0; j < num_threads; ++j)
+	    pthread_join(threads[j], 0);
+	free(threads);
+    }
+
+    free_matcher(&matcher);
+    lisp_free(pattern);
+    free(grep.extract);
+
+    return num_errors > 0 ? 2 : total > 0 ? 0 : 1;
+}
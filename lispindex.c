@@ -0,0 +1,164 @@
+/*
+ * lispindex.c
+ *
+ * Copyright (C) 2026 Mark Probst <schani@complang.tuwien.ac.at>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lispreader.h>
+#include <formindex.h>
+
+static void
+usage (void)
+{
+    fprintf(stderr,
+	    "usage: lispindex [--key PATH] FILE      build the index FILE.idx\n"
+	    "       lispindex --nth N FILE           print form N of FILE\n"
+	    "       lispindex --find KEY FILE        print the form of FILE with key KEY\n");
+    exit(1);
+}
+
+static char*
+index_path (const char *filename)
+{
+    char *path = (char*)malloc(strlen(filename) + 5);
+
+    strcpy(path, filename);
+    strcat(path, ".idx");
+
+    return path;
+}
+
+static int
+build (const char *filename, const char *key_spec)
+{
+    lisp_index_t *index;
+    char *path;
+    int ok;
+
+    index = lisp_index_build(filename, key_spec);
+    if (index == 0)
+    {
+	fprintf(stderr, "could not index %s\n", filename);
+	return 1;
+    }
+
+    path = index_path(filename);
+    ok = lisp_index_write(index, path);
+    if (!ok)
+	fprintf(stderr, "could not write %s\n", path);
+
+    free(path);
+    lisp_index_free(index);
+
+    return ok ? 0 : 1;
+}
+
+static int
+lookup (const char *filename, const char *nth, const char *key_string)
+{
+    lisp_index_t *index;
+    lisp_stream_t stream;
+    lisp_object_t *obj;
+    char *path;
+    long n;
+    int result = 1;
+
+    path = index_path(filename);
+    index = lisp_index_load(path);
+    if (index == 0)
+    {
+	fprintf(stderr, "could not load %s\n", path);
+	free(path);
+	return 1;
+    }
+    free(path);
+
+    if (!lisp_index_is_current(index, filename))
+	fprintf(stderr, "warning: index of %s is out of date\n", filename);
+
+    if (lisp_stream_init_path(&stream, filename) == 0)
+    {
+	fprintf(stderr, "could not init path stream\n");
+	lisp_index_free(index);
+	return 1;
+    }
+
+    if (nth != 0)
+    {
+	n = atol(nth);
+	if (!lisp_index_seek(index, &stream, n))
+	    n = -1;
+    }
+    else
+    {
+	lisp_object_t *key = lisp_read_from_string(key_string);
+
+	if (lisp_type(key) == LISP_TYPE_EOF || lisp_type(key) == LISP_TYPE_PARSE_ERROR)
+	{
+	    fprintf(stderr, "could not parse key\n");
+	    n = -1;
+	}
+	else
+	    n = lisp_index_find_key(index, &stream, key);
+	lisp_free(key);
+    }
+
+    if (n >= 0)
+    {
+	obj = lisp_read(&stream);
+	if (lisp_type(obj) == LISP_TYPE_PARSE_ERROR)
+	    fprintf(stderr, "parse error\n");
+	else
+	{
+	    lisp_dump(obj, stdout);
+	    fputc('\n', stdout);
+	    result = 0;
+	}
+	lisp_free(obj);
+    }
+    else
+	fprintf(stderr, "not found\n");
+
+    lisp_stream_free_path(&stream);
+    lisp_index_free(index);
+
+    return result;
+}
+
+int
+main (int argc, char *argv[])
+{
+    if (argc == 2)
+	return build(argv[1], 0);
+    if (argc != 4)
+	usage();
+
+    if (strcmp(argv[1], "--key") == 0)
+	return build(argv[3], argv[2]);
+    if (strcmp(argv[1], "--nth") == 0)
+	return lookup(argv[3], argv[2], 0);
+    if (strcmp(argv[1], "--find") == 0)
+	return lookup(argv[3], 0, argv[2]);
+
+    usage();
+    return 1;
+}
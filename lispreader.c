@@ -25,10 +25,10 @@
 #include <sys/mman.h>
 #endif
 #include <unistd.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
 #include <assert.h>
 
 #include <glib.h>
@@ -48,48 +48,191 @@
 #define TOKEN_TRUE                    9
 #define TOKEN_FALSE                   10
 
-#define MAX_TOKEN_LENGTH           8192
+#define MIN_TOKEN_CAPACITY         256
 
-static char token_string[MAX_TOKEN_LENGTH + 1] = "";
-static int token_length = 0;
+/* the scanner state is per thread, so that threads can read in parallel */
+static __thread char *token_string = 0;
+static __thread size_t token_length = 0, token_capacity = 0;
 
-static char *mmap_token_start, *mmap_token_stop;
+static __thread char *mmap_token_start, *mmap_token_stop;
+/* the first character of the last token of a memory mapped stream */
+static __thread char *mmap_token_begin;
+
+/* frees a thread's token buffer when the thread exits */
+static GPrivate token_buffer_key = G_PRIVATE_INIT(g_free);
+
+static size_t max_token_length = LISP_DEFAULT_MAX_TOKEN_LENGTH;
 
 static lisp_object_t end_marker = { LISP_TYPE_EOF };
 static lisp_object_t error_object = { LISP_TYPE_PARSE_ERROR };
 static lisp_object_t close_paren_marker = { LISP_TYPE_PARSE_ERROR };
 static lisp_object_t dot_marker = { LISP_TYPE_PARSE_ERROR };
 
+/* Makes room for a token of the given length plus its terminator.
+   Returns 0 if the token would be longer than the maximum. */
+static int
+_token_reserve (size_t length)
+{
+    size_t capacity;
+
+    if (length > max_token_length)
+	return 0;
+    if (length < token_capacity)
+	return 1;
+
+    capacity = token_capacity < MIN_TOKEN_CAPACITY ? MIN_TOKEN_CAPACITY : token_capacity;
+    while (capacity <= length && capacity * 2 > capacity)
+	capacity *= 2;
+    if (capacity <= length)
+	capacity = length + 1;
+
+    token_string = g_realloc(token_string, capacity);
+    token_capacity = capacity;
+    g_private_set(&token_buffer_key, token_string);
+
+    return 1;
+}
+
 static void
 _token_clear (void)
 {
+    if (token_capacity == 0)
+	_token_reserve(0);
+
     token_string[0] = '\0';
     token_length = 0;
 }
 
-static void
+static inline int
 _token_append (char c)
 {
-    assert(token_length < MAX_TOKEN_LENGTH);
+    if ((token_length + 1 >= token_capacity || token_length >= max_token_length)
+	&& !_token_reserve(token_length + 1))
+	return 0;
 
     token_string[token_length++] = c;
     token_string[token_length] = '\0';
+
+    return 1;
+}
+
+static int
+_token_append_run (const char *start, size_t length)
+{
+    if (length == 0)
+	return 1;
+    if (!_token_reserve(token_length + length))
+	return 0;
+
+    memcpy(token_string + token_length, start, length);
+    token_length += length;
+    token_string[token_length] = '\0';
+
+    return 1;
 }
 
 static void
 copy_mmapped_token (void)
 {
-    token_length = mmap_token_stop - mmap_token_start;
+    _token_clear();
+    /* the scanner has already checked the length against the maximum */
+    _token_append_run(mmap_token_start, mmap_token_stop - mmap_token_start);
+}
 
-    assert(token_length < MAX_TOKEN_LENGTH);
+/* Returns the end of the run of string characters starting at pos,
+   i.e., the position of the first quote or backslash, or end. */
+static inline char*
+_string_run_end (char *pos, char *end)
+{
+    while (pos < end && *pos != '"' && *pos != '\\')
+	++pos;
+    return pos;
+}
 
-    memcpy(token_string, mmap_token_start, token_length);
-    token_string[token_length] = '\0';
+/* whether a block stream ended because its fill function failed */
+#define STREAM_FAILED(s)       ((s)->type == LISP_STREAM_BLOCKS && (s)->v.blocks.failed)
+
+/* states of the bound of a stream */
+#define BOUND_NONE             0
+#define BOUND_LINES            1 /* reading stops before the next line
+				    that starts with an open parenthesis */
+#define BOUND_REACHED          2 /* and has stopped there */
+
+/* Returns the beginning of the first line after pos that starts with
+   an open parenthesis, or end if there is none. */
+static char*
+_next_form_line (char *pos, char *end)
+{
+    while ((pos = memchr(pos, '\n', end - pos)) != 0 && pos + 1 < end && pos[1] != '(')
+	++pos;
+
+    return (pos == 0 || pos + 1 >= end) ? end : pos + 1;
+}
+
+/* Moves on to the next block of a block stream and returns its first
+   character. */
+static int
+_next_block (lisp_stream_t *stream)
+{
+    char *buf;
+    size_t length;
+
+    /* the block has been cut at the bound */
+    if (stream->bound != BOUND_NONE && stream->v.blocks.end < stream->v.blocks.stop)
+    {
+	stream->bound = BOUND_REACHED;
+	return EOF;
+    }
+
+    stream->v.blocks.offset += stream->v.blocks.end - stream->v.blocks.buf;
+    if (stream->v.blocks.end > stream->v.blocks.buf)
+	stream->last_char = (unsigned char)stream->v.blocks.end[-1];
+
+    if (stream->v.blocks.failed)
+	return EOF;
+
+    switch (stream->v.blocks.fill(stream->v.blocks.data, &buf, &length))
+    {
+	case 1 :
+	    break;
+
+	case 0 :
+	    stream->v.blocks.buf = stream->v.blocks.pos = stream->v.blocks.end = 0;
+	    return EOF;
+
+	default :
+	    /* the scanner turns the end of the stream into an error */
+	    stream->v.blocks.buf = stream->v.blocks.pos = stream->v.blocks.end = 0;
+	    stream->v.blocks.failed = 1;
+	    return EOF;
+    }
+
+    assert(length > 0);
+
+    stream->v.blocks.buf = buf;
+    stream->v.blocks.end = buf + length;
+    stream->v.blocks.pos = buf + 1;
+
+    if (stream->bound != BOUND_NONE)
+    {
+	stream->v.blocks.stop = stream->v.blocks.end;
+	if (*buf == '(' && stream->last_char == '\n')
+	{
+	    stream->v.blocks.pos = stream->v.blocks.end = buf;
+	    stream->bound = BOUND_REACHED;
+	    return EOF;
+	}
+	stream->v.blocks.end = _next_form_line(buf, stream->v.blocks.stop);
+    }
+
+    return (unsigned char)*buf;
 }
 
 static int
 _next_char (lisp_stream_t *stream)
 {
+    int c;
+
     switch (stream->type)
     {
 	case LISP_STREAM_MMAP_FILE :
@@ -98,13 +241,40 @@ _next_char (lisp_stream_t *stream)
 	    return EOF;
 
 	case LISP_STREAM_FILE :
-	    return getc(stream->v.file);
+	    c = getc(stream->v.file);
+	    break;
 
         case LISP_STREAM_ANY:
-	    return stream->v.any.next_char(stream->v.any.data);
+	    c = stream->v.any.next_char(stream->v.any.data);
+	    /* the scanner indexes its tables with characters */
+	    if (c != EOF)
+		c = (unsigned char)c;
+	    break;
+
+	case LISP_STREAM_BLOCKS :
+	    if (stream->v.blocks.pos < stream->v.blocks.end)
+		return (unsigned char)*stream->v.blocks.pos++;
+	    return _next_block(stream);
+
+	default :
+	    assert(0);
+	    return EOF;
     }
-    assert(0);
-    return EOF;
+
+    if (c == '(' && stream->last_char == '\n' && stream->bound != BOUND_NONE)
+    {
+	if (stream->type == LISP_STREAM_FILE)
+	    ungetc(c, stream->v.file);
+	else
+	    stream->v.any.unget_char(c, stream->v.any.data);
+	stream->bound = BOUND_REACHED;
+	return EOF;
+    }
+
+    stream->previous_char = stream->last_char;
+    stream->last_char = c;
+
+    return c;
 }
 
 static void
@@ -119,10 +289,19 @@ _unget_char (char c, lisp_stream_t *stream)
 
 	case LISP_STREAM_FILE :
 	    ungetc(c, stream->v.file);
+	    stream->last_char = stream->previous_char;
 	    break;
 
        case LISP_STREAM_ANY:
 	    stream->v.any.unget_char(c, stream->v.any.data);
+	    stream->last_char = stream->previous_char;
+	    break;
+
+	case LISP_STREAM_BLOCKS :
+	    /* only the last character read can be put back, which is
+	       always still in the current block */
+	    if (stream->v.blocks.pos > stream->v.blocks.buf)
+		--stream->v.blocks.pos;
 	    break;
 	 
 	default :
@@ -130,10 +309,50 @@ _unget_char (char c, lisp_stream_t *stream)
     }
 }
 
+/* character classes, indexed by CHAR_CLASS with a character or EOF */
+#define CHAR_SPACE          1
+#define CHAR_DELIMITER      2
+#define CHAR_COMMENT        4
+#define CHAR_DIGIT          8
+#define CHAR_DOT            16
+#define CHAR_NUMBER_START   32
+#define CHAR_END            64
+
+#define CHAR_TERMINATOR     (CHAR_SPACE | CHAR_DELIMITER | CHAR_END)
+#define CHAR_NUMERIC        (CHAR_DIGIT | CHAR_DOT)
+
+#define CHAR_CLASS(c)       (char_classes[(c) + 1])
+
+/* entry 0 is for EOF; characters without a class are symbol
+   constituents */
+static const unsigned char char_classes[1 + 256] = {
+    [0] = CHAR_END,
+    [1 + ' '] = CHAR_SPACE,
+    [1 + '\t'] = CHAR_SPACE,
+    [1 + '\n'] = CHAR_SPACE,
+    [1 + '\v'] = CHAR_SPACE,
+    [1 + '\f'] = CHAR_SPACE,
+    [1 + '\r'] = CHAR_SPACE,
+    [1 + '"'] = CHAR_DELIMITER,
+    [1 + '('] = CHAR_DELIMITER,
+    [1 + ')'] = CHAR_DELIMITER,
+    [1 + ';'] = CHAR_DELIMITER | CHAR_COMMENT,
+    [1 + '0' ... 1 + '9'] = CHAR_DIGIT | CHAR_NUMBER_START,
+    [1 + '-'] = CHAR_NUMBER_START,
+    [1 + '.'] = CHAR_DOT
+};
+
 static int
 my_atoi (const char *start, const char *stop)
 {
     int value = 0;
+    int negative = 0;
+
+    if (start < stop && *start == '-')
+    {
+	negative = 1;
+	++start;
+    }
 
     while (start < stop)
     {
@@ -141,16 +360,21 @@ my_atoi (const char *start, const char *stop)
 	++start;
     }
 
-    return value;
+    return negative ? -value : value;
 }
 
 #define SCAN_FUNC_NAME _scan_mmap
 #define SCAN_DECLS     char *pos = stream->v.mmap.pos, *end = stream->v.mmap.end;
-#define NEXT_CHAR      (pos == end ? EOF : *pos++)
+#define NEXT_CHAR      (pos == end ? EOF : (unsigned char)*pos++)
 #define UNGET_CHAR(c)  (--pos)
+#define TOKEN_BEGIN    (mmap_token_begin = pos - 1)
 #define TOKEN_START(o) (mmap_token_start = pos - (o))
 #define TOKEN_APPEND(c)
-#define TOKEN_STOP     (mmap_token_stop = pos)
+#define TOKEN_STOP     ({ if ((size_t)((mmap_token_stop = pos) - mmap_token_start) > max_token_length) \
+			      RETURN(TOKEN_ERROR); })
+#define END_TOKEN      TOKEN_EOF
+#define STRING_RUN     ({ char *run = pos; pos = _string_run_end(pos, end); \
+			  if (!_token_append_run(run, pos - run)) RETURN(TOKEN_ERROR); })
 #define RETURN(t)      ({ stream->v.mmap.pos = pos ; return (t); })
 
 #include "lispscan.h"
@@ -159,18 +383,28 @@ my_atoi (const char *start, const char *stop)
 #undef SCAN_DECLS
 #undef NEXT_CHAR
 #undef UNGET_CHAR
+#undef TOKEN_BEGIN
 #undef TOKEN_START
 #undef TOKEN_APPEND
 #undef TOKEN_STOP
+#undef END_TOKEN
+#undef STRING_RUN
 #undef RETURN
 
 #define SCAN_FUNC_NAME  _scan
 #define SCAN_DECLS
-#define NEXT_CHAR       _next_char(stream)
+#define NEXT_CHAR       (stream->type == LISP_STREAM_BLOCKS && stream->v.blocks.pos < stream->v.blocks.end \
+			 ? (unsigned char)*stream->v.blocks.pos++ : _next_char(stream))
 #define UNGET_CHAR(c)   _unget_char((c), stream)
+#define TOKEN_BEGIN
 #define TOKEN_START(o)  _token_clear()
-#define TOKEN_APPEND(c) _token_append((c))
+#define TOKEN_APPEND(c) ({ if (!_token_append((c))) RETURN(TOKEN_ERROR); })
 #define TOKEN_STOP
+#define END_TOKEN       (STREAM_FAILED(stream) ? TOKEN_ERROR : TOKEN_EOF)
+#define STRING_RUN      ({ if (stream->type == LISP_STREAM_BLOCKS) { \
+			       char *run = stream->v.blocks.pos; \
+			       stream->v.blocks.pos = _string_run_end(run, stream->v.blocks.end); \
+			       if (!_token_append_run(run, stream->v.blocks.pos - run)) RETURN(TOKEN_ERROR); } })
 #define RETURN(t)       return (t)
 
 #include "lispscan.h"
@@ -179,20 +413,177 @@ my_atoi (const char *start, const char *stop)
 #undef SCAN_DECLS
 #undef NEXT_CHAR
 #undef UNGET_CHAR
+#undef TOKEN_BEGIN
 #undef TOKEN_START
 #undef TOKEN_APPEND
 #undef TOKEN_STOP
+#undef END_TOKEN
+#undef STRING_RUN
 #undef RETURN
 
 #define IS_STREAM_MMAPPED(s)   ((s)->type <= LISP_LAST_MMAPPED_STREAM)
+
+#ifdef LISP_PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PROFILE_CLOCK()        __builtin_ia32_rdtsc()
+#else
+#define PROFILE_CLOCK()        _profile_clock()
+
+static uint64_t
+_profile_clock (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#define PROFILE_NO_PHASE       -1
+
+/* the statistics are per thread, like the scanner state */
+static __thread lisp_stats_t profile_stats;
+static __thread int profile_phase = PROFILE_NO_PHASE;
+static __thread uint64_t profile_last;
+
+/* Charges the time since the last switch to the current phase and
+   makes phase the current one.  Returns the previous phase.  Outside
+   of reading, nothing is charged. */
+static int
+_profile_switch (int phase)
+{
+    int outer = profile_phase;
+    uint64_t now;
+
+    if (outer == PROFILE_NO_PHASE)
+	return outer;
+
+    now = PROFILE_CLOCK();
+    profile_stats.cycles[outer] += now - profile_last;
+    profile_last = now;
+    profile_phase = phase;
+
+    return outer;
+}
+
+static int
+_profile_begin_call (uint64_t *start)
+{
+    *start = PROFILE_CLOCK();
+
+    if (profile_phase != PROFILE_NO_PHASE)
+	return _profile_switch(LISP_PHASE_LINK);
+
+    profile_last = *start;
+    profile_phase = LISP_PHASE_LINK;
+
+    return PROFILE_NO_PHASE;
+}
+
+static void
+_profile_end_call (uint64_t start, int outer)
+{
+    uint64_t now = PROFILE_CLOCK();
+    int bucket = 63 - __builtin_clzll((now - start) | 1);
+
+    profile_stats.cycles[profile_phase] += now - profile_last;
+    profile_last = now;
+    profile_phase = outer;
+
+    ++profile_stats.calls;
+    ++profile_stats.latency[bucket < LISP_STATS_LATENCY_BUCKETS ? bucket : LISP_STATS_LATENCY_BUCKETS - 1];
+}
+
+static int
+_profile_scan (lisp_stream_t *stream)
+{
+    int outer = _profile_switch(LISP_PHASE_SCAN);
+    long start = stream->type == LISP_STREAM_FILE ? -1 : lisp_stream_tell(stream);
+    int token = IS_STREAM_MMAPPED(stream) ? _scan_mmap(stream) : _scan(stream);
+
+    if (start >= 0)
+	profile_stats.bytes += lisp_stream_tell(stream) - start;
+    ++profile_stats.tokens[token - TOKEN_ERROR];
+    _profile_switch(outer);
+
+    return token;
+}
+
+#define SCAN(s)                _profile_scan((s))
+#define PROFILED(p,e)          ({ int _outer = _profile_switch((p)); typeof(e) _value = (e); \
+				  _profile_switch(_outer); _value; })
+#define PROFILE_CALL_BEGIN     uint64_t _profile_start; int _profile_outer = _profile_begin_call(&_profile_start)
+#define PROFILE_CALL_END       _profile_end_call(_profile_start, _profile_outer)
+
+#else
+
 #define SCAN(s)                (IS_STREAM_MMAPPED((s)) ? _scan_mmap((s)) : _scan((s)))
+#define PROFILED(p,e)          (e)
+#define PROFILE_CALL_BEGIN
+#define PROFILE_CALL_END
+
+#endif
+
+int
+lisp_get_stats (lisp_stats_t *stats)
+{
+#ifdef LISP_PROFILE
+    *stats = profile_stats;
+    return 1;
+#else
+    memset(stats, 0, sizeof(lisp_stats_t));
+    return 0;
+#endif
+}
+
+void
+lisp_reset_stats (void)
+{
+#ifdef LISP_PROFILE
+    memset(&profile_stats, 0, sizeof(lisp_stats_t));
+#endif
+}
+
+const char*
+lisp_stats_phase_name (int phase)
+{
+    static const char *names[LISP_NUM_PHASES] = { "scan", "numbers", "symbols", "alloc", "link" };
+
+    assert(phase >= 0 && phase < LISP_NUM_PHASES);
+
+    return names[phase];
+}
+
+const char*
+lisp_stats_token_name (int token)
+{
+    static const char *names[LISP_STATS_NUM_TOKENS] = {
+	"error", "eof", "open paren", "close paren", "symbol", "string", "integer",
+	"real", "pattern open paren", "dot", "true", "false"
+    };
+
+    assert(token >= 0 && token < LISP_STATS_NUM_TOKENS);
+
+    return names[token];
+}
+
+/* the hash slot of conses with LISP_OBJECT_HASHED */
+#define LISP_OBJECT_HASH(o)    (*(uint64_t*)((o) + 1))
+
+#define HASH_LIST_FACTOR    0x9e3779b97f4a7c15ULL
+#define HASH_LIST_INVERSE   0xf1de83e19937733dULL /* HASH_LIST_FACTOR * HASH_LIST_INVERSE == 1 */
+#define HASH_NIL            0x6a09e667f3bcc909ULL
 
 static lisp_object_t*
 lisp_object_alloc (allocator_t *allocator, int type)
 {
-    lisp_object_t *obj = (lisp_object_t*)allocator_alloc(allocator, sizeof(lisp_object_t));
+    lisp_object_t *obj = PROFILED(LISP_PHASE_ALLOC,
+				  (lisp_object_t*)allocator_alloc(allocator, sizeof(lisp_object_t)));
 
     obj->type = type;
+    obj->flags = 0;
 
     return obj;
 }
@@ -242,9 +633,13 @@ lisp_stream_init_path (lisp_stream_t *stream, const char *path)
 	close(fd);
 
 	stream->type = LISP_STREAM_MMAP_FILE;
+	stream->flags = 0;
 	stream->v.mmap.buf = buf;
 	stream->v.mmap.pos = buf;
 	stream->v.mmap.end = buf + len;
+	stream->v.mmap.locations = 0;
+	stream->v.mmap.unclosed = 0;
+	stream->bound = BOUND_NONE;
     }
 
     return stream;
@@ -254,6 +649,9 @@ lisp_stream_t*
 lisp_stream_init_file (lisp_stream_t *stream, FILE *file)
 {
     stream->type = LISP_STREAM_FILE;
+    stream->flags = 0;
+    stream->last_char = stream->previous_char = EOF;
+    stream->bound = BOUND_NONE;
     stream->v.file = file;
 
     return stream;
@@ -263,9 +661,28 @@ lisp_stream_t*
 lisp_stream_init_string (lisp_stream_t *stream, char *buf)
 {
     stream->type = LISP_STREAM_STRING;
+    stream->flags = 0;
     stream->v.mmap.buf = buf;
     stream->v.mmap.end = buf + strlen(buf);
     stream->v.mmap.pos = buf;
+    stream->v.mmap.locations = 0;
+    stream->v.mmap.unclosed = 0;
+    stream->bound = BOUND_NONE;
+
+    return stream;
+}
+
+lisp_stream_t*
+lisp_stream_init_buffer (lisp_stream_t *stream, const char *buf, size_t length)
+{
+    stream->type = LISP_STREAM_STRING;
+    stream->flags = 0;
+    stream->v.mmap.buf = (char*)buf;
+    stream->v.mmap.end = (char*)buf + length;
+    stream->v.mmap.pos = (char*)buf;
+    stream->v.mmap.locations = 0;
+    stream->v.mmap.unclosed = 0;
+    stream->bound = BOUND_NONE;
 
     return stream;
 }
@@ -278,6 +695,9 @@ lisp_stream_init_any (lisp_stream_t *stream, void *data,
     assert(next_char != 0 && unget_char != 0);
     
     stream->type = LISP_STREAM_ANY;
+    stream->flags = 0;
+    stream->last_char = stream->previous_char = EOF;
+    stream->bound = BOUND_NONE;
     stream->v.any.data = data;
     stream->v.any.next_char= next_char;
     stream->v.any.unget_char = unget_char;
@@ -285,11 +705,40 @@ lisp_stream_init_any (lisp_stream_t *stream, void *data,
     return stream;
 }
 
+lisp_stream_t*
+lisp_stream_init_blocks (lisp_stream_t *stream, void *data,
+			 int (*fill) (void *data, char **buf, size_t *length),
+			 void (*close) (void *data))
+{
+    assert(fill != 0);
+
+    stream->type = LISP_STREAM_BLOCKS;
+    stream->flags = 0;
+    stream->last_char = stream->previous_char = EOF;
+    stream->bound = BOUND_NONE;
+    stream->v.blocks.buf = stream->v.blocks.end = stream->v.blocks.pos = 0;
+    stream->v.blocks.offset = 0;
+    stream->v.blocks.failed = 0;
+    stream->v.blocks.data = data;
+    stream->v.blocks.fill = fill;
+    stream->v.blocks.close = close;
+
+    return stream;
+}
+
 void
 lisp_stream_free_path  (lisp_stream_t *stream)
 {
     assert(stream->type == LISP_STREAM_MMAP_FILE
-	   || stream->type == LISP_STREAM_FILE);
+	   || stream->type == LISP_STREAM_FILE
+	   || stream->type == LISP_STREAM_BLOCKS);
+
+    if (stream->type == LISP_STREAM_BLOCKS)
+    {
+	if (stream->v.blocks.close != 0)
+	    stream->v.blocks.close(stream->v.blocks.data);
+	return;
+    }
 
 #ifndef __MINGW32__
     if (stream->type == LISP_STREAM_MMAP_FILE)
@@ -299,904 +748,3516 @@ lisp_stream_free_path  (lisp_stream_t *stream)
 	fclose(stream->v.file);
 }
 
-lisp_object_t*
-lisp_make_integer_with_allocator (allocator_t *allocator, int value)
+void
+lisp_stream_set_flags (lisp_stream_t *stream, int flags)
 {
-    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_INTEGER);
-
-    obj->v.integer = value;
+    stream->flags = flags;
+}
 
-    return obj;
+void
+lisp_set_max_token_length (size_t length)
+{
+    max_token_length = length;
 }
 
-lisp_object_t*
-lisp_make_real_with_allocator (allocator_t *allocator, float value)
+long
+lisp_stream_tell (lisp_stream_t *stream)
 {
-    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_REAL);
+    switch (stream->type)
+    {
+	case LISP_STREAM_MMAP_FILE :
+	case LISP_STREAM_STRING :
+	    return stream->v.mmap.pos - stream->v.mmap.buf;
 
-    obj->v.real = value;
+	case LISP_STREAM_FILE :
+	    return ftell(stream->v.file);
 
-    return obj;
+	case LISP_STREAM_BLOCKS :
+	    return stream->v.blocks.offset + (stream->v.blocks.pos - stream->v.blocks.buf);
+    }
+
+    return -1;
 }
 
-static lisp_object_t*
-lisp_make_symbol_with_allocator_internal (allocator_t *allocator, const char *str, size_t len)
+int
+lisp_stream_seek (lisp_stream_t *stream, long offset)
 {
-    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_SYMBOL);
+    switch (stream->type)
+    {
+	case LISP_STREAM_MMAP_FILE :
+	case LISP_STREAM_STRING :
+	    if (offset < 0 || offset > stream->v.mmap.end - stream->v.mmap.buf)
+		return 0;
+	    stream->v.mmap.pos = stream->v.mmap.buf + offset;
+	    return 1;
 
-    obj->v.string = allocator_alloc(allocator, len + 1);
-    memcpy(obj->v.string, str, len + 1);
-    obj->v.string[len] = '\0';
+	case LISP_STREAM_FILE :
+	    return fseek(stream->v.file, offset, SEEK_SET) == 0;
+    }
 
-    return obj;
+    return 0;
 }
 
-lisp_object_t*
-lisp_make_symbol_with_allocator (allocator_t *allocator, const char *value)
+typedef struct
 {
-    return lisp_make_symbol_with_allocator_internal(allocator, value, strlen(value));
-}
+    lisp_object_t *obj;
+    long offset;
+} location_t;
 
-lisp_object_t*
-lisp_make_string_with_allocator (allocator_t *allocator, const char *value)
+struct _lisp_locations_t
 {
-    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_STRING);
+    const char *buf;
+    size_t length;
 
-    obj->v.string = allocator_strdup(allocator, value);
+    location_t *entries;
+    size_t num_entries;
+    size_t num_sorted;		/* entries sorted by object */
+    size_t capacity;
 
-    return obj;
-}
+    long *newlines;		/* offsets, built on the first line lookup */
+    size_t num_newlines;
+};
 
-lisp_object_t*
-lisp_make_cons_with_allocator (allocator_t *allocator, lisp_object_t *car, lisp_object_t *cdr)
+lisp_locations_t*
+lisp_locations_new (void)
 {
-    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_CONS);
+    lisp_locations_t *locations = (lisp_locations_t*)malloc(sizeof(lisp_locations_t));
 
-    obj->v.cons.car = car;
-    obj->v.cons.cdr = cdr;
+    memset(locations, 0, sizeof(lisp_locations_t));
 
-    return obj;
+    return locations;
 }
 
-lisp_object_t*
-lisp_make_boolean_with_allocator (allocator_t *allocator, int value)
+void
+lisp_locations_clear (lisp_locations_t *locations)
 {
-    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_BOOLEAN);
-
-    obj->v.integer = value ? 1 : 0;
-
-    return obj;
+    locations->num_entries = 0;
+    locations->num_sorted = 0;
 }
 
-lisp_object_t*
-lisp_make_integer (int value)
+void
+lisp_locations_free (lisp_locations_t *locations)
 {
-    return lisp_make_integer_with_allocator(&malloc_allocator, value);
+    free(locations->entries);
+    free(locations->newlines);
+    free(locations);
 }
 
-lisp_object_t*
-lisp_make_real (float value)
+int
+lisp_stream_set_locations (lisp_stream_t *stream, lisp_locations_t *locations)
 {
-    return lisp_make_real_with_allocator(&malloc_allocator, value);
+    if (!IS_STREAM_MMAPPED(stream))
+	return 0;
+
+    stream->v.mmap.locations = locations;
+
+    if (locations != 0 && locations->buf != stream->v.mmap.buf)
+    {
+	locations->buf = stream->v.mmap.buf;
+	locations->length = stream->v.mmap.end - stream->v.mmap.buf;
+	free(locations->newlines);
+	locations->newlines = 0;
+	locations->num_newlines = 0;
+    }
+
+    return 1;
 }
 
-lisp_object_t*
-lisp_make_symbol (const char *value)
+static void
+_add_location (lisp_locations_t *locations, lisp_object_t *obj, long offset)
 {
-    return lisp_make_symbol_with_allocator(&malloc_allocator, value);
+    if (locations->num_entries == locations->capacity)
+    {
+	locations->capacity = locations->capacity == 0 ? 1024 : locations->capacity * 2;
+	locations->entries = (location_t*)realloc(locations->entries,
+						  locations->capacity * sizeof(location_t));
+    }
+
+    locations->entries[locations->num_entries].obj = obj;
+    locations->entries[locations->num_entries].offset = offset;
+    ++locations->num_entries;
 }
 
-lisp_object_t*
-lisp_make_string (const char *value)
+static int
+_compare_locations (const void *a, const void *b)
 {
-    return lisp_make_string_with_allocator(&malloc_allocator, value);
+    const location_t *x = (const location_t*)a, *y = (const location_t*)b;
+
+    if (x->obj != y->obj)
+	return x->obj < y->obj ? -1 : 1;
+    return 0;
 }
 
-lisp_object_t*
-lisp_make_cons (lisp_object_t *car, lisp_object_t *cdr)
+long
+lisp_locations_offset (lisp_locations_t *locations, lisp_object_t *obj)
 {
-    return lisp_make_cons_with_allocator(&malloc_allocator, car, cdr);
+    size_t low = 0, high;
+
+    /* the entries are sorted only when they are first looked up */
+    if (locations->num_sorted != locations->num_entries)
+    {
+	qsort(locations->entries, locations->num_entries, sizeof(location_t), _compare_locations);
+	locations->num_sorted = locations->num_entries;
+    }
+
+    high = locations->num_entries;
+    while (low < high)
+    {
+	size_t middle = low + (high - low) / 2;
+
+	if (locations->entries[middle].obj < obj)
+	    low = middle + 1;
+	else
+	    high = middle;
+    }
+
+    if (low < locations->num_entries && locations->entries[low].obj == obj)
+	return locations->entries[low].offset;
+    return -1;
 }
 
-lisp_object_t*
-lisp_make_boolean (int value)
+int
+lisp_locations_line (lisp_locations_t *locations, long offset, long *line, long *column)
 {
-    return lisp_make_boolean_with_allocator(&malloc_allocator, value);
+    size_t low = 0, high;
+
+    if (locations->buf == 0 || offset < 0 || (size_t)offset > locations->length)
+	return 0;
+
+    if (locations->newlines == 0)
+    {
+	const char *pos = locations->buf, *end = locations->buf + locations->length;
+	size_t capacity = 1024;
+
+	locations->newlines = (long*)malloc(capacity * sizeof(long));
+	while ((pos = memchr(pos, '\n', end - pos)) != 0)
+	{
+	    if (locations->num_newlines == capacity)
+	    {
+		capacity *= 2;
+		locations->newlines = (long*)realloc(locations->newlines, capacity * sizeof(long));
+	    }
+	    locations->newlines[locations->num_newlines++] = pos - locations->buf;
+	    ++pos;
+	}
+    }
+
+    /* count the newlines before offset */
+    high = locations->num_newlines;
+    while (low < high)
+    {
+	size_t middle = low + (high - low) / 2;
+
+	if (locations->newlines[middle] < offset)
+	    low = middle + 1;
+	else
+	    high = middle;
+    }
+
+    *line = low + 1;
+    *column = offset - (low == 0 ? 0 : locations->newlines[low - 1] + 1) + 1;
+
+    return 1;
 }
 
-static lisp_object_t*
-lisp_make_pattern_cons_with_allocator (allocator_t *allocator, lisp_object_t *car, lisp_object_t *cdr)
+lisp_object_t*
+lisp_make_integer_with_allocator (allocator_t *allocator, int value)
 {
-    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_PATTERN_CONS);
+    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_INTEGER);
 
-    obj->v.cons.car = car;
-    obj->v.cons.cdr = cdr;
+    obj->v.integer = value;
 
     return obj;
 }
 
-static lisp_object_t*
-lisp_make_pattern_var_with_allocator (allocator_t *allocator, int type, int index, lisp_object_t *sub)
+lisp_object_t*
+lisp_make_real_with_allocator (allocator_t *allocator, float value)
 {
-    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_PATTERN_VAR);
+    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_REAL);
 
-    obj->v.pattern.type = type;
-    obj->v.pattern.index = index;
-    obj->v.pattern.sub = sub;
+    obj->v.real = value;
 
     return obj;
 }
 
-lisp_object_t*
-lisp_read_with_allocator (allocator_t *allocator, lisp_stream_t *in)
+static lisp_object_t*
+lisp_make_symbol_with_allocator_internal (allocator_t *allocator, const char *str, size_t len)
 {
-    int token = SCAN(in);
-    lisp_object_t *obj = lisp_nil();
+    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_SYMBOL);
 
-    if (token == TOKEN_EOF)
-	return &end_marker;
+    obj->v.string = allocator_alloc(allocator, len + 1);
+    memcpy(obj->v.string, str, len);
+    obj->v.string[len] = '\0';
 
-    switch (token)
-    {
-	case TOKEN_ERROR :
-	    return &error_object;
+    return obj;
+}
 
-	case TOKEN_EOF :
-	    return &end_marker;
+lisp_object_t*
+lisp_make_symbol_with_allocator (allocator_t *allocator, const char *value)
+{
+    return lisp_make_symbol_with_allocator_internal(allocator, value, strlen(value));
+}
 
-	case TOKEN_OPEN_PAREN :
-	case TOKEN_PATTERN_OPEN_PAREN :
-	    {
-		lisp_object_t *last = lisp_nil(), *car;
+lisp_object_t*
+lisp_make_string_with_allocator (allocator_t *allocator, const char *value)
+{
+    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_STRING);
 
-		do
-		{
-		    car = lisp_read_with_allocator(allocator, in);
-		    if (car == &error_object || car == &end_marker)
-		    {
-			lisp_free_with_allocator(allocator, obj);
-			return &error_object;
-		    }
-		    else if (car == &dot_marker)
-		    {
-			if (lisp_nil_p(last))
-			{
-			    lisp_free_with_allocator(allocator, obj);
-			    return &error_object;
-			}
+    obj->v.string = allocator_strdup(allocator, value);
 
-			car = lisp_read_with_allocator(allocator, in);
-			if (car == &error_object || car == &end_marker)
-			{
-			    lisp_free_with_allocator(allocator, obj);
-			    return car;
-			}
-			else
-			{
-			    last->v.cons.cdr = car;
+    return obj;
+}
 
-			    if (SCAN(in) != TOKEN_CLOSE_PAREN)
-			    {
-				lisp_free_with_allocator(allocator, obj);
-				return &error_object;
-			    }
+lisp_object_t*
+lisp_make_cons_with_allocator (allocator_t *allocator, lisp_object_t *car, lisp_object_t *cdr)
+{
+    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_CONS);
 
-			    car = &close_paren_marker;
-			}
-		    }
-		    else if (car != &close_paren_marker)
-		    {
-			if (lisp_nil_p(last))
-			    obj = last = (token == TOKEN_OPEN_PAREN
-					  ? lisp_make_cons_with_allocator(allocator, car, lisp_nil())
-					  : lisp_make_pattern_cons_with_allocator(allocator, car, lisp_nil()));
-			else
-			    last = last->v.cons.cdr = lisp_make_cons_with_allocator(allocator, car, lisp_nil());
-		    }
-		} while (car != &close_paren_marker);
-	    }
-	    return obj;
+    obj->v.cons.car = car;
+    obj->v.cons.cdr = cdr;
 
-	case TOKEN_CLOSE_PAREN :
-	    return &close_paren_marker;
+    return obj;
+}
 
-	case TOKEN_SYMBOL :
-	    if (IS_STREAM_MMAPPED(in))
-		return lisp_make_symbol_with_allocator_internal(allocator, mmap_token_start,
-								mmap_token_stop - mmap_token_start);
-	    else
-		return lisp_make_symbol_with_allocator(allocator, token_string);
+lisp_object_t*
+lisp_make_boolean_with_allocator (allocator_t *allocator, int value)
+{
+    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_BOOLEAN);
 
-	case TOKEN_STRING :
-	    return lisp_make_string_with_allocator(allocator, token_string);
+    obj->v.integer = value ? 1 : 0;
 
-	case TOKEN_INTEGER :
-	    if (IS_STREAM_MMAPPED(in))
-		return lisp_make_integer_with_allocator(allocator, my_atoi(mmap_token_start, mmap_token_stop));
-	    else
-		return lisp_make_integer_with_allocator(allocator, atoi(token_string));
+    return obj;
+}
 
-        case TOKEN_REAL :
-	    if (IS_STREAM_MMAPPED(in))
-		copy_mmapped_token();
-	    return lisp_make_real_with_allocator(allocator, (float)g_ascii_strtod(token_string, NULL));
+lisp_object_t*
+lisp_make_integer (int value)
+{
+    return lisp_make_integer_with_allocator(&malloc_allocator, value);
+}
 
-	case TOKEN_DOT :
-	    return &dot_marker;
+lisp_object_t*
+lisp_make_real (float value)
+{
+    return lisp_make_real_with_allocator(&malloc_allocator, value);
+}
 
-	case TOKEN_TRUE :
-	    return lisp_make_boolean_with_allocator(allocator, 1);
+lisp_object_t*
+lisp_make_symbol (const char *value)
+{
+    return lisp_make_symbol_with_allocator(&malloc_allocator, value);
+}
 
-	case TOKEN_FALSE :
-	    return lisp_make_boolean_with_allocator(allocator, 0);
-    }
+lisp_object_t*
+lisp_make_string (const char *value)
+{
+    return lisp_make_string_with_allocator(&malloc_allocator, value);
+}
 
-    assert(0);
-    return &error_object;
+lisp_object_t*
+lisp_make_cons (lisp_object_t *car, lisp_object_t *cdr)
+{
+    return lisp_make_cons_with_allocator(&malloc_allocator, car, cdr);
 }
 
 lisp_object_t*
-lisp_read (lisp_stream_t *in)
+lisp_make_boolean (int value)
 {
-    return lisp_read_with_allocator(&malloc_allocator, in);
+    return lisp_make_boolean_with_allocator(&malloc_allocator, value);
 }
 
-void
-lisp_free_with_allocator (allocator_t *allocator, lisp_object_t *obj)
+/* Makes a number object which keeps the text of the token just
+   scanned and converts it only when its value is asked for.  Tokens
+   of mmapped streams are referenced in place, all others are
+   copied. */
+static lisp_object_t*
+lisp_make_lazy_number_with_allocator (allocator_t *allocator, lisp_stream_t *in, int type)
 {
- restart:
+    lisp_object_t *obj = lisp_object_alloc(allocator, type);
 
-    if (obj == 0)
-	return;
+    obj->flags = LISP_OBJECT_LAZY;
 
-    switch (obj->type)
+    if (IS_STREAM_MMAPPED(in))
     {
-	case LISP_TYPE_INTERNAL :
-	case LISP_TYPE_PARSE_ERROR :
-	case LISP_TYPE_EOF :
-	    return;
+	obj->v.number.text = mmap_token_start;
+	obj->v.number.length = mmap_token_stop - mmap_token_start;
+    }
+    else
+    {
+	obj->v.number.text = allocator_alloc(allocator, token_length);
+	memcpy(obj->v.number.text, token_string, token_length);
+	obj->v.number.length = token_length;
+	obj->flags |= LISP_OBJECT_OWNS_TEXT;
+    }
 
-	case LISP_TYPE_SYMBOL :
-	case LISP_TYPE_STRING :
-	    allocator_free(allocator, obj->v.string);
-	    break;
+    return obj;
+}
 
-	case LISP_TYPE_CONS :
-	case LISP_TYPE_PATTERN_CONS :
-	    /* If we just recursively free car and cdr we risk a stack
-	       overflow because lists may be nested arbitrarily deep.
+static void
+lisp_decode_number (lisp_object_t *obj)
+{
+    char *text = obj->v.number.text;
+    int length = obj->v.number.length;
 
-	       We can get rid of one recursive call with a tail call,
-	       but there's still one remaining.
+    /* Threads may share a lazily read tree, so the value is published
+       with a release store of the flag, which the accessors load with
+       acquire ordering.  Threads decoding the same number concurrently
+       store the same value. */
+    if (obj->type == LISP_TYPE_INTEGER)
+    {
+	int integer = my_atoi(text, text + length);
 
-	       The solution is to flatten a recursive list until we
-	       can free the car without recursion.  Then we free the
-	       cdr with a tail call.
+	__atomic_store(&obj->v.number.value.integer, &integer, __ATOMIC_RELAXED);
+    }
+    else
+    {
+	char buf[64];
+	char *copy = buf;
+	float real;
 
-	       The transformation we perform on the list is this:
+	if (length >= sizeof(buf))
+	    copy = g_malloc(length + 1);
 
-	         ((a . b) . c) -> (a . (b . c))
-	    */
-	    if (!lisp_nil_p(obj->v.cons.car)
-		&& (lisp_type(obj->v.cons.car) == LISP_TYPE_CONS
-		    || lisp_type(obj->v.cons.car) == LISP_TYPE_PATTERN_CONS))
-	    {
-		/* this is the transformation */
+	memcpy(copy, text, length);
+	copy[length] = '\0';
 
-		lisp_object_t *car, *cdar;
+	real = (float)g_ascii_strtod(copy, NULL);
+	__atomic_store(&obj->v.number.value.real, &real, __ATOMIC_RELAXED);
 
-		car = obj->v.cons.car;
-		cdar = car->v.cons.cdr;
+	if (copy != buf)
+	    g_free(copy);
+    }
 
-		car->v.cons.cdr = obj;
+    __atomic_or_fetch(&obj->flags, LISP_OBJECT_DECODED, __ATOMIC_RELEASE);
+}
 
-		obj->v.cons.car = cdar;
+static lisp_object_t*
+lisp_make_pattern_cons_with_allocator (allocator_t *allocator, lisp_object_t *car, lisp_object_t *cdr)
+{
+    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_PATTERN_CONS);
 
-		obj = car;
+    obj->v.cons.car = car;
+    obj->v.cons.cdr = cdr;
 
-		goto restart;
-	    }
-	    else
-	    {
-		/* here we just free the car (which is not recursive),
-		   the cons itself and the cdr via a tail call.  */
+    return obj;
+}
 
-		lisp_object_t *tmp;
+static lisp_object_t*
+lisp_make_pattern_var_with_allocator (allocator_t *allocator, int type, int index, lisp_object_t *sub)
+{
+    lisp_object_t *obj = lisp_object_alloc(allocator, LISP_TYPE_PATTERN_VAR);
 
-		lisp_free_with_allocator(allocator, obj->v.cons.car);
+    obj->v.pattern.type = type;
+    obj->v.pattern.index = index;
+    obj->v.pattern.sub = sub;
 
-		tmp = obj;
-		obj = obj->v.cons.cdr;
+    return obj;
+}
 
-		allocator_free(allocator, tmp);
+#define IS_SPACE(c)       (CHAR_CLASS((unsigned char)(c)) & CHAR_SPACE)
+#define IS_DELIMITER(c)   (CHAR_CLASS((unsigned char)(c)) & (CHAR_SPACE | CHAR_DELIMITER))
 
-		goto restart;
-	    }
+/* Skips expressions in a memory mapped stream without scanning
+   tokens.  If depth is 0, skips exactly one expression, otherwise
+   skips until depth lists have been closed.  Returns 1 on success, 0
+   if the end of the stream was reached before an expression started
+   and -1 on a syntax error. */
+static int
+_skip_mmap (lisp_stream_t *stream, int depth)
+{
+    char *pos = stream->v.mmap.pos, *end = stream->v.mmap.end;
+    int result = 1;
 
-	case LISP_TYPE_PATTERN_VAR :
-	    lisp_free_with_allocator(allocator, obj->v.pattern.sub);
-	    break;
+    do
+    {
+	char c;
+
+	while (pos < end && (IS_SPACE(*pos) || *pos == ';'))
+	{
+	    if (*pos == ';')
+	    {
+		pos = memchr(pos, '\n', end - pos);
+		if (pos == 0)
+		{
+		    pos = end;
+		    break;
+		}
+	    }
+	    ++pos;
+	}
+
+	if (pos == end)
+	{
+	    result = depth == 0 ? 0 : -1;
+	    break;
+	}
+
+	c = *pos++;
+	switch (c)
+	{
+	    case '(' :
+		++depth;
+		break;
+
+	    case ')' :
+		if (depth == 0)
+		{
+		    result = -1;
+		    goto done;
+		}
+		--depth;
+		break;
+
+	    case '"' :
+		for (;;)
+		{
+		    char *quote = memchr(pos, '"', end - pos);
+		    char *p;
+
+		    if (quote == 0)
+		    {
+			pos = end;
+			result = -1;
+			goto done;
+		    }
+
+		    /* the quote is escaped if it is preceded by an odd
+		       number of backslashes */
+		    for (p = quote; p > pos && p[-1] == '\\'; --p)
+			;
+		    pos = quote + 1;
+		    if (((quote - p) & 1) == 0)
+			break;
+		}
+		break;
+
+	    case '#' :
+		if (pos == end)
+		{
+		    result = -1;
+		    goto done;
+		}
+		c = *pos++;
+		if (c == '?')
+		{
+		    if (pos == end || *pos++ != '(')
+		    {
+			result = -1;
+			goto done;
+		    }
+		    ++depth;
+		}
+		else if (c != 't' && c != 'f')
+		{
+		    result = -1;
+		    goto done;
+		}
+		break;
+
+	    default :
+		if (c == '.' && depth == 0 && (pos == end || IS_DELIMITER(*pos)))
+		{
+		    result = -1;
+		    goto done;
+		}
+		while (pos < end && !IS_DELIMITER(*pos))
+		    ++pos;
+	}
+    } while (depth > 0);
+
+ done:
+    stream->v.mmap.pos = pos;
+
+    return result;
+}
+
+static int
+_skip_tokens (lisp_stream_t *stream, int depth)
+{
+    do
+    {
+	switch (_scan(stream))
+	{
+	    case TOKEN_ERROR :
+		return -1;
+
+	    case TOKEN_EOF :
+		return depth == 0 ? 0 : -1;
+
+	    case TOKEN_OPEN_PAREN :
+	    case TOKEN_PATTERN_OPEN_PAREN :
+		++depth;
+		break;
+
+	    case TOKEN_CLOSE_PAREN :
+		if (depth == 0)
+		    return -1;
+		--depth;
+		break;
+
+	    case TOKEN_DOT :
+		if (depth == 0)
+		    return -1;
+		break;
+	}
+    } while (depth > 0);
+
+    return 1;
+}
+
+static int
+_skip (lisp_stream_t *in, int depth)
+{
+    if (IS_STREAM_MMAPPED(in))
+	return _skip_mmap(in, depth);
+    return _skip_tokens(in, depth);
+}
+
+int
+lisp_skip (lisp_stream_t *in)
+{
+    return _skip(in, 0);
+}
+
+int
+lisp_skip_space (lisp_stream_t *in)
+{
+    int c;
+
+    if (IS_STREAM_MMAPPED(in))
+    {
+	char *pos = in->v.mmap.pos, *end = in->v.mmap.end;
+
+	while (pos < end && (IS_SPACE(*pos) || *pos == ';'))
+	{
+	    if (*pos == ';')
+	    {
+		pos = memchr(pos, '\n', end - pos);
+		if (pos == 0)
+		{
+		    pos = end;
+		    break;
+		}
+	    }
+	    ++pos;
+	}
+
+	in->v.mmap.pos = pos;
+
+	return pos < end;
     }
 
-    allocator_free(allocator, obj);
+    /* a failed block stream is not at its end yet: the next read
+       reports the error */
+    for (;;)
+    {
+	c = _next_char(in);
+	if (c == EOF)
+	    return STREAM_FAILED(in);
+	if (c == ';')
+	{
+	    do
+		c = _next_char(in);
+	    while (c != EOF && c != '\n');
+	    if (c == EOF)
+		return STREAM_FAILED(in);
+	}
+	else if (!IS_SPACE(c))
+	    break;
+    }
+
+    _unget_char(c, in);
+
+    return 1;
 }
 
-void
-lisp_free (lisp_object_t *obj)
+/* validation states of the current list */
+#define VALIDATE_TOP        0	/* not in a list */
+#define VALIDATE_FIRST      1	/* before the first element */
+#define VALIDATE_ELEMENTS   2	/* after an element */
+#define VALIDATE_DOT        3	/* after a dot */
+#define VALIDATE_CLOSE      4	/* after the element following a dot */
+
+#define MAX_VALIDATE_DEPTH  65536
+
+#define BITS_PER_LONG       (8 * sizeof(unsigned long))
+
+typedef struct
 {
-    lisp_free_with_allocator(&malloc_allocator, obj);
+    lisp_validate_stats_t *stats;
+    int depth;
+    int state;
+    /* for each depth, whether the list there started after a dot */
+    unsigned long after_dot[MAX_VALIDATE_DEPTH / BITS_PER_LONG];
+} validator_t;
+
+/* The following functions check one token against the state of the
+   validator and return 0 if it is not allowed. */
+
+static inline int
+_validate_element (validator_t *v)
+{
+    switch (v->state)
+    {
+	case VALIDATE_TOP :
+	    ++v->stats->expressions;
+	    return 1;
+
+	case VALIDATE_DOT :
+	    v->state = VALIDATE_CLOSE;
+	    return 1;
+
+	case VALIDATE_CLOSE :
+	    return 0;
+
+	default :
+	    v->state = VALIDATE_ELEMENTS;
+	    return 1;
+    }
 }
 
-lisp_object_t*
-lisp_read_from_string_with_allocator (allocator_t *allocator, const char *buf)
+static inline int
+_validate_atom (validator_t *v)
 {
-    lisp_stream_t stream;
+    ++v->stats->atoms;
+    return _validate_element(v);
+}
 
-    lisp_stream_init_string(&stream, (char*)buf);
-    return lisp_read_with_allocator(allocator, &stream);
+static inline int
+_validate_open (validator_t *v)
+{
+    if (v->state == VALIDATE_CLOSE || v->depth == MAX_VALIDATE_DEPTH)
+	return 0;
+
+    if (v->state == VALIDATE_DOT)
+	v->after_dot[v->depth / BITS_PER_LONG] |= 1UL << (v->depth % BITS_PER_LONG);
+    else
+	v->after_dot[v->depth / BITS_PER_LONG] &= ~(1UL << (v->depth % BITS_PER_LONG));
+
+    if (++v->depth > v->stats->max_depth)
+	v->stats->max_depth = v->depth;
+    v->state = VALIDATE_FIRST;
+
+    return 1;
 }
 
-lisp_object_t*
-lisp_read_from_string (const char *buf)
+static inline int
+_validate_close (validator_t *v)
 {
-    return lisp_read_from_string_with_allocator(&malloc_allocator, buf);
+    if (v->depth == 0 || v->state == VALIDATE_DOT)
+	return 0;
+
+    --v->depth;
+    ++v->stats->lists;
+
+    if (v->depth == 0)
+    {
+	v->state = VALIDATE_TOP;
+	++v->stats->expressions;
+    }
+    else if (v->after_dot[v->depth / BITS_PER_LONG] & (1UL << (v->depth % BITS_PER_LONG)))
+	v->state = VALIDATE_CLOSE;
+    else
+	v->state = VALIDATE_ELEMENTS;
+
+    return 1;
 }
 
+static inline int
+_validate_dot (validator_t *v)
+{
+    if (v->state != VALIDATE_ELEMENTS)
+	return 0;
+
+    v->state = VALIDATE_DOT;
+
+    return 1;
+}
+
+/* Validates a memory mapped stream byte by byte, accepting exactly
+   what the scanner and the reader accept.  On an error, stores the
+   offset of the token at which it was detected in error. */
 static int
-_compile_pattern (lisp_object_t **obj, int *index)
+_validate_mmap (lisp_stream_t *stream, validator_t *v, long *error)
 {
-    if (*obj == 0)
-	return 1;
+    char *pos = stream->v.mmap.pos, *end = stream->v.mmap.end;
+    char *start = pos;
+    int result = 0;
 
-    switch (lisp_type(*obj))
+    for (;;)
     {
-	case LISP_TYPE_PATTERN_CONS :
+	int ok;
+
+	while (pos < end && (CHAR_CLASS((unsigned char)*pos) & (CHAR_SPACE | CHAR_COMMENT)))
+	{
+	    if (*pos == ';')
 	    {
-		struct { char *name; int type; } types[] =
-						 {
-						     { "any", LISP_PATTERN_ANY },
-						     { "symbol", LISP_PATTERN_SYMBOL },
-						     { "string", LISP_PATTERN_STRING },
-						     { "integer", LISP_PATTERN_INTEGER },
-						     { "real", LISP_PATTERN_REAL },
-						     { "boolean", LISP_PATTERN_BOOLEAN },
-						     { "list", LISP_PATTERN_LIST },
-						     { "or", LISP_PATTERN_OR },
-						     { "number", LISP_PATTERN_NUMBER },
-						     { 0, 0 }
-						 };
-		char *type_name;
-		int type = 0;	/* makes gcc happy */
-		int i;
-		lisp_object_t *pattern;
+		pos = memchr(pos, '\n', end - pos);
+		if (pos == 0)
+		{
+		    pos = end;
+		    break;
+		}
+	    }
+	    ++pos;
+	}
 
-		if (lisp_type(lisp_car(*obj)) != LISP_TYPE_SYMBOL)
-		    return 0;
+	start = pos;
+	if (pos == end)
+	{
+	    result = v->depth == 0;
+	    break;
+	}
 
-		type_name = lisp_symbol(lisp_car(*obj));
-		for (i = 0; types[i].name != 0; ++i)
+	switch (*pos++)
+	{
+	    case '(' :
+		ok = _validate_open(v);
+		break;
+
+	    case ')' :
+		ok = _validate_close(v);
+		break;
+
+	    case '"' :
+	    {
+		size_t length;
+
+		for (;;)
 		{
-		    if (strcmp(types[i].name, type_name) == 0)
-		    {
-			type = types[i].type;
+		    char *quote = memchr(pos, '"', end - pos);
+		    char *p;
+
+		    if (quote == 0)
+			goto done;
+
+		    /* the quote is escaped if it is preceded by an odd
+		       number of backslashes */
+		    for (p = quote; p > pos && p[-1] == '\\'; --p)
+			;
+		    pos = quote + 1;
+		    if (((quote - p) & 1) == 0)
 			break;
-		    }
 		}
 
-		if (types[i].name == 0)
-		    return 0;
+		/* only long strings need their escapes counted */
+		length = pos - start - 2;
+		if (length > max_token_length)
+		{
+		    char *p;
 
-		if (type != LISP_PATTERN_OR && lisp_cdr(*obj) != 0)
-		    return 0;
+		    for (p = start + 1; p < pos - 1; ++p)
+			if (*p == '\\')
+			{
+			    ++p;
+			    --length;
+			}
+		}
 
-		pattern = lisp_make_pattern_var_with_allocator(&malloc_allocator, type, (*index)++, lisp_nil());
+		ok = length <= max_token_length && _validate_atom(v);
+		break;
+	    }
 
-		if (type == LISP_PATTERN_OR)
+	    case '#' :
+		if (pos == end)
+		    goto done;
+		switch (*pos++)
 		{
-		    lisp_object_t *cdr = lisp_cdr(*obj);
-
-		    if (!_compile_pattern(&cdr, index))
-		    {
-			lisp_free(pattern);
-			return 0;
-		    }
+		    case 't' :
+		    case 'f' :
+			ok = _validate_atom(v);
+			break;
 
-		    pattern->v.pattern.sub = cdr;
+		    case '?' :
+			ok = pos < end && *pos++ == '(' && _validate_open(v);
+			break;
 
-		    (*obj)->v.cons.cdr = lisp_nil();
+		    default :
+			ok = 0;
 		}
+		break;
 
-		lisp_free(*obj);
+	    default :
+		if (*start == '.' && (pos == end || (CHAR_CLASS((unsigned char)*pos) & CHAR_TERMINATOR)))
+		{
+		    ok = _validate_dot(v);
+		    break;
+		}
+		while (pos < end && !(CHAR_CLASS((unsigned char)*pos) & CHAR_TERMINATOR))
+		    ++pos;
+		ok = (size_t)(pos - start) <= max_token_length && _validate_atom(v);
+	}
 
-		*obj = pattern;
-	    }
+	if (!ok)
 	    break;
+    }
 
-	case LISP_TYPE_CONS :
-	    if (!_compile_pattern(&(*obj)->v.cons.car, index))
-		return 0;
-	    if (!_compile_pattern(&(*obj)->v.cons.cdr, index))
+ done:
+    stream->v.mmap.pos = pos;
+    *error = start - stream->v.mmap.buf;
+
+    return result;
+}
+
+static int
+_validate_tokens (lisp_stream_t *stream, validator_t *v, long *error)
+{
+    for (;;)
+    {
+	int ok;
+
+	/* the offset of a token is only known before it is scanned,
+	   so the space in front of it is skipped first */
+	if (stream->type == LISP_STREAM_BLOCKS)
+	    while (stream->v.blocks.pos < stream->v.blocks.end && IS_SPACE(*stream->v.blocks.pos))
+		++stream->v.blocks.pos;
+	if (stream->type != LISP_STREAM_BLOCKS || stream->v.blocks.pos == stream->v.blocks.end
+	    || *stream->v.blocks.pos == ';')
+	    lisp_skip_space(stream);
+	*error = lisp_stream_tell(stream);
+
+	switch (_scan(stream))
+	{
+	    case TOKEN_ERROR :
 		return 0;
-	    break;
+
+	    case TOKEN_EOF :
+		return v->depth == 0;
+
+	    case TOKEN_OPEN_PAREN :
+	    case TOKEN_PATTERN_OPEN_PAREN :
+		ok = _validate_open(v);
+		break;
+
+	    case TOKEN_CLOSE_PAREN :
+		ok = _validate_close(v);
+		break;
+
+	    case TOKEN_DOT :
+		ok = _validate_dot(v);
+		break;
+
+	    default :
+		ok = _validate_atom(v);
+	}
+
+	if (!ok)
+	    return 0;
     }
+}
+
+#define VALIDATE_BLOCK_SIZE    (64 * 1024)
+
+typedef struct
+{
+    FILE *file;
+    char buf[VALIDATE_BLOCK_SIZE];
+} file_blocks_t;
+
+static int
+_file_blocks_fill (void *data, char **buf, size_t *length)
+{
+    file_blocks_t *blocks = (file_blocks_t*)data;
+
+    *length = fread(blocks->buf, 1, VALIDATE_BLOCK_SIZE, blocks->file);
+    if (*length == 0)
+	return ferror(blocks->file) ? -1 : 0;
+    *buf = blocks->buf;
 
     return 1;
 }
 
+/* Validates a FILE stream through a block stream, which is faster and
+   keeps track of the offsets of the tokens without asking the FILE.
+   Seekable files are left where validation stopped, from others more
+   may have been read. */
+static int
+_validate_file (lisp_stream_t *stream, validator_t *v, long *error)
+{
+    file_blocks_t *blocks = (file_blocks_t*)malloc(sizeof(file_blocks_t));
+    long start = ftell(stream->v.file);
+    lisp_stream_t in;
+    int result;
+
+    if (blocks == 0)
+    {
+	*error = -1;
+	return 0;
+    }
+
+    blocks->file = stream->v.file;
+    lisp_stream_init_blocks(&in, blocks, _file_blocks_fill, 0);
+    result = _validate_tokens(&in, v, error);
+
+    if (start >= 0)
+    {
+	*error += start;
+	fseek(stream->v.file, start + lisp_stream_tell(&in), SEEK_SET);
+    }
+    else
+	*error = -1;
+
+    free(blocks);
+
+    return result;
+}
+
 int
-lisp_compile_pattern (lisp_object_t **obj, int *num_subs)
+lisp_validate (lisp_stream_t *in, lisp_validate_stats_t *stats)
 {
-    int index = 0;
+    lisp_validate_stats_t dummy;
+    validator_t v;
+    long error;
     int result;
 
-    result = _compile_pattern(obj, &index);
+    if (stats == 0)
+	stats = &dummy;
+    memset(stats, 0, sizeof(lisp_validate_stats_t));
 
-    if (result && num_subs != 0)
-	*num_subs = index;
+    v.stats = stats;
+    v.depth = 0;
+    v.state = VALIDATE_TOP;
+
+    if (IS_STREAM_MMAPPED(in))
+	result = _validate_mmap(in, &v, &error);
+    else if (in->type == LISP_STREAM_FILE)
+	result = _validate_file(in, &v, &error);
+    else
+	result = _validate_tokens(in, &v, &error);
+
+    stats->error_offset = result ? -1 : error;
 
     return result;
 }
 
-static int _match_pattern (lisp_object_t *pattern, lisp_object_t *obj, lisp_object_t **vars);
+typedef struct
+{
+    allocator_t *allocator;
+    lisp_stream_t *in;
+    int (*skip_child) (int depth, int index, void *data);
+    void *skip_data;
+    int depth;
+    lisp_locations_t *locations;
+} reader_t;
+
+static lisp_object_t* _read (reader_t *reader, int token);
+static uint64_t hash_element (lisp_object_t *obj);
+static void hash_list (lisp_object_t *list, uint64_t hash);
+
+/* Skips the rest of the expression whose first token has already
+   been scanned.  Returns non-zero on success. */
+static int
+_skip_rest (reader_t *reader, int token)
+{
+    switch (token)
+    {
+	case TOKEN_ERROR :
+	case TOKEN_EOF :
+	case TOKEN_CLOSE_PAREN :
+	case TOKEN_DOT :
+	    return 0;
+
+	case TOKEN_OPEN_PAREN :
+	case TOKEN_PATTERN_OPEN_PAREN :
+	    return _skip(reader->in, 1) > 0;
+    }
+
+    return 1;
+}
+
+/* Makes a cons followed by a slot for the hash of the list it starts.
+   Until the list is complete, the slot holds the hash of the car. */
+static lisp_object_t*
+lisp_make_hashed_cons_with_allocator (allocator_t *allocator, int type, lisp_object_t *car)
+{
+    lisp_object_t *obj = (lisp_object_t*)allocator_alloc(allocator, sizeof(lisp_object_t) + sizeof(uint64_t));
+
+    obj->type = type;
+    obj->flags = LISP_OBJECT_HASHED;
+    obj->v.cons.car = car;
+    obj->v.cons.cdr = lisp_nil();
+    LISP_OBJECT_HASH(obj) = hash_element(car);
+
+    return obj;
+}
+
+/* Reads the elements of a list up to and including the closing
+   parenthesis.  token is the first token after the opening
+   parenthesis. */
+static lisp_object_t*
+_read_list (reader_t *reader, int open_token, int token)
+{
+    allocator_t *allocator = reader->allocator;
+    lisp_object_t *obj = lisp_nil(), *last = lisp_nil(), *car, *cons;
+    int index = 0, type;
+    int hashed = reader->in->flags & LISP_READ_HASHES;
+    uint64_t hash = 0, factor = 1;
+
+    ++reader->depth;
+
+    for (;; token = SCAN(reader->in))
+    {
+	if (token == TOKEN_CLOSE_PAREN)
+	    break;
+
+	if (token == TOKEN_DOT)
+	{
+	    if (lisp_nil_p(last))
+		goto error;
+
+	    token = SCAN(reader->in);
+	    if (reader->skip_child != 0
+		&& reader->skip_child(reader->depth, index, reader->skip_data))
+	    {
+		if (!_skip_rest(reader, token))
+		    goto error;
+	    }
+	    else
+	    {
+		if (token == TOKEN_CLOSE_PAREN || token == TOKEN_DOT)
+		    goto error;
+
+		car = _read(reader, token);
+		if (car == &error_object || car == &end_marker)
+		    goto error;
+
+		last->v.cons.cdr = car;
+	    }
+
+	    if (SCAN(reader->in) != TOKEN_CLOSE_PAREN)
+		goto error;
+	    break;
+	}
+
+	if (reader->skip_child != 0
+	    && reader->skip_child(reader->depth, index++, reader->skip_data))
+	{
+	    if (!_skip_rest(reader, token))
+		goto error;
+	    continue;
+	}
+
+	car = _read(reader, token);
+	if (car == &error_object || car == &end_marker)
+	    goto error;
+
+	type = (lisp_nil_p(last) && open_token == TOKEN_PATTERN_OPEN_PAREN
+		? LISP_TYPE_PATTERN_CONS : LISP_TYPE_CONS);
+	if (hashed)
+	{
+	    cons = lisp_make_hashed_cons_with_allocator(allocator, type, car);
+	    hash += LISP_OBJECT_HASH(cons) * factor;
+	    factor *= HASH_LIST_FACTOR;
+	}
+	else if (type == LISP_TYPE_CONS)
+	    cons = lisp_make_cons_with_allocator(allocator, car, lisp_nil());
+	else
+	    cons = lisp_make_pattern_cons_with_allocator(allocator, car, lisp_nil());
+
+	if (lisp_nil_p(last))
+	    obj = last = cons;
+	else
+	    last = last->v.cons.cdr = cons;
+    }
+
+    --reader->depth;
+
+    if (hashed && !lisp_nil_p(obj))
+	hash_list(obj, hash + lisp_hash(last->v.cons.cdr) * factor);
+
+    return obj;
+
+ error:
+    --reader->depth;
+    lisp_free_with_allocator(allocator, obj);
+
+    return &error_object;
+}
+
+/* Converts the real token that has just been scanned. */
+static float
+_token_real (lisp_stream_t *in)
+{
+    if (IS_STREAM_MMAPPED(in))
+	copy_mmapped_token();
+    return (float)g_ascii_strtod(token_string, NULL);
+}
+
+static lisp_object_t*
+_read_object (reader_t *reader, int token)
+{
+    allocator_t *allocator = reader->allocator;
+    lisp_stream_t *in = reader->in;
+
+    switch (token)
+    {
+	case TOKEN_ERROR :
+	    return &error_object;
+
+	case TOKEN_EOF :
+	    return &end_marker;
+
+	case TOKEN_OPEN_PAREN :
+	case TOKEN_PATTERN_OPEN_PAREN :
+	    return _read_list(reader, token, SCAN(in));
+
+	case TOKEN_CLOSE_PAREN :
+	    return &close_paren_marker;
+
+	case TOKEN_SYMBOL :
+	    if (IS_STREAM_MMAPPED(in))
+		return PROFILED(LISP_PHASE_SYMBOLS,
+				lisp_make_symbol_with_allocator_internal(allocator, mmap_token_start,
+									 mmap_token_stop - mmap_token_start));
+	    else
+		return PROFILED(LISP_PHASE_SYMBOLS, lisp_make_symbol_with_allocator(allocator, token_string));
+
+	case TOKEN_STRING :
+	    return PROFILED(LISP_PHASE_SYMBOLS, lisp_make_string_with_allocator(allocator, token_string));
+
+	case TOKEN_INTEGER :
+	    if (in->flags & LISP_READ_LAZY_NUMBERS)
+		return PROFILED(LISP_PHASE_NUMBERS,
+				lisp_make_lazy_number_with_allocator(allocator, in, LISP_TYPE_INTEGER));
+	    if (IS_STREAM_MMAPPED(in))
+		return lisp_make_integer_with_allocator(allocator,
+							PROFILED(LISP_PHASE_NUMBERS,
+								 my_atoi(mmap_token_start, mmap_token_stop)));
+	    else
+		return lisp_make_integer_with_allocator(allocator,
+							PROFILED(LISP_PHASE_NUMBERS, atoi(token_string)));
+
+        case TOKEN_REAL :
+	    if (in->flags & LISP_READ_LAZY_NUMBERS)
+		return PROFILED(LISP_PHASE_NUMBERS,
+				lisp_make_lazy_number_with_allocator(allocator, in, LISP_TYPE_REAL));
+	    return lisp_make_real_with_allocator(allocator, PROFILED(LISP_PHASE_NUMBERS, _token_real(in)));
+
+	case TOKEN_DOT :
+	    return &dot_marker;
+
+	case TOKEN_TRUE :
+	    return lisp_make_boolean_with_allocator(allocator, 1);
+
+	case TOKEN_FALSE :
+	    return lisp_make_boolean_with_allocator(allocator, 0);
+    }
+
+    assert(0);
+    return &error_object;
+}
+
+/* Reads the expression whose first token has already been scanned. */
+static lisp_object_t*
+_read (reader_t *reader, int token)
+{
+    lisp_object_t *obj;
+    char *begin;
+
+    if (reader->locations == 0)
+	return _read_object(reader, token);
+
+    begin = mmap_token_begin;
+    obj = _read_object(reader, token);
+    if (lisp_type(obj) > LISP_TYPE_NIL)
+	_add_location(reader->locations, obj, begin - reader->in->v.mmap.buf);
+
+    return obj;
+}
+
+static void
+_reader_init (reader_t *reader, allocator_t *allocator, lisp_stream_t *in)
+{
+    reader->allocator = allocator;
+    reader->in = in;
+    reader->skip_child = 0;
+    reader->skip_data = 0;
+    reader->depth = 0;
+    reader->locations = IS_STREAM_MMAPPED(in) ? in->v.mmap.locations : 0;
+}
+
+lisp_object_t*
+lisp_read_with_allocator (allocator_t *allocator, lisp_stream_t *in)
+{
+    reader_t reader;
+    lisp_object_t *obj;
+    PROFILE_CALL_BEGIN;
+
+    _reader_init(&reader, allocator, in);
+
+    obj = _read(&reader, SCAN(in));
+
+    PROFILE_CALL_END;
+
+    return obj;
+}
+
+lisp_object_t*
+lisp_read (lisp_stream_t *in)
+{
+    return lisp_read_with_allocator(&malloc_allocator, in);
+}
+
+/* Makes reading from a stream that is not memory mapped stop before
+   the next line that starts with an open parenthesis.  The stream must
+   be positioned at the beginning of an expression. */
+static void
+_bound (lisp_stream_t *in)
+{
+    in->bound = BOUND_LINES;
+
+    if (in->type == LISP_STREAM_BLOCKS)
+    {
+	in->v.blocks.stop = in->v.blocks.end;
+	if (in->v.blocks.pos < in->v.blocks.end)
+	    in->v.blocks.end = _next_form_line(in->v.blocks.pos, in->v.blocks.stop);
+    }
+    else
+	/* the expression itself may start a line */
+	in->last_char = EOF;
+}
+
+/* Skips the rest of the input up to the bound of a stream. */
+static void
+_skip_to_bound (lisp_stream_t *in)
+{
+    do
+	if (in->type == LISP_STREAM_BLOCKS)
+	    in->v.blocks.pos = in->v.blocks.end;
+    while (_next_char(in) != EOF);
+}
+
+/* Removes the bound of a stream and returns whether reading has
+   stopped at it. */
+static int
+_unbound (lisp_stream_t *in)
+{
+    int reached = in->bound == BOUND_REACHED;
+
+    in->bound = BOUND_NONE;
+    if (in->type == LISP_STREAM_BLOCKS)
+	in->v.blocks.end = in->v.blocks.stop;
+
+    return reached;
+}
+
+/* Returns the end of the expression at pos, looking only at
+   parentheses, strings and comments, or 0 if it does not end before
+   end. */
+static char*
+_expression_end (char *pos, char *end)
+{
+    int depth = 0;
+
+    while (pos < end)
+	switch (*pos++)
+	{
+	    case '(' :
+		++depth;
+		break;
+
+	    case ')' :
+		if (--depth <= 0)
+		    return pos;
+		break;
+
+	    case '"' :
+		for (;;)
+		{
+		    char *quote = memchr(pos, '"', end - pos);
+		    char *p;
+
+		    if (quote == 0)
+			return 0;
+
+		    /* the quote is escaped if it is preceded by an odd
+		       number of backslashes */
+		    for (p = quote; p > pos && p[-1] == '\\'; --p)
+			;
+		    pos = quote + 1;
+		    if (((quote - p) & 1) == 0)
+			break;
+		}
+		if (depth == 0)
+		    return pos;
+		break;
+
+	    case ';' :
+		pos = memchr(pos, '\n', end - pos);
+		if (pos == 0)
+		    return 0;
+		break;
+	}
+
+    return 0;
+}
+
+lisp_object_t*
+lisp_read_recovering_with_allocator (allocator_t *allocator, lisp_stream_t *in,
+				     lisp_error_func_t error, void *data)
+{
+    for (;;)
+    {
+	reader_t reader;
+	lisp_object_t *obj;
+	char *start = 0, *bound = 0, *end = 0;
+	int token, list, reached;
+	PROFILE_CALL_BEGIN;
+
+	/* A broken expression must not take the following ones with it,
+	   so each expression is first read only up to the next line that
+	   starts with an open parenthesis. */
+	lisp_skip_space(in);
+	if (IS_STREAM_MMAPPED(in))
+	{
+	    start = in->v.mmap.pos;
+	    end = in->v.mmap.end;
+	    bound = in->v.mmap.end = _next_form_line(start, end);
+	}
+	else
+	    _bound(in);
+
+	_reader_init(&reader, allocator, in);
+	token = SCAN(in);
+	obj = _read(&reader, token);
+	list = token == TOKEN_OPEN_PAREN || token == TOKEN_PATTERN_OPEN_PAREN;
+
+	PROFILE_CALL_END;
+
+	if (IS_STREAM_MMAPPED(in))
+	{
+	    reached = in->v.mmap.pos == bound && bound < end;
+	    in->v.mmap.end = end;
+	}
+	else
+	{
+	    if (lisp_type(obj) == LISP_TYPE_PARSE_ERROR && list && in->bound == BOUND_LINES)
+		_skip_to_bound(in);
+	    reached = _unbound(in);
+	}
+
+	if (lisp_type(obj) != LISP_TYPE_PARSE_ERROR)
+	    return obj;
+
+	/* An expression in a memory mapped stream that goes on after the
+	   bound is read again as a whole if it ends at all.  Once one is
+	   found that does not, the expressions after it are only read up
+	   to their bounds, so that each byte is scanned a bounded number
+	   of times. */
+	if (reached && start != 0
+	    && (in->v.mmap.unclosed == 0 || start <= in->v.mmap.unclosed))
+	{
+	    char *stop = _expression_end(start, end);
+
+	    if (stop != 0)
+	    {
+		in->v.mmap.pos = start;
+		in->v.mmap.end = stop;
+		obj = lisp_read_with_allocator(allocator, in);
+		in->v.mmap.end = end;
+
+		if (lisp_type(obj) != LISP_TYPE_PARSE_ERROR)
+		    return obj;
+
+		bound = stop;
+	    }
+	    else
+		in->v.mmap.unclosed = start;
+	}
+
+	if (error != 0)
+	    error(lisp_stream_tell(in), data);
+
+	/* nothing can be read after a failed block */
+	if (STREAM_FAILED(in))
+	    return &end_marker;
+
+	/* reading goes on right after a broken atom, and at the bound
+	   after a broken list or an expression cut by the bound */
+	if (start != 0 && (list || reached))
+	    in->v.mmap.pos = bound;
+    }
+}
+
+lisp_object_t*
+lisp_read_recovering (lisp_stream_t *in, lisp_error_func_t error, void *data)
+{
+    return lisp_read_recovering_with_allocator(&malloc_allocator, in, error, data);
+}
+
+lisp_object_t*
+lisp_read_skipping_with_allocator (allocator_t *allocator, lisp_stream_t *in,
+				   int (*skip_child) (int depth, int index, void *data), void *data)
+{
+    reader_t reader;
+    lisp_object_t *obj;
+    PROFILE_CALL_BEGIN;
+
+    _reader_init(&reader, allocator, in);
+    reader.skip_child = skip_child;
+    reader.skip_data = data;
+
+    obj = _read(&reader, SCAN(in));
+
+    PROFILE_CALL_END;
+
+    return obj;
+}
+
+lisp_object_t*
+lisp_read_skipping (lisp_stream_t *in, int (*skip_child) (int depth, int index, void *data), void *data)
+{
+    return lisp_read_skipping_with_allocator(&malloc_allocator, in, skip_child, data);
+}
+
+int
+lisp_enter_list (lisp_stream_t *in)
+{
+    int c;
+
+    if (!lisp_skip_space(in))
+	return 0;
+
+    /* anything but a list is left in the stream, to be read with
+       lisp_read_element */
+    if (IS_STREAM_MMAPPED(in))
+	c = (unsigned char)*in->v.mmap.pos;
+    else
+    {
+	c = _next_char(in);
+	if (c == EOF)
+	    return -1;
+	_unget_char(c, in);
+    }
+
+    if (c != '(')
+	return -1;
+
+    SCAN(in);
+
+    return 1;
+}
+
+lisp_object_t*
+lisp_read_element_with_allocator (allocator_t *allocator, lisp_stream_t *in)
+{
+    reader_t reader;
+    int token = SCAN(in);
+
+    switch (token)
+    {
+	case TOKEN_CLOSE_PAREN :
+	    return &end_marker;
+
+	case TOKEN_EOF :
+	case TOKEN_DOT :
+	    return &error_object;
+    }
+
+    _reader_init(&reader, allocator, in);
+
+    return _read(&reader, token);
+}
+
+lisp_object_t*
+lisp_read_element (lisp_stream_t *in)
+{
+    return lisp_read_element_with_allocator(&malloc_allocator, in);
+}
+
+#define PATH_CAR      1
+#define PATH_CDR      2
+#define PATH_NTH      3
+#define PATH_KEY      4
+
+typedef struct
+{
+    int op;
+    int n;
+    char *key;
+    size_t key_length;
+} path_step_t;
+
+struct _lisp_path_t
+{
+    int num_steps;
+    path_step_t steps[];
+};
+
+lisp_path_t*
+lisp_path_compile (const char *spec)
+{
+    lisp_path_t *path;
+    const char *p;
+    int num_steps = 0, i;
+
+    for (p = spec; *p != '\0'; )
+    {
+	while (IS_SPACE(*p))
+	    ++p;
+	if (*p == '\0')
+	    break;
+	++num_steps;
+	while (*p != '\0' && !IS_SPACE(*p))
+	    ++p;
+    }
+
+    path = (lisp_path_t*)malloc(sizeof(lisp_path_t) + num_steps * sizeof(path_step_t));
+    if (path == 0)
+	return 0;
+    path->num_steps = 0;
+
+    for (p = spec, i = 0; i < num_steps; ++i)
+    {
+	path_step_t *step = &path->steps[path->num_steps];
+	path_step_t *prev = path->num_steps > 0 ? step - 1 : 0;
+	const char *start;
+	size_t length;
+
+	while (IS_SPACE(*p))
+	    ++p;
+	start = p;
+	while (*p != '\0' && !IS_SPACE(*p))
+	    ++p;
+	length = p - start;
+
+	step->n = 0;
+	step->key = 0;
+	step->key_length = 0;
+
+	/* runs of cdrs are merged, and if they are followed by a car
+	   they become a single nth step */
+	if (length == 1 && *start == 'a')
+	{
+	    if (prev != 0 && prev->op == PATH_CDR)
+	    {
+		prev->op = PATH_NTH;
+		continue;
+	    }
+	    step->op = PATH_CAR;
+	}
+	else if (length == 1 && *start == 'd')
+	{
+	    if (prev != 0 && prev->op == PATH_CDR)
+	    {
+		++prev->n;
+		continue;
+	    }
+	    step->op = PATH_CDR;
+	    step->n = 1;
+	}
+	else if (strspn(start, "0123456789") >= length)
+	{
+	    step->op = PATH_NTH;
+	    step->n = my_atoi(start, p);
+	}
+	else
+	{
+	    step->op = PATH_KEY;
+	    step->key = (char*)malloc(length + 1);
+	    if (step->key == 0)
+	    {
+		++path->num_steps;
+		lisp_path_free(path);
+		return 0;
+	    }
+	    memcpy(step->key, start, length);
+	    step->key[length] = '\0';
+	    step->key_length = length;
+	}
+
+	++path->num_steps;
+    }
+
+    return path;
+}
+
+void
+lisp_path_free (lisp_path_t *path)
+{
+    int i;
+
+    for (i = 0; i < path->num_steps; ++i)
+	if (path->steps[i].key != 0)
+	    free(path->steps[i].key);
+
+    free(path);
+}
+
+/* The value a path query is positioned at while it walks through the
+   stream. */
+#define CURSOR_NIL     0	/* the empty list, or the path did not apply */
+#define CURSOR_EXPR    1	/* the expression starting with token */
+#define CURSOR_REST    2	/* the rest of the current list, token being the first
+				   token of its first element */
+
+typedef struct
+{
+    lisp_stream_t *in;
+    int kind;
+    int token;
+    int depth;			/* number of lists entered but not yet left */
+} cursor_t;
+
+/* Makes a REST cursor point to a cons, the empty list or an atom
+   after a dot.  A list after a dot just continues the current list.
+   Returns zero on a parse error. */
+static int
+_cursor_normalize (cursor_t *cursor)
+{
+    while (cursor->kind == CURSOR_REST)
+    {
+	switch (cursor->token)
+	{
+	    case TOKEN_ERROR :
+	    case TOKEN_EOF :
+		return 0;
+
+	    case TOKEN_CLOSE_PAREN :
+		--cursor->depth;
+		cursor->kind = CURSOR_NIL;
+		break;
+
+	    case TOKEN_DOT :
+		cursor->token = SCAN(cursor->in);
+		switch (cursor->token)
+		{
+		    case TOKEN_ERROR :
+		    case TOKEN_EOF :
+		    case TOKEN_CLOSE_PAREN :
+		    case TOKEN_DOT :
+			return 0;
+
+		    case TOKEN_OPEN_PAREN :
+		    case TOKEN_PATTERN_OPEN_PAREN :
+			++cursor->depth;
+			cursor->token = SCAN(cursor->in);
+			break;
+
+		    default :
+			cursor->kind = CURSOR_EXPR;
+		}
+		break;
+
+	    default :
+		return 1;
+	}
+    }
+
+    return 1;
+}
+
+/* Enters the list the cursor points to.  If the cursor points to an
+   atom, it becomes NIL. */
+static int
+_cursor_enter (cursor_t *cursor)
+{
+    if (cursor->kind != CURSOR_EXPR)
+	return 1;
+
+    if (cursor->token != TOKEN_OPEN_PAREN && cursor->token != TOKEN_PATTERN_OPEN_PAREN)
+    {
+	cursor->kind = CURSOR_NIL;
+	return 1;
+    }
+
+    ++cursor->depth;
+    cursor->kind = CURSOR_REST;
+    cursor->token = SCAN(cursor->in);
+    if (cursor->token == TOKEN_DOT)
+	return 0;
+
+    return _cursor_normalize(cursor);
+}
+
+static int
+_cursor_cdr (reader_t *reader, cursor_t *cursor)
+{
+    if (!_cursor_enter(cursor))
+	return 0;
+    if (cursor->kind != CURSOR_REST)
+	return 1;
+
+    if (!_skip_rest(reader, cursor->token))
+	return 0;
+    cursor->token = SCAN(cursor->in);
+
+    return _cursor_normalize(cursor);
+}
+
+static int
+_cursor_is_symbol (cursor_t *cursor, path_step_t *step)
+{
+    if (cursor->token != TOKEN_SYMBOL)
+	return 0;
+
+    if (IS_STREAM_MMAPPED(cursor->in))
+	return mmap_token_stop - mmap_token_start == step->key_length
+	    && memcmp(mmap_token_start, step->key, step->key_length) == 0;
+
+    return strcmp(token_string, step->key) == 0;
+}
+
+static int
+_cursor_step (reader_t *reader, cursor_t *cursor, path_step_t *step)
+{
+    int i;
+
+    if (!_cursor_enter(cursor))
+	return 0;
+    if (cursor->kind != CURSOR_REST)
+	return 1;
+
+    switch (step->op)
+    {
+	case PATH_CAR :
+	    cursor->kind = CURSOR_EXPR;
+	    break;
+
+	case PATH_CDR :
+	    for (i = 0; i < step->n; ++i)
+		if (!_cursor_cdr(reader, cursor))
+		    return 0;
+	    break;
+
+	case PATH_NTH :
+	    for (i = 0; i < step->n && cursor->kind == CURSOR_REST; ++i)
+		if (!_cursor_cdr(reader, cursor))
+		    return 0;
+	    if (cursor->kind == CURSOR_REST)
+		cursor->kind = CURSOR_EXPR;
+	    else
+		cursor->kind = CURSOR_NIL;
+	    break;
+
+	case PATH_KEY :
+	    while (cursor->kind == CURSOR_REST)
+	    {
+		int found = _cursor_is_symbol(cursor, step);
+
+		if (!_cursor_cdr(reader, cursor))
+		    return 0;
+		if (cursor->kind != CURSOR_REST)
+		    break;
+
+		if (found)
+		{
+		    cursor->kind = CURSOR_EXPR;
+		    return 1;
+		}
+
+		if (!_cursor_cdr(reader, cursor))
+		    return 0;
+	    }
+	    cursor->kind = CURSOR_NIL;
+	    break;
+
+	default :
+	    assert(0);
+    }
+
+    return 1;
+}
+
+lisp_object_t*
+lisp_read_path_with_allocator (allocator_t *allocator, lisp_stream_t *in, lisp_path_t *path)
+{
+    reader_t reader;
+    cursor_t cursor;
+    lisp_object_t *result;
+    int i;
+
+    _reader_init(&reader, allocator, in);
+
+    cursor.in = in;
+    cursor.kind = CURSOR_EXPR;
+    cursor.token = SCAN(in);
+    cursor.depth = 0;
+
+    switch (cursor.token)
+    {
+	case TOKEN_EOF :
+	    return &end_marker;
+
+	case TOKEN_ERROR :
+	case TOKEN_CLOSE_PAREN :
+	case TOKEN_DOT :
+	    return &error_object;
+    }
+
+    for (i = 0; i < path->num_steps && cursor.kind != CURSOR_NIL; ++i)
+	if (!_cursor_step(&reader, &cursor, &path->steps[i]))
+	    return &error_object;
+
+    switch (cursor.kind)
+    {
+	case CURSOR_EXPR :
+	    result = _read(&reader, cursor.token);
+	    break;
+
+	case CURSOR_REST :
+	    result = _read_list(&reader, TOKEN_OPEN_PAREN, cursor.token);
+	    --cursor.depth;
+	    break;
+
+	default :
+	    result = lisp_nil();
+    }
+
+    if (result == &error_object || result == &end_marker)
+	return &error_object;
+
+    if (cursor.depth > 0 && _skip(in, cursor.depth) <= 0)
+    {
+	lisp_free_with_allocator(allocator, result);
+	return &error_object;
+    }
+
+    return result;
+}
+
+lisp_object_t*
+lisp_read_path (lisp_stream_t *in, lisp_path_t *path)
+{
+    return lisp_read_path_with_allocator(&malloc_allocator, in, path);
+}
+
+#define IS_CONS(o)     ((o) != 0 && ((o)->type == LISP_TYPE_CONS || (o)->type == LISP_TYPE_PATTERN_CONS))
+
+int
+lisp_path_apply (lisp_path_t *path, lisp_object_t *obj, lisp_object_t **result)
+{
+    int i, n;
+
+    for (i = 0; i < path->num_steps; ++i)
+    {
+	path_step_t *step = &path->steps[i];
+
+	switch (step->op)
+	{
+	    case PATH_CAR :
+		if (!IS_CONS(obj))
+		    return 0;
+		obj = obj->v.cons.car;
+		break;
+
+	    case PATH_CDR :
+	    case PATH_NTH :
+		for (n = step->n; n > 0; --n)
+		{
+		    if (!IS_CONS(obj))
+			return 0;
+		    obj = obj->v.cons.cdr;
+		}
+		if (step->op == PATH_NTH)
+		{
+		    if (!IS_CONS(obj))
+			return 0;
+		    obj = obj->v.cons.car;
+		}
+		break;
+
+	    case PATH_KEY :
+		for (;;)
+		{
+		    lisp_object_t *key;
+
+		    if (!IS_CONS(obj) || !IS_CONS(obj->v.cons.cdr))
+			return 0;
+
+		    key = obj->v.cons.car;
+		    if (key != 0 && key->type == LISP_TYPE_SYMBOL
+			&& key->v.string[0] == step->key[0]
+			&& strcmp(key->v.string, step->key) == 0)
+		    {
+			obj = obj->v.cons.cdr->v.cons.car;
+			break;
+		    }
+
+		    obj = obj->v.cons.cdr->v.cons.cdr;
+		}
+		break;
+
+	    default :
+		return 0;
+	}
+    }
+
+    *result = obj;
+
+    return 1;
+}
+
+void
+lisp_free_with_allocator (allocator_t *allocator, lisp_object_t *obj)
+{
+ restart:
+
+    if (obj == 0)
+	return;
+
+    switch (obj->type)
+    {
+	case LISP_TYPE_INTERNAL :
+	case LISP_TYPE_PARSE_ERROR :
+	case LISP_TYPE_EOF :
+	    return;
+
+	case LISP_TYPE_SYMBOL :
+	case LISP_TYPE_STRING :
+	    allocator_free(allocator, obj->v.string);
+	    break;
+
+	case LISP_TYPE_INTEGER :
+	case LISP_TYPE_REAL :
+	    if (obj->flags & LISP_OBJECT_OWNS_TEXT)
+		allocator_free(allocator, obj->v.number.text);
+	    break;
+
+	case LISP_TYPE_CONS :
+	case LISP_TYPE_PATTERN_CONS :
+	    /* If we just recursively free car and cdr we risk a stack
+	       overflow because lists may be nested arbitrarily deep.
+
+	       We can get rid of one recursive call with a tail call,
+	       but there's still one remaining.
+
+	       The solution is to flatten a recursive list until we
+	       can free the car without recursion.  Then we free the
+	       cdr with a tail call.
+
+	       The transformation we perform on the list is this:
+
+	         ((a . b) . c) -> (a . (b . c))
+	    */
+	    if (!lisp_nil_p(obj->v.cons.car)
+		&& (lisp_type(obj->v.cons.car) == LISP_TYPE_CONS
+		    || lisp_type(obj->v.cons.car) == LISP_TYPE_PATTERN_CONS))
+	    {
+		/* this is the transformation */
+
+		lisp_object_t *car, *cdar;
+
+		car = obj->v.cons.car;
+		cdar = car->v.cons.cdr;
+
+		car->v.cons.cdr = obj;
+
+		obj->v.cons.car = cdar;
+
+		obj = car;
+
+		goto restart;
+	    }
+	    else
+	    {
+		/* here we just free the car (which is not recursive),
+		   the cons itself and the cdr via a tail call.  */
+
+		lisp_object_t *tmp;
+
+		lisp_free_with_allocator(allocator, obj->v.cons.car);
+
+		tmp = obj;
+		obj = obj->v.cons.cdr;
+
+		allocator_free(allocator, tmp);
+
+		goto restart;
+	    }
+
+	case LISP_TYPE_PATTERN_VAR :
+	    lisp_free_with_allocator(allocator, obj->v.pattern.sub);
+	    break;
+    }
+
+    allocator_free(allocator, obj);
+}
+
+void
+lisp_free (lisp_object_t *obj)
+{
+    lisp_free_with_allocator(&malloc_allocator, obj);
+}
+
+lisp_object_t*
+lisp_read_from_string_with_allocator (allocator_t *allocator, const char *buf)
+{
+    lisp_stream_t stream;
+
+    lisp_stream_init_string(&stream, (char*)buf);
+    return lisp_read_with_allocator(allocator, &stream);
+}
+
+lisp_object_t*
+lisp_read_from_string (const char *buf)
+{
+    return lisp_read_from_string_with_allocator(&malloc_allocator, buf);
+}
+
+static int
+_compile_pattern (lisp_object_t **obj, int *index)
+{
+    if (*obj == 0)
+	return 1;
+
+    switch (lisp_type(*obj))
+    {
+	case LISP_TYPE_PATTERN_CONS :
+	    {
+		struct { char *name; int type; } types[] =
+						 {
+						     { "any", LISP_PATTERN_ANY },
+						     { "symbol", LISP_PATTERN_SYMBOL },
+						     { "string", LISP_PATTERN_STRING },
+						     { "integer", LISP_PATTERN_INTEGER },
+						     { "real", LISP_PATTERN_REAL },
+						     { "boolean", LISP_PATTERN_BOOLEAN },
+						     { "list", LISP_PATTERN_LIST },
+						     { "or", LISP_PATTERN_OR },
+						     { "number", LISP_PATTERN_NUMBER },
+						     { 0, 0 }
+						 };
+		char *type_name;
+		int type = 0;	/* makes gcc happy */
+		int i;
+		lisp_object_t *pattern;
+
+		if (lisp_type(lisp_car(*obj)) != LISP_TYPE_SYMBOL)
+		    return 0;
+
+		type_name = lisp_symbol(lisp_car(*obj));
+		for (i = 0; types[i].name != 0; ++i)
+		{
+		    if (strcmp(types[i].name, type_name) == 0)
+		    {
+			type = types[i].type;
+			break;
+		    }
+		}
+
+		if (types[i].name == 0)
+		    return 0;
+
+		if (type != LISP_PATTERN_OR && lisp_cdr(*obj) != 0)
+		    return 0;
+
+		pattern = lisp_make_pattern_var_with_allocator(&malloc_allocator, type, (*index)++, lisp_nil());
+
+		if (type == LISP_PATTERN_OR)
+		{
+		    lisp_object_t *cdr = lisp_cdr(*obj);
+
+		    if (!_compile_pattern(&cdr, index))
+		    {
+			lisp_free(pattern);
+			return 0;
+		    }
+
+		    pattern->v.pattern.sub = cdr;
+
+		    (*obj)->v.cons.cdr = lisp_nil();
+		}
+
+		lisp_free(*obj);
+
+		*obj = pattern;
+	    }
+	    break;
+
+	case LISP_TYPE_CONS :
+	    if (!_compile_pattern(&(*obj)->v.cons.car, index))
+		return 0;
+	    if (!_compile_pattern(&(*obj)->v.cons.cdr, index))
+		return 0;
+	    break;
+    }
+
+    return 1;
+}
+
+int
+lisp_compile_pattern (lisp_object_t **obj, int *num_subs)
+{
+    int index = 0;
+    int result;
+
+    result = _compile_pattern(obj, &index);
+
+    if (result && num_subs != 0)
+	*num_subs = index;
+
+    return result;
+}
+
+/* where the matcher stores the objects matched by pattern variables */
+typedef struct
+{
+    lisp_object_t **vars;
+    int num_vars;
+} match_t;
+
+static int _match_pattern (lisp_object_t *pattern, lisp_object_t *obj, match_t *match);
+
+/* Returns whether obj can be stored in the field described by
+   binding. */
+static int
+_bindable (const lisp_binding_t *binding, lisp_object_t *obj)
+{
+    switch (binding->type)
+    {
+	case LISP_BIND_NONE :
+	case LISP_BIND_OBJECT :
+	    return 1;
+
+	case LISP_BIND_INTEGER :
+	    return lisp_type(obj) == LISP_TYPE_INTEGER;
+
+	case LISP_BIND_REAL :
+	    return lisp_type(obj) == LISP_TYPE_REAL || lisp_type(obj) == LISP_TYPE_INTEGER;
+
+	case LISP_BIND_BOOLEAN :
+	    return lisp_type(obj) == LISP_TYPE_BOOLEAN;
+
+	case LISP_BIND_SYMBOL :
+	    return lisp_type(obj) == LISP_TYPE_SYMBOL;
+
+	case LISP_BIND_STRING :
+	    return lisp_type(obj) == LISP_TYPE_STRING;
+
+	default :
+	    return 0;
+    }
+}
+
+/* Stores obj in the field of the record described by binding,
+   converted to the field's type.  obj must be bindable. */
+static void
+_bind (const lisp_binding_t *binding, lisp_object_t *obj, char *record)
+{
+    void *field = record + binding->offset;
+
+    switch (binding->type)
+    {
+	case LISP_BIND_INTEGER :
+	    *(int*)field = lisp_integer(obj);
+	    break;
+
+	case LISP_BIND_REAL :
+	    if (lisp_type(obj) == LISP_TYPE_REAL)
+		*(float*)field = lisp_real(obj);
+	    else
+		*(float*)field = lisp_integer(obj);
+	    break;
+
+	case LISP_BIND_BOOLEAN :
+	    *(int*)field = lisp_boolean(obj);
+	    break;
+
+	case LISP_BIND_SYMBOL :
+	    *(char**)field = lisp_symbol(obj);
+	    break;
+
+	case LISP_BIND_STRING :
+	    *(char**)field = lisp_string(obj);
+	    break;
+
+	case LISP_BIND_OBJECT :
+	    *(lisp_object_t**)field = obj;
+	    break;
+    }
+}
+
+static int
+_match_pattern_var (lisp_object_t *pattern, lisp_object_t *obj, match_t *match)
+{
+    int index;
+
+    assert(lisp_type(pattern) == LISP_TYPE_PATTERN_VAR);
+
+    switch (pattern->v.pattern.type)
+    {
+	case LISP_PATTERN_ANY :
+	    break;
+
+	case LISP_PATTERN_SYMBOL :
+	    if (lisp_type(obj) != LISP_TYPE_SYMBOL)
+		return 0;
+	    break;
+
+	case LISP_PATTERN_STRING :
+	    if (lisp_type(obj) != LISP_TYPE_STRING)
+		return 0;
+	    break;
+
+	case LISP_PATTERN_INTEGER :
+	    if (lisp_type(obj) != LISP_TYPE_INTEGER)
+		return 0;
+	    break;
+
+        case LISP_PATTERN_REAL :
+	    if (lisp_type(obj) != LISP_TYPE_REAL)
+		return 0;
+	    break;
+	  
+	case LISP_PATTERN_BOOLEAN :
+	    if (lisp_type(obj) != LISP_TYPE_BOOLEAN)
+		return 0;
+	    break;
+
+	case LISP_PATTERN_LIST :
+	    if (lisp_type(obj) != LISP_TYPE_CONS
+		&& lisp_type(obj) != LISP_TYPE_NIL)
+		return 0;
+	    break;
+
+	case LISP_PATTERN_OR :
+	    {
+		lisp_object_t *sub;
+		int matched = 0;
+
+		for (sub = pattern->v.pattern.sub; sub != 0; sub = lisp_cdr(sub))
+		{
+		    assert(lisp_type(sub) == LISP_TYPE_CONS);
+
+		    if (_match_pattern(lisp_car(sub), obj, match))
+			matched = 1;
+		}
+
+		if (!matched)
+		    return 0;
+	    }
+	    break;
+
+	case LISP_PATTERN_NUMBER :
+	    if (lisp_type(obj) != LISP_TYPE_INTEGER
+		&& lisp_type(obj) != LISP_TYPE_REAL)
+		return 0;
+	    break;
+
+	default :
+	    assert(0);
+    }
+
+    index = pattern->v.pattern.index;
+
+    if (match->vars != 0 && index < match->num_vars)
+	match->vars[index] = obj;
+
+    return 1;
+}
+
+static int
+_match_pattern (lisp_object_t *pattern, lisp_object_t *obj, match_t *match)
+{
+    if (pattern == 0)
+	return obj == 0;
+
+    if (lisp_type(pattern) == LISP_TYPE_PATTERN_VAR)
+	return _match_pattern_var(pattern, obj, match);
+
+    if (lisp_type(pattern) != lisp_type(obj))
+	return 0;
+
+    switch (lisp_type(pattern))
+    {
+	case LISP_TYPE_SYMBOL :
+	    return strcmp(lisp_symbol(pattern), lisp_symbol(obj)) == 0;
+
+	case LISP_TYPE_STRING :
+	    return strcmp(lisp_string(pattern), lisp_string(obj)) == 0;
+
+	case LISP_TYPE_INTEGER :
+	    return lisp_integer(pattern) == lisp_integer(obj);
+
+        case LISP_TYPE_REAL :
+            return lisp_real(pattern) == lisp_real(obj);
+
+	case LISP_TYPE_CONS :
+	    {
+		int result1, result2;
+
+		result1 = _match_pattern(lisp_car(pattern), lisp_car(obj), match);
+		result2 = _match_pattern(lisp_cdr(pattern), lisp_cdr(obj), match);
+
+		return result1 && result2;
+	    }
+	    break;
+
+	default :
+	    assert(0);
+    }
+
+    return 0;
+}
+
+int
+lisp_match_pattern (lisp_object_t *pattern, lisp_object_t *obj, lisp_object_t **vars, int num_subs)
+{
+    match_t match;
+    int i;
+
+    if (vars != 0)
+	for (i = 0; i < num_subs; ++i)
+	    vars[i] = &error_object;
+
+    match.vars = vars;
+    match.num_vars = num_subs;
+
+    return _match_pattern(pattern, obj, &match);
+}
+
+int
+lisp_match_pattern_bind (lisp_object_t *pattern, lisp_object_t *obj,
+			 const lisp_binding_t *bindings, int num_bindings, void *record)
+{
+    lisp_object_t *vars[LISP_MAX_BIND_VARS];
+    int i;
+
+    for (i = 0; i < num_bindings; ++i)
+	if (bindings[i].index < 0 || bindings[i].index >= LISP_MAX_BIND_VARS)
+	    return 0;
+
+    if (!lisp_match_pattern(pattern, obj, vars, LISP_MAX_BIND_VARS))
+	return 0;
+
+    /* the record is only written once everything matched and all
+       subexpressions can be converted */
+    for (i = 0; i < num_bindings; ++i)
+    {
+	lisp_object_t *var = vars[bindings[i].index];
+
+	if (var != &error_object && !_bindable(&bindings[i], var))
+	    return 0;
+    }
+
+    for (i = 0; i < num_bindings; ++i)
+    {
+	lisp_object_t *var = vars[bindings[i].index];
+
+	if (var != &error_object)
+	    _bind(&bindings[i], var, (char*)record);
+    }
+
+    return 1;
+}
+
+int
+lisp_match_string (const char *pattern_string, lisp_object_t *obj, lisp_object_t **vars)
+{
+    lisp_object_t *pattern;
+    int result;
+    int num_subs;
+
+    pattern = lisp_read_from_string(pattern_string);
+
+    if (pattern != 0 && (lisp_type(pattern) == LISP_TYPE_EOF
+			 || lisp_type(pattern) == LISP_TYPE_PARSE_ERROR))
+	return 0;
+
+    if (!lisp_compile_pattern(&pattern, &num_subs))
+    {
+	lisp_free(pattern);
+	return 0;
+    }
+
+    result = lisp_match_pattern(pattern, obj, vars, num_subs);
+
+    lisp_free(pattern);
+
+    return result;
+}
+
+int
+lisp_type (lisp_object_t *obj)
+{
+    if (obj == 0)
+	return LISP_TYPE_NIL;
+    return obj->type;
+}
+
+int
+lisp_integer (lisp_object_t *obj)
+{
+    int flags;
+
+    assert(obj->type == LISP_TYPE_INTEGER);
+
+    flags = __atomic_load_n(&obj->flags, __ATOMIC_ACQUIRE);
+    if (flags & LISP_OBJECT_LAZY)
+    {
+	int integer;
+
+	if (!(flags & LISP_OBJECT_DECODED))
+	    lisp_decode_number(obj);
+	__atomic_load(&obj->v.number.value.integer, &integer, __ATOMIC_RELAXED);
+	return integer;
+    }
+
+    return obj->v.integer;
+}
+
+char*
+lisp_symbol (lisp_object_t *obj)
+{
+    assert(obj->type == LISP_TYPE_SYMBOL);
+
+    return obj->v.string;
+}
+
+char*
+lisp_string (lisp_object_t *obj)
+{
+    assert(obj->type == LISP_TYPE_STRING);
+
+    return obj->v.string;
+}
+
+int
+lisp_boolean (lisp_object_t *obj)
+{
+    assert(obj->type == LISP_TYPE_BOOLEAN);
+
+    return obj->v.integer;
+}
+
+float
+lisp_real (lisp_object_t *obj)
+{
+    int flags;
+
+    assert(obj->type == LISP_TYPE_REAL || obj->type == LISP_TYPE_INTEGER);
+
+    if (obj->type == LISP_TYPE_INTEGER)
+	return lisp_integer(obj);
+
+    flags = __atomic_load_n(&obj->flags, __ATOMIC_ACQUIRE);
+    if (flags & LISP_OBJECT_LAZY)
+    {
+	float real;
+
+	if (!(flags & LISP_OBJECT_DECODED))
+	    lisp_decode_number(obj);
+	__atomic_load(&obj->v.number.value.real, &real, __ATOMIC_RELAXED);
+	return real;
+    }
+
+    return obj->v.real;
+}
+	   
+lisp_object_t*
+lisp_car (lisp_object_t *obj)
+{
+    assert(obj->type == LISP_TYPE_CONS || obj->type == LISP_TYPE_PATTERN_CONS);
+
+    return obj->v.cons.car;
+}
+
+lisp_object_t*
+lisp_cdr (lisp_object_t *obj)
+{
+    assert(obj->type == LISP_TYPE_CONS || obj->type == LISP_TYPE_PATTERN_CONS);
+
+    return obj->v.cons.cdr;
+}
+
+lisp_object_t*
+lisp_cxr (lisp_object_t *obj, const char *x)
+{
+    int i;
+
+    for (i = strlen(x) - 1; i >= 0; --i)
+	if (x[i] == 'a')
+	    obj = lisp_car(obj);
+	else if (x[i] == 'd')
+	    obj = lisp_cdr(obj);
+	else
+	    assert(0);
+
+    return obj;
+}
+
+int
+lisp_list_length (lisp_object_t *obj)
+{
+    int length = 0;
+
+    while (obj != 0)
+    {
+	assert(obj->type == LISP_TYPE_CONS || obj->type == LISP_TYPE_PATTERN_CONS);
+
+	++length;
+	obj = obj->v.cons.cdr;
+    }
+
+    return length;
+}
+
+lisp_object_t*
+lisp_list_nth_cdr (lisp_object_t *obj, int index)
+{
+    while (index > 0)
+    {
+	assert(obj != 0);
+	assert(obj->type == LISP_TYPE_CONS || obj->type == LISP_TYPE_PATTERN_CONS);
+
+	--index;
+	obj = obj->v.cons.cdr;
+    }
+
+    return obj;
+}
+
+lisp_object_t*
+lisp_list_nth (lisp_object_t *obj, int index)
+{
+    obj = lisp_list_nth_cdr(obj, index);
+
+    assert(obj != 0);
+
+    return obj->v.cons.car;
+}
+
+/* Hashes are combined such that the hash of a cons only depends on
+   the hash of its car and the hash of its cdr.  This lets lists be
+   hashed without recursing over their cdrs. */
+
+static uint64_t
+hash_mix (uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static uint64_t
+hash_string (const char *str)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*str != '\0')
+	h = (h ^ (unsigned char)*str++) * 0x100000001b3ULL;
+
+    return h;
+}
+
+static uint64_t
+hash_atom (lisp_object_t *obj)
+{
+    uint64_t h;
+
+    switch (lisp_type(obj))
+    {
+	case LISP_TYPE_NIL :
+	    return HASH_NIL;
+
+	case LISP_TYPE_SYMBOL :
+	case LISP_TYPE_STRING :
+	    h = hash_string(obj->v.string);
+	    break;
+
+	case LISP_TYPE_INTEGER :
+	    h = (uint64_t)(int64_t)lisp_integer(obj);
+	    break;
+
+	case LISP_TYPE_REAL :
+	    {
+		union { float f; uint32_t i; } u;
+
+		/* 0.0 and -0.0 are equal, so they must hash alike */
+		u.f = lisp_real(obj) == 0.0 ? 0.0 : lisp_real(obj);
+		h = u.i;
+	    }
+	    break;
+
+	case LISP_TYPE_BOOLEAN :
+	    h = lisp_boolean(obj);
+	    break;
+
+	case LISP_TYPE_PATTERN_VAR :
+	    h = ((uint64_t)obj->v.pattern.type << 32) ^ obj->v.pattern.index
+		^ lisp_hash(obj->v.pattern.sub);
+	    break;
+
+	default :
+	    h = 0;
+    }
+
+    return hash_mix(h ^ ((uint64_t)lisp_type(obj) << 56));
+}
+
+/* The contribution of obj as an element of a list. */
+static uint64_t
+hash_element (lisp_object_t *obj)
+{
+    if (lisp_type(obj) == LISP_TYPE_CONS || lisp_type(obj) == LISP_TYPE_PATTERN_CONS)
+	return hash_mix(lisp_hash(obj) ^ lisp_type(obj));
+
+    return hash_atom(obj);
+}
+
+/* Stores the hashes of all the sublists of the complete list, whose
+   conses were made by lisp_make_hashed_cons_with_allocator.  hash is
+   the hash of the whole list.  The hash of the cdr of each cons
+   follows from the hash of the cons and of the car, because
+   hash == hash(car) + HASH_LIST_FACTOR * hash(cdr). */
+static void
+hash_list (lisp_object_t *list, uint64_t hash)
+{
+    for (; list != 0 && (list->flags & LISP_OBJECT_HASHED); list = list->v.cons.cdr)
+    {
+	uint64_t car_hash = LISP_OBJECT_HASH(list);
+
+	LISP_OBJECT_HASH(list) = hash;
+	hash = (hash - car_hash) * HASH_LIST_INVERSE;
+    }
+}
+
+uint64_t
+lisp_hash (lisp_object_t *obj)
+{
+    uint64_t h = 0, factor = 1;
+
+    while (lisp_type(obj) == LISP_TYPE_CONS || lisp_type(obj) == LISP_TYPE_PATTERN_CONS)
+    {
+	if (obj->flags & LISP_OBJECT_HASHED)
+	    return h + LISP_OBJECT_HASH(obj) * factor;
+
+	h += hash_element(obj->v.cons.car) * factor;
+	factor *= HASH_LIST_FACTOR;
+
+	obj = obj->v.cons.cdr;
+    }
+
+    return h + hash_atom(obj) * factor;
+}
+
+int
+lisp_equal (lisp_object_t *a, lisp_object_t *b)
+{
+    for (;;)
+    {
+	if (a == b)
+	    return 1;
+
+	if (lisp_type(a) != lisp_type(b))
+	    return 0;
+
+	switch (lisp_type(a))
+	{
+	    case LISP_TYPE_SYMBOL :
+	    case LISP_TYPE_STRING :
+		return strcmp(a->v.string, b->v.string) == 0;
+
+	    case LISP_TYPE_INTEGER :
+		return lisp_integer(a) == lisp_integer(b);
+
+	    case LISP_TYPE_REAL :
+		return lisp_real(a) == lisp_real(b);
+
+	    case LISP_TYPE_BOOLEAN :
+		return lisp_boolean(a) == lisp_boolean(b);
+
+	    case LISP_TYPE_PATTERN_VAR :
+		return a->v.pattern.type == b->v.pattern.type
+		    && a->v.pattern.index == b->v.pattern.index
+		    && lisp_equal(a->v.pattern.sub, b->v.pattern.sub);
+
+	    case LISP_TYPE_CONS :
+	    case LISP_TYPE_PATTERN_CONS :
+		if ((a->flags & b->flags & LISP_OBJECT_HASHED)
+		    && LISP_OBJECT_HASH(a) != LISP_OBJECT_HASH(b))
+		    return 0;
+		if (!lisp_equal(a->v.cons.car, b->v.cons.car))
+		    return 0;
+		a = a->v.cons.cdr;
+		b = b->v.cons.cdr;
+		break;
+
+	    default :
+		return 0;
+	}
+    }
+}
+
+int
+lisp_print_nil (FILE *out)
+{
+    if (fputs("()", out) == EOF)
+	return 0;
+    return 1;
+}
+
+int
+lisp_print_open_paren (FILE *out)
+{
+    if (fputc('(', out) == EOF)
+	return 0;
+    return 1;
+}
+
+int
+lisp_print_close_paren (FILE *out)
+{
+    if (fputc(')', out) == EOF)
+	return 0;
+    return 1;
+}
+
+int
+lisp_print_dot (FILE *out)
+{
+    if (fputs(". ", out) == EOF)
+	return 0;
+    return 1;
+}
+
+int
+lisp_print_integer (int integer, FILE *out)
+{
+    if (fprintf(out, "%d ", integer) < 0)
+	return 0;
+    return 1;
+}
+
+int
+lisp_print_real (float real, FILE *out)
+{
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    g_ascii_formatd(buf, G_ASCII_DTOSTR_BUF_SIZE, "%f", real);
+
+    if (fprintf(out, "%s ", buf) < 0)
+	return 0;
+    return 1;
+}
+
+int
+lisp_print_symbol (const char *symbol, FILE *out)
+{
+    if (fprintf(out, "%s ", symbol) < 0)
+	return 0;
+    return 1;
+}
+
+int
+lisp_print_string (const char *string, FILE *out)
+{
+    const char *p;
+
+    if (fputc('"', out) == EOF)
+	return 0;
+
+    for (p = string; *p != 0; ++p)
+    {
+	if (*p == '"' || *p == '\\')
+	{
+	    if (fputc('\\', out) == EOF)
+		return 0;
+	}
+
+	if (fputc(*p, out) == EOF)
+	    return 0;
+    }
+
+    if (fputs("\" ", out) == EOF)
+	return 0;
+    return 1;
+}
 
-static int
-_match_pattern_var (lisp_object_t *pattern, lisp_object_t *obj, lisp_object_t **vars)
+int
+lisp_print_boolean (int boolean, FILE *out)
 {
-    assert(lisp_type(pattern) == LISP_TYPE_PATTERN_VAR);
+    if (fprintf(out, "#%c ", boolean ? 't' : 'f') < 0)
+	return 0;
+    return 1;
+}
 
-    switch (pattern->v.pattern.type)
+void
+lisp_dump (lisp_object_t *obj, FILE *out)
+{
+    if (obj == 0)
     {
-	case LISP_PATTERN_ANY :
-	    break;
+	lisp_print_nil(out);
+	return;
+    }
 
-	case LISP_PATTERN_SYMBOL :
-	    if (lisp_type(obj) != LISP_TYPE_SYMBOL)
-		return 0;
+    switch (lisp_type(obj))
+    {
+	case LISP_TYPE_EOF :
+	    fputs("#<eof>", out);
 	    break;
 
-	case LISP_PATTERN_STRING :
-	    if (lisp_type(obj) != LISP_TYPE_STRING)
-		return 0;
+	case LISP_TYPE_PARSE_ERROR :
+	    fputs("#<error>", out);
 	    break;
 
-	case LISP_PATTERN_INTEGER :
-	    if (lisp_type(obj) != LISP_TYPE_INTEGER)
-		return 0;
+	case LISP_TYPE_INTEGER :
+	case LISP_TYPE_REAL :
+	    /* lazy numbers are printed exactly as they were read */
+	    if (__atomic_load_n(&obj->flags, __ATOMIC_RELAXED) & LISP_OBJECT_LAZY)
+		fprintf(out, "%.*s ", obj->v.number.length, obj->v.number.text);
+	    else if (lisp_type(obj) == LISP_TYPE_INTEGER)
+		lisp_print_integer(lisp_integer(obj), out);
+	    else
+		lisp_print_real(lisp_real(obj), out);
 	    break;
 
-        case LISP_PATTERN_REAL :
-	    if (lisp_type(obj) != LISP_TYPE_REAL)
-		return 0;
-	    break;
-	  
-	case LISP_PATTERN_BOOLEAN :
-	    if (lisp_type(obj) != LISP_TYPE_BOOLEAN)
-		return 0;
+	case LISP_TYPE_SYMBOL :
+	    lisp_print_symbol(lisp_symbol(obj), out);
 	    break;
 
-	case LISP_PATTERN_LIST :
-	    if (lisp_type(obj) != LISP_TYPE_CONS
-		&& lisp_type(obj) != LISP_TYPE_NIL)
-		return 0;
+	case LISP_TYPE_STRING :
+	    lisp_print_string(lisp_string(obj), out);
 	    break;
 
-	case LISP_PATTERN_OR :
+	case LISP_TYPE_CONS :
+	case LISP_TYPE_PATTERN_CONS :
+	    if (lisp_type(obj) == LISP_TYPE_CONS)
+		lisp_print_open_paren(out);
+	    else
+		fputs("#?(", out);
+	    while (obj != 0)
 	    {
-		lisp_object_t *sub;
-		int matched = 0;
-
-		for (sub = pattern->v.pattern.sub; sub != 0; sub = lisp_cdr(sub))
+		lisp_dump(lisp_car(obj), out);
+		obj = lisp_cdr(obj);
+		if (obj != 0)
 		{
-		    assert(lisp_type(sub) == LISP_TYPE_CONS);
-
-		    if (_match_pattern(lisp_car(sub), obj, vars))
-			matched = 1;
+		    if (lisp_type(obj) != LISP_TYPE_CONS
+			&& lisp_type(obj) != LISP_TYPE_PATTERN_CONS)
+		    {
+			lisp_print_dot(out);
+			lisp_dump(obj, out);
+			break;
+		    }
 		}
-
-		if (!matched)
-		    return 0;
 	    }
+	    lisp_print_close_paren(out);
 	    break;
 
-	case LISP_PATTERN_NUMBER :
-	    if (lisp_type(obj) != LISP_TYPE_INTEGER
-		&& lisp_type(obj) != LISP_TYPE_REAL)
-		return 0;
+	case LISP_TYPE_BOOLEAN :
+	    lisp_print_boolean(lisp_boolean(obj), out);
 	    break;
 
 	default :
 	    assert(0);
     }
+}
 
-    if (vars != 0)
-	vars[pattern->v.pattern.index] = obj;
+lisp_object_t*
+lisp_proplist_lookup_symbol (lisp_object_t *list, const char *key)
+{
+    while (lisp_cons_p(list))
+    {
+	if (lisp_symbol_p(lisp_car(list)) && strcmp(key, lisp_symbol(lisp_car(list))) == 0)
+	{
+	    if (lisp_cons_p(lisp_cdr(list)))
+		return lisp_car(lisp_cdr(list));
+	    return lisp_nil();
+	}
 
-    return 1;
+	if (lisp_cons_p(lisp_cdr(list)))
+	    list = lisp_cdr(lisp_cdr(list));
+	else
+	    return lisp_nil();
+    }
+
+    return lisp_nil();
 }
 
-static int
-_match_pattern (lisp_object_t *pattern, lisp_object_t *obj, lisp_object_t **vars)
+typedef struct
 {
-    if (pattern == 0)
-	return obj == 0;
+    uint64_t hash;
+    const char *key;
+    lisp_object_t *value;
+} proplist_entry_t;
 
-    if (lisp_type(pattern) == LISP_TYPE_PATTERN_VAR)
-	return _match_pattern_var(pattern, obj, vars);
+struct _lisp_proplist_index_t
+{
+    size_t mask;
+    proplist_entry_t entries[];
+};
 
-    if (lisp_type(pattern) != lisp_type(obj))
-	return 0;
+static void
+proplist_index_insert (lisp_proplist_index_t *index, lisp_object_t *key, lisp_object_t *value)
+{
+    uint64_t hash = hash_string(lisp_symbol(key));
+    size_t i;
 
-    switch (lisp_type(pattern))
+    for (i = hash & index->mask; index->entries[i].key != 0; i = (i + 1) & index->mask)
     {
-	case LISP_TYPE_SYMBOL :
-	    return strcmp(lisp_symbol(pattern), lisp_symbol(obj)) == 0;
-
-	case LISP_TYPE_STRING :
-	    return strcmp(lisp_string(pattern), lisp_string(obj)) == 0;
-
-	case LISP_TYPE_INTEGER :
-	    return lisp_integer(pattern) == lisp_integer(obj);
+	/* the first occurrence of a key wins, like in a linear lookup */
+	if (index->entries[i].hash == hash && strcmp(index->entries[i].key, lisp_symbol(key)) == 0)
+	    return;
+    }
 
-        case LISP_TYPE_REAL :
-            return lisp_real(pattern) == lisp_real(obj);
+    index->entries[i].hash = hash;
+    index->entries[i].key = lisp_symbol(key);
+    index->entries[i].value = value;
+}
 
-	case LISP_TYPE_CONS :
-	    {
-		int result1, result2;
+static lisp_proplist_index_t*
+proplist_index_new (allocator_t *allocator, int num_keys)
+{
+    lisp_proplist_index_t *index;
+    size_t size = 8, byte_size;
 
-		result1 = _match_pattern(lisp_car(pattern), lisp_car(obj), vars);
-		result2 = _match_pattern(lisp_cdr(pattern), lisp_cdr(obj), vars);
+    /* keep the load factor at 1/2 at most */
+    while (size < 2 * num_keys)
+	size *= 2;
 
-		return result1 && result2;
-	    }
-	    break;
+    byte_size = sizeof(lisp_proplist_index_t) + size * sizeof(proplist_entry_t);
+    index = (lisp_proplist_index_t*)allocator_alloc(allocator, byte_size);
+    if (index == 0)
+	return 0;
 
-	default :
-	    assert(0);
-    }
+    memset(index, 0, byte_size);
+    index->mask = size - 1;
 
-    return 0;
+    return index;
 }
 
-int
-lisp_match_pattern (lisp_object_t *pattern, lisp_object_t *obj, lisp_object_t **vars, int num_subs)
+lisp_proplist_index_t*
+lisp_proplist_index_with_allocator (allocator_t *allocator, lisp_object_t *list)
 {
-    int i;
+    lisp_proplist_index_t *index;
+    lisp_object_t *l;
+    int num_keys = 0;
 
-    if (vars != 0)
-	for (i = 0; i < num_subs; ++i)
-	    vars[i] = &error_object;
+    for (l = list; lisp_cons_p(l) && lisp_cons_p(lisp_cdr(l)); l = lisp_cdr(lisp_cdr(l)))
+	++num_keys;
 
-    return _match_pattern(pattern, obj, vars);
+    index = proplist_index_new(allocator, num_keys);
+    if (index == 0)
+	return 0;
+
+    for (l = list; lisp_cons_p(l) && lisp_cons_p(lisp_cdr(l)); l = lisp_cdr(lisp_cdr(l)))
+	if (lisp_symbol_p(lisp_car(l)))
+	    proplist_index_insert(index, lisp_car(l), lisp_car(lisp_cdr(l)));
+
+    return index;
 }
 
-int
-lisp_match_string (const char *pattern_string, lisp_object_t *obj, lisp_object_t **vars)
+lisp_proplist_index_t*
+lisp_proplist_index (lisp_object_t *list)
 {
-    lisp_object_t *pattern;
-    int result;
-    int num_subs;
+    return lisp_proplist_index_with_allocator(&malloc_allocator, list);
+}
 
-    pattern = lisp_read_from_string(pattern_string);
+lisp_proplist_index_t*
+lisp_alist_index_with_allocator (allocator_t *allocator, lisp_object_t *list)
+{
+    lisp_proplist_index_t *index;
+    lisp_object_t *l;
+    int num_keys = 0;
 
-    if (pattern != 0 && (lisp_type(pattern) == LISP_TYPE_EOF
-			 || lisp_type(pattern) == LISP_TYPE_PARSE_ERROR))
-	return 0;
+    for (l = list; lisp_cons_p(l); l = lisp_cdr(l))
+	++num_keys;
 
-    if (!lisp_compile_pattern(&pattern, &num_subs))
-    {
-	lisp_free(pattern);
+    index = proplist_index_new(allocator, num_keys);
+    if (index == 0)
 	return 0;
-    }
 
-    result = lisp_match_pattern(pattern, obj, vars, num_subs);
+    for (l = list; lisp_cons_p(l); l = lisp_cdr(l))
+    {
+	lisp_object_t *entry = lisp_car(l);
 
-    lisp_free(pattern);
+	if (lisp_cons_p(entry) && lisp_symbol_p(lisp_car(entry)))
+	    proplist_index_insert(index, lisp_car(entry), lisp_cdr(entry));
+    }
 
-    return result;
+    return index;
 }
 
-int
-lisp_type (lisp_object_t *obj)
+lisp_proplist_index_t*
+lisp_alist_index (lisp_object_t *list)
 {
-    if (obj == 0)
-	return LISP_TYPE_NIL;
-    return obj->type;
+    return lisp_alist_index_with_allocator(&malloc_allocator, list);
 }
 
-int
-lisp_integer (lisp_object_t *obj)
+lisp_object_t*
+lisp_proplist_index_lookup (const lisp_proplist_index_t *index, const char *key)
 {
-    assert(obj->type == LISP_TYPE_INTEGER);
+    uint64_t hash = hash_string(key);
+    size_t i;
 
-    return obj->v.integer;
+    for (i = hash & index->mask; index->entries[i].key != 0; i = (i + 1) & index->mask)
+	if (index->entries[i].hash == hash && strcmp(index->entries[i].key, key) == 0)
+	    return index->entries[i].value;
+
+    return lisp_nil();
 }
 
-char*
-lisp_symbol (lisp_object_t *obj)
+void
+lisp_proplist_index_free_with_allocator (allocator_t *allocator, lisp_proplist_index_t *index)
 {
-    assert(obj->type == LISP_TYPE_SYMBOL);
-
-    return obj->v.string;
+    allocator_free(allocator, index);
 }
 
-char*
-lisp_string (lisp_object_t *obj)
+void
+lisp_proplist_index_free (lisp_proplist_index_t *index)
 {
-    assert(obj->type == LISP_TYPE_STRING);
-
-    return obj->v.string;
+    lisp_proplist_index_free_with_allocator(&malloc_allocator, index);
 }
 
-int
-lisp_boolean (lisp_object_t *obj)
+typedef struct
 {
-    assert(obj->type == LISP_TYPE_BOOLEAN);
-
-    return obj->v.integer;
-}
+    uint64_t hash;
+    lisp_object_t *obj;
+} hashcons_entry_t;
 
-float
-lisp_real (lisp_object_t *obj)
+struct _lisp_hashcons_t
 {
-    assert(obj->type == LISP_TYPE_REAL || obj->type == LISP_TYPE_INTEGER);
+    allocator_t *allocator;
+    size_t mask;
+    size_t count;
+    hashcons_entry_t *entries;
 
-    if (obj->type == LISP_TYPE_INTEGER)
-	return obj->v.integer;
-    return obj->v.real;
-}
-	   
-lisp_object_t*
-lisp_car (lisp_object_t *obj)
+    /* the interned elements of the lists which are being built */
+    lisp_object_t **stack;
+    size_t stack_size;
+    size_t stack_top;
+};
+
+#define HASHCONS_INITIAL_SIZE     1024
+
+static uint64_t
+hashcons_hash (lisp_object_t *obj)
 {
-    assert(obj->type == LISP_TYPE_CONS || obj->type == LISP_TYPE_PATTERN_CONS);
+    /* the car and cdr of a cons are already interned, so their
+       addresses identify them */
+    if (obj->type == LISP_TYPE_CONS || obj->type == LISP_TYPE_PATTERN_CONS)
+	return hash_mix(((uint64_t)(uintptr_t)obj->v.cons.car * HASH_LIST_FACTOR)
+			^ (uint64_t)(uintptr_t)obj->v.cons.cdr ^ (uint64_t)obj->type);
 
-    return obj->v.cons.car;
+    return hash_atom(obj);
 }
 
-lisp_object_t*
-lisp_cdr (lisp_object_t *obj)
+static int
+hashcons_equal (lisp_object_t *a, lisp_object_t *b)
 {
-    assert(obj->type == LISP_TYPE_CONS || obj->type == LISP_TYPE_PATTERN_CONS);
+    if (a->type != b->type)
+	return 0;
 
-    return obj->v.cons.cdr;
+    switch (a->type)
+    {
+	case LISP_TYPE_CONS :
+	case LISP_TYPE_PATTERN_CONS :
+	    return a->v.cons.car == b->v.cons.car && a->v.cons.cdr == b->v.cons.cdr;
+
+	case LISP_TYPE_REAL :
+	    /* unlike lisp_equal, 0.0 and -0.0 are kept apart */
+	    return memcmp(&a->v.real, &b->v.real, sizeof(float)) == 0;
+
+	default :
+	    return lisp_equal(a, b);
+    }
 }
 
-lisp_object_t*
-lisp_cxr (lisp_object_t *obj, const char *x)
+static lisp_object_t*
+hashcons_copy (allocator_t *allocator, lisp_object_t *obj)
 {
-    int i;
+    switch (obj->type)
+    {
+	case LISP_TYPE_SYMBOL :
+	    return lisp_make_symbol_with_allocator(allocator, obj->v.string);
 
-    for (i = strlen(x) - 1; i >= 0; --i)
-	if (x[i] == 'a')
-	    obj = lisp_car(obj);
-	else if (x[i] == 'd')
-	    obj = lisp_cdr(obj);
-	else
-	    assert(0);
+	case LISP_TYPE_STRING :
+	    return lisp_make_string_with_allocator(allocator, obj->v.string);
 
-    return obj;
+	case LISP_TYPE_INTEGER :
+	    return lisp_make_integer_with_allocator(allocator, obj->v.integer);
+
+	case LISP_TYPE_REAL :
+	    return lisp_make_real_with_allocator(allocator, obj->v.real);
+
+	case LISP_TYPE_BOOLEAN :
+	    return lisp_make_boolean_with_allocator(allocator, obj->v.integer);
+
+	case LISP_TYPE_CONS :
+	    return lisp_make_cons_with_allocator(allocator, obj->v.cons.car, obj->v.cons.cdr);
+
+	case LISP_TYPE_PATTERN_CONS :
+	    return lisp_make_pattern_cons_with_allocator(allocator, obj->v.cons.car, obj->v.cons.cdr);
+
+	case LISP_TYPE_PATTERN_VAR :
+	    return lisp_make_pattern_var_with_allocator(allocator, obj->v.pattern.type,
+							obj->v.pattern.index, obj->v.pattern.sub);
+    }
+
+    assert(0);
+    return 0;
 }
 
-int
-lisp_list_length (lisp_object_t *obj)
+static int
+hashcons_grow (lisp_hashcons_t *table)
 {
-    int length = 0;
+    size_t size = 2 * (table->mask + 1), i, j;
+    hashcons_entry_t *entries;
 
-    while (obj != 0)
+    entries = (hashcons_entry_t*)allocator_alloc(table->allocator, size * sizeof(hashcons_entry_t));
+    if (entries == 0)
+	return 0;
+    memset(entries, 0, size * sizeof(hashcons_entry_t));
+
+    for (i = 0; i <= table->mask; ++i)
     {
-	assert(obj->type == LISP_TYPE_CONS || obj->type == LISP_TYPE_PATTERN_CONS);
+	if (table->entries[i].obj == 0)
+	    continue;
 
-	++length;
-	obj = obj->v.cons.cdr;
+	for (j = table->entries[i].hash & (size - 1); entries[j].obj != 0; j = (j + 1) & (size - 1))
+	    ;
+	entries[j] = table->entries[i];
     }
 
-    return length;
+    allocator_free(table->allocator, table->entries);
+    table->entries = entries;
+    table->mask = size - 1;
+
+    return 1;
 }
 
-lisp_object_t*
-lisp_list_nth_cdr (lisp_object_t *obj, int index)
+/* Returns the node of table which is equal to probe, adding a copy of
+   probe if there is none.  probe is a temporary object whose car and
+   cdr or sub pattern are already interned.  Returns 0 if there is not
+   enough memory. */
+static lisp_object_t*
+hashcons_intern (lisp_hashcons_t *table, lisp_object_t *probe)
 {
-    while (index > 0)
-    {
-	assert(obj != 0);
-	assert(obj->type == LISP_TYPE_CONS || obj->type == LISP_TYPE_PATTERN_CONS);
+    uint64_t hash;
+    lisp_object_t *obj;
+    size_t i;
 
-	--index;
-	obj = obj->v.cons.cdr;
-    }
+    /* keep the load factor at 1/2 at most */
+    if (2 * (table->count + 1) > table->mask + 1 && !hashcons_grow(table))
+	return 0;
+
+    hash = hashcons_hash(probe);
+    for (i = hash & table->mask; table->entries[i].obj != 0; i = (i + 1) & table->mask)
+	if (table->entries[i].hash == hash && hashcons_equal(table->entries[i].obj, probe))
+	    return table->entries[i].obj;
+
+    obj = hashcons_copy(table->allocator, probe);
+    if (obj == 0)
+	return 0;
+
+    table->entries[i].hash = hash;
+    table->entries[i].obj = obj;
+    ++table->count;
 
     return obj;
 }
 
-lisp_object_t*
-lisp_list_nth (lisp_object_t *obj, int index)
+static int
+hashcons_push (lisp_hashcons_t *table, lisp_object_t *obj)
 {
-    obj = lisp_list_nth_cdr(obj, index);
+    if (table->stack_top == table->stack_size)
+    {
+	size_t size = table->stack_size == 0 ? 64 : 2 * table->stack_size;
+	lisp_object_t **stack = (lisp_object_t**)allocator_alloc(table->allocator, size * sizeof(lisp_object_t*));
 
-    assert(obj != 0);
+	if (stack == 0)
+	    return 0;
 
-    return obj->v.cons.car;
-}
+	if (table->stack != 0)
+	{
+	    memcpy(stack, table->stack, table->stack_top * sizeof(lisp_object_t*));
+	    allocator_free(table->allocator, table->stack);
+	}
+	table->stack = stack;
+	table->stack_size = size;
+    }
+
+    table->stack[table->stack_top++] = obj;
 
-int
-lisp_print_nil (FILE *out)
-{
-    if (fputs("()", out) == EOF)
-	return 0;
     return 1;
 }
 
-int
-lisp_print_open_paren (FILE *out)
+/* Interns the list whose elements from base to the top of the stack
+   were pushed by hashcons_push, and pops them.  Only the first cons
+   gets the type head_type, like in _read_list. */
+static lisp_object_t*
+hashcons_pop_list (lisp_hashcons_t *table, size_t base, int head_type, lisp_object_t *tail)
 {
-    if (fputc('(', out) == EOF)
-	return 0;
-    return 1;
+    lisp_object_t probe;
+
+    probe.flags = 0;
+
+    while (table->stack_top > base)
+    {
+	probe.type = table->stack_top == base + 1 ? head_type : LISP_TYPE_CONS;
+	probe.v.cons.car = table->stack[--table->stack_top];
+	probe.v.cons.cdr = tail;
+
+	tail = hashcons_intern(table, &probe);
+	if (tail == 0)
+	{
+	    table->stack_top = base;
+	    return &error_object;
+	}
+    }
+
+    return tail;
 }
 
-int
-lisp_print_close_paren (FILE *out)
+lisp_hashcons_t*
+lisp_hashcons_new_with_allocator (allocator_t *allocator)
 {
-    if (fputc(')', out) == EOF)
+    lisp_hashcons_t *table;
+
+    table = (lisp_hashcons_t*)allocator_alloc(allocator, sizeof(lisp_hashcons_t));
+    if (table == 0)
 	return 0;
-    return 1;
-}
 
-int
-lisp_print_dot (FILE *out)
-{
-    if (fputs(". ", out) == EOF)
+    table->entries = (hashcons_entry_t*)allocator_alloc(allocator, HASHCONS_INITIAL_SIZE * sizeof(hashcons_entry_t));
+    if (table->entries == 0)
+    {
+	allocator_free(allocator, table);
 	return 0;
-    return 1;
+    }
+    memset(table->entries, 0, HASHCONS_INITIAL_SIZE * sizeof(hashcons_entry_t));
+
+    table->allocator = allocator;
+    table->mask = HASHCONS_INITIAL_SIZE - 1;
+    table->count = 0;
+    table->stack = 0;
+    table->stack_size = 0;
+    table->stack_top = 0;
+
+    return table;
 }
 
-int
-lisp_print_integer (int integer, FILE *out)
+lisp_hashcons_t*
+lisp_hashcons_new (void)
 {
-    if (fprintf(out, "%d ", integer) < 0)
-	return 0;
-    return 1;
+    return lisp_hashcons_new_with_allocator(&malloc_allocator);
 }
 
-int
-lisp_print_real (float real, FILE *out)
+void
+lisp_hashcons_free (lisp_hashcons_t *table)
 {
-    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    allocator_t *allocator = table->allocator;
+    size_t i;
 
-    g_ascii_formatd(buf, G_ASCII_DTOSTR_BUF_SIZE, "%f", real);
+    /* the nodes share their children, so they must not be freed with
+       lisp_free */
+    for (i = 0; i <= table->mask; ++i)
+    {
+	lisp_object_t *obj = table->entries[i].obj;
 
-    if (fprintf(out, "%s ", buf) < 0)
-	return 0;
-    return 1;
+	if (obj == 0)
+	    continue;
+	if (obj->type == LISP_TYPE_SYMBOL || obj->type == LISP_TYPE_STRING)
+	    allocator_free(allocator, obj->v.string);
+	allocator_free(allocator, obj);
+    }
+
+    if (table->stack != 0)
+	allocator_free(allocator, table->stack);
+    allocator_free(allocator, table->entries);
+    allocator_free(allocator, table);
 }
 
-int
-lisp_print_symbol (const char *symbol, FILE *out)
+size_t
+lisp_hashcons_count (lisp_hashcons_t *table)
 {
-    if (fprintf(out, "%s ", symbol) < 0)
-	return 0;
-    return 1;
+    return table->count;
 }
 
-int
-lisp_print_string (const char *string, FILE *out)
-{
-    const char *p;
+static lisp_object_t* _read_hashconsed (lisp_hashcons_t *table, lisp_stream_t *in, int token);
 
-    if (fputc('"', out) == EOF)
-	return 0;
+/* Reads the rest of a list like _read_list, but keeps the elements
+   on the stack of table and interns the conses back to front after
+   the closing parenthesis. */
+static lisp_object_t*
+_read_list_hashconsed (lisp_hashcons_t *table, lisp_stream_t *in, int open_token, int token)
+{
+    size_t base = table->stack_top;
+    lisp_object_t *tail = lisp_nil(), *car;
 
-    for (p = string; *p != 0; ++p)
+    for (;; token = SCAN(in))
     {
-	if (*p == '"' || *p == '\\')
+	if (token == TOKEN_CLOSE_PAREN)
+	    break;
+
+	if (token == TOKEN_DOT)
 	{
-	    if (fputc('\\', out) == EOF)
-		return 0;
+	    if (table->stack_top == base)
+		goto error;
+
+	    token = SCAN(in);
+	    if (token == TOKEN_CLOSE_PAREN || token == TOKEN_DOT)
+		goto error;
+
+	    tail = _read_hashconsed(table, in, token);
+	    if (tail == &error_object || tail == &end_marker)
+		goto error;
+
+	    if (SCAN(in) != TOKEN_CLOSE_PAREN)
+		goto error;
+	    break;
 	}
 
-	if (fputc(*p, out) == EOF)
-	    return 0;
+	car = _read_hashconsed(table, in, token);
+	if (car == &error_object || car == &end_marker || !hashcons_push(table, car))
+	    goto error;
     }
 
-    if (fputs("\" ", out) == EOF)
-	return 0;
-    return 1;
-}
+    return hashcons_pop_list(table, base,
+			     open_token == TOKEN_OPEN_PAREN ? LISP_TYPE_CONS : LISP_TYPE_PATTERN_CONS,
+			     tail);
 
-int
-lisp_print_boolean (int boolean, FILE *out)
-{
-    if (fprintf(out, "#%c ", boolean ? 't' : 'f') < 0)
-	return 0;
-    return 1;
+ error:
+    table->stack_top = base;
+
+    return &error_object;
 }
 
-void
-lisp_dump (lisp_object_t *obj, FILE *out)
+static lisp_object_t*
+_read_hashconsed (lisp_hashcons_t *table, lisp_stream_t *in, int token)
 {
-    if (obj == 0)
-    {
-	lisp_print_nil(out);
-	return;
-    }
+    lisp_object_t probe, *obj;
 
-    switch (lisp_type(obj))
+    probe.flags = 0;
+
+    switch (token)
     {
-	case LISP_TYPE_EOF :
-	    fputs("#<eof>", out);
-	    break;
+	case TOKEN_ERROR :
+	    return &error_object;
 
-	case LISP_TYPE_PARSE_ERROR :
-	    fputs("#<error>", out);
-	    break;
+	case TOKEN_EOF :
+	    return &end_marker;
 
-	case LISP_TYPE_INTEGER :
-	    lisp_print_integer(lisp_integer(obj), out);
+	case TOKEN_OPEN_PAREN :
+	case TOKEN_PATTERN_OPEN_PAREN :
+	    return _read_list_hashconsed(table, in, token, SCAN(in));
+
+	case TOKEN_CLOSE_PAREN :
+	    return &close_paren_marker;
+
+	case TOKEN_DOT :
+	    return &dot_marker;
+
+	case TOKEN_SYMBOL :
+	case TOKEN_STRING :
+	    if (token == TOKEN_SYMBOL && IS_STREAM_MMAPPED(in))
+		copy_mmapped_token();
+	    probe.type = token == TOKEN_SYMBOL ? LISP_TYPE_SYMBOL : LISP_TYPE_STRING;
+	    probe.v.string = token_string;
 	    break;
 
-        case LISP_TYPE_REAL :
-	    lisp_print_real(lisp_real(obj), out);
+	case TOKEN_INTEGER :
+	    probe.type = LISP_TYPE_INTEGER;
+	    if (IS_STREAM_MMAPPED(in))
+		probe.v.integer = my_atoi(mmap_token_start, mmap_token_stop);
+	    else
+		probe.v.integer = atoi(token_string);
 	    break;
 
-	case LISP_TYPE_SYMBOL :
-	    lisp_print_symbol(lisp_symbol(obj), out);
+	case TOKEN_REAL :
+	    if (IS_STREAM_MMAPPED(in))
+		copy_mmapped_token();
+	    probe.type = LISP_TYPE_REAL;
+	    probe.v.real = (float)g_ascii_strtod(token_string, NULL);
 	    break;
 
-	case LISP_TYPE_STRING :
-	    lisp_print_string(lisp_string(obj), out);
+	case TOKEN_TRUE :
+	case TOKEN_FALSE :
+	    probe.type = LISP_TYPE_BOOLEAN;
+	    probe.v.integer = token == TOKEN_TRUE;
 	    break;
 
+	default :
+	    assert(0);
+	    return &error_object;
+    }
+
+    obj = hashcons_intern(table, &probe);
+    if (obj == 0)
+	return &error_object;
+
+    return obj;
+}
+
+lisp_object_t*
+lisp_read_hashconsed (lisp_hashcons_t *table, lisp_stream_t *in)
+{
+    return _read_hashconsed(table, in, SCAN(in));
+}
+
+lisp_object_t*
+lisp_hashcons (lisp_hashcons_t *table, lisp_object_t *obj)
+{
+    lisp_object_t probe, *car, *tail;
+    size_t base = table->stack_top;
+
+    probe.flags = 0;
+    probe.type = lisp_type(obj);
+
+    switch (lisp_type(obj))
+    {
+	case LISP_TYPE_NIL :
+	case LISP_TYPE_INTERNAL :
+	case LISP_TYPE_PARSE_ERROR :
+	case LISP_TYPE_EOF :
+	    return obj;
+
 	case LISP_TYPE_CONS :
 	case LISP_TYPE_PATTERN_CONS :
-	    if (lisp_type(obj) == LISP_TYPE_CONS)
-		lisp_print_open_paren(out);
-	    else
-		fputs("#?(", out);
-	    while (obj != 0)
+	    for (tail = obj; tail == obj || lisp_type(tail) == LISP_TYPE_CONS; tail = tail->v.cons.cdr)
 	    {
-		lisp_dump(lisp_car(obj), out);
-		obj = lisp_cdr(obj);
-		if (obj != 0)
+		car = lisp_hashcons(table, tail->v.cons.car);
+		if (car == &error_object || !hashcons_push(table, car))
 		{
-		    if (lisp_type(obj) != LISP_TYPE_CONS
-			&& lisp_type(obj) != LISP_TYPE_PATTERN_CONS)
-		    {
-			lisp_print_dot(out);
-			lisp_dump(obj, out);
-			break;
-		    }
+		    table->stack_top = base;
+		    return &error_object;
 		}
 	    }
-	    lisp_print_close_paren(out);
+
+	    tail = lisp_hashcons(table, tail);
+	    if (tail == &error_object)
+	    {
+		table->stack_top = base;
+		return &error_object;
+	    }
+
+	    return hashcons_pop_list(table, base, obj->type, tail);
+
+	case LISP_TYPE_SYMBOL :
+	case LISP_TYPE_STRING :
+	    probe.v.string = obj->v.string;
+	    break;
+
+	case LISP_TYPE_INTEGER :
+	    probe.v.integer = lisp_integer(obj);
+	    break;
+
+	case LISP_TYPE_REAL :
+	    probe.v.real = lisp_real(obj);
 	    break;
 
 	case LISP_TYPE_BOOLEAN :
-	    lisp_print_boolean(lisp_boolean(obj), out);
+	    probe.v.integer = obj->v.integer;
+	    break;
+
+	case LISP_TYPE_PATTERN_VAR :
+	    probe.v.pattern.type = obj->v.pattern.type;
+	    probe.v.pattern.index = obj->v.pattern.index;
+	    probe.v.pattern.sub = lisp_hashcons(table, obj->v.pattern.sub);
+	    if (probe.v.pattern.sub == &error_object)
+		return &error_object;
 	    break;
 
 	default :
 	    assert(0);
     }
-}
-
-lisp_object_t*
-lisp_proplist_lookup_symbol (lisp_object_t *list, const char *key)
-{
-    while (lisp_cons_p(list))
-    {
-	if (lisp_symbol_p(lisp_car(list)) && strcmp(key, lisp_symbol(lisp_car(list))) == 0)
-	{
-	    if (lisp_cons_p(lisp_cdr(list)))
-		return lisp_car(lisp_cdr(list));
-	    return lisp_nil();
-	}
 
-	if (lisp_cons_p(lisp_cdr(list)))
-	    list = lisp_cdr(lisp_cdr(list));
-	else
-	    return lisp_nil();
-    }
+    obj = hashcons_intern(table, &probe);
+    if (obj == 0)
+	return &error_object;
 
-    return lisp_nil();
+    return obj;
 }
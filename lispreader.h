@@ -23,16 +23,39 @@
 #define __LISPREADER_H__
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "allocator.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define LISP_STREAM_MMAP_FILE  1
 #define LISP_STREAM_STRING     2
 #define LISP_STREAM_FILE       3
 #define LISP_STREAM_ANY        4
+#define LISP_STREAM_BLOCKS     5
 
 #define LISP_LAST_MMAPPED_STREAM   LISP_STREAM_STRING
 
+#define LISP_READ_LAZY_NUMBERS     1
+#define LISP_READ_HASHES           2
+
+#define LISP_DEFAULT_MAX_TOKEN_LENGTH   (16 * 1024 * 1024)
+
+/* phases of reading, for lisp_stats_t */
+#define LISP_PHASE_SCAN         0
+#define LISP_PHASE_NUMBERS      1
+#define LISP_PHASE_SYMBOLS      2
+#define LISP_PHASE_ALLOC        3
+#define LISP_PHASE_LINK         4
+#define LISP_NUM_PHASES         5
+
+#define LISP_STATS_NUM_TOKENS        12
+#define LISP_STATS_LATENCY_BUCKETS   32
+
 #define LISP_TYPE_INTERNAL      -3
 #define LISP_TYPE_PARSE_ERROR   -2
 #define LISP_TYPE_EOF           -1
@@ -56,9 +79,33 @@
 #define LISP_PATTERN_OR         8
 #define LISP_PATTERN_NUMBER     9
 
+/* C types of the fields of lisp_binding_t */
+#define LISP_BIND_NONE          0
+#define LISP_BIND_INTEGER       1	/* int */
+#define LISP_BIND_REAL          2	/* float */
+#define LISP_BIND_BOOLEAN       3	/* int */
+#define LISP_BIND_SYMBOL        4	/* char* */
+#define LISP_BIND_STRING        5	/* char* */
+#define LISP_BIND_OBJECT        6	/* lisp_object_t* */
+
+/* pattern variables which lisp_match_pattern_bind can bind */
+#define LISP_MAX_BIND_VARS      64
+
+/* flags of lisp_object_t */
+#define LISP_OBJECT_LAZY           1 /* number which still carries its lexeme */
+#define LISP_OBJECT_DECODED        2 /* the value of a lazy number is cached */
+#define LISP_OBJECT_OWNS_TEXT      4 /* the lexeme was copied and must be freed */
+#define LISP_OBJECT_HASHED         8 /* cons followed by the hash of the list */
+
 typedef struct
 {
     int type;
+    int flags;
+    int last_char;		/* the last two characters read from file and */
+    int previous_char;		/* any streams, for lisp_read_recovering */
+    int bound;			/* whether reading stops at the next line
+				   starting with a parenthesis, for
+				   lisp_read_recovering */
 
     union
     {
@@ -68,6 +115,9 @@ typedef struct
 	    char *buf;
 	    char *end;
 	    char *pos;
+	    struct _lisp_locations_t *locations;
+	    char *unclosed;	/* an expression that does not end, found
+				   by lisp_read_recovering */
 	} mmap;
         struct
 	{
@@ -75,13 +125,58 @@ typedef struct
 	    int (*next_char) (void *data);
 	    void (*unget_char) (char c, void *data);
 	} any;
+	struct
+	{
+	    char *buf;
+	    char *end;
+	    char *pos;
+	    char *stop;		/* the end of the block while end is bounded */
+	    long offset;	/* of buf in the stream */
+	    int failed;		/* fill returned an error */
+	    void *data;
+	    int (*fill) (void *data, char **buf, size_t *length);
+	    void (*close) (void *data);
+	} blocks;
     } v;
 } lisp_stream_t;
 
+typedef struct
+{
+    unsigned long long cycles[LISP_NUM_PHASES];
+    unsigned long long tokens[LISP_STATS_NUM_TOKENS];
+    unsigned long long bytes;
+    unsigned long long calls;
+    unsigned long long latency[LISP_STATS_LATENCY_BUCKETS];
+} lisp_stats_t;
+
+typedef struct
+{
+    long expressions;
+    long lists;
+    long atoms;
+    int max_depth;
+    long error_offset;
+} lisp_validate_stats_t;
+
+typedef struct
+{
+    int index;			/* of the pattern variable */
+    int type;
+    size_t offset;		/* of the field in the record */
+} lisp_binding_t;
+
+#define LISP_BINDING(index,type,record_type,field)   { (index), (type), offsetof(record_type, field) }
+
+typedef struct _lisp_locations_t lisp_locations_t;
+typedef struct _lisp_path_t lisp_path_t;
+typedef struct _lisp_proplist_index_t lisp_proplist_index_t;
+typedef struct _lisp_hashcons_t lisp_hashcons_t;
+
 typedef struct _lisp_object_t lisp_object_t;
 struct _lisp_object_t
 {
     int type;
+    int flags;
 
     union
     {
@@ -95,6 +190,17 @@ struct _lisp_object_t
 	int integer;
 	float real;
 
+	struct
+	{
+	    union
+	    {
+		int integer;
+		float real;
+	    } value;
+	    int length;
+	    char *text;
+	} number;
+
 	struct
 	{
 	    int type;
@@ -107,15 +213,70 @@ struct _lisp_object_t
 lisp_stream_t* lisp_stream_init_path (lisp_stream_t *stream, const char *path);
 lisp_stream_t* lisp_stream_init_file (lisp_stream_t *stream, FILE *file);
 lisp_stream_t* lisp_stream_init_string (lisp_stream_t *stream, char *buf);
+lisp_stream_t* lisp_stream_init_buffer (lisp_stream_t *stream, const char *buf, size_t length);
 lisp_stream_t* lisp_stream_init_any (lisp_stream_t *stream, void *data, 
 				     int (*next_char) (void *data),
 				     void (*unget_char) (char c, void *data));
+lisp_stream_t* lisp_stream_init_blocks (lisp_stream_t *stream, void *data,
+				       int (*fill) (void *data, char **buf, size_t *length),
+				       void (*close) (void *data));
+lisp_stream_t* lisp_stream_init_compressed_path (lisp_stream_t *stream, const char *path);
+lisp_stream_t* lisp_stream_init_compressed_fd (lisp_stream_t *stream, int fd);
+lisp_stream_t* lisp_stream_init_input_path (lisp_stream_t *stream, const char *path);
 
 void lisp_stream_free_path  (lisp_stream_t *stream);
 
+void lisp_stream_set_flags (lisp_stream_t *stream, int flags);
+
+void lisp_set_max_token_length (size_t length);
+
+int lisp_get_stats (lisp_stats_t *stats);
+void lisp_reset_stats (void);
+const char* lisp_stats_phase_name (int phase);
+const char* lisp_stats_token_name (int token);
+
+lisp_locations_t* lisp_locations_new (void);
+void lisp_locations_clear (lisp_locations_t *locations);
+void lisp_locations_free (lisp_locations_t *locations);
+int lisp_stream_set_locations (lisp_stream_t *stream, lisp_locations_t *locations);
+long lisp_locations_offset (lisp_locations_t *locations, lisp_object_t *obj);
+int lisp_locations_line (lisp_locations_t *locations, long offset, long *line, long *column);
+
+long lisp_stream_tell (lisp_stream_t *stream);
+int lisp_stream_seek (lisp_stream_t *stream, long offset);
+
 lisp_object_t* lisp_read_with_allocator (allocator_t *allocator, lisp_stream_t *in);
 lisp_object_t* lisp_read (lisp_stream_t *in);
 
+typedef void (*lisp_error_func_t) (long offset, void *data);
+
+lisp_object_t* lisp_read_recovering_with_allocator (allocator_t *allocator, lisp_stream_t *in,
+						    lisp_error_func_t error, void *data);
+lisp_object_t* lisp_read_recovering (lisp_stream_t *in, lisp_error_func_t error, void *data);
+
+lisp_object_t* lisp_read_skipping_with_allocator (allocator_t *allocator, lisp_stream_t *in,
+						  int (*skip_child) (int depth, int index, void *data),
+						  void *data);
+lisp_object_t* lisp_read_skipping (lisp_stream_t *in,
+				   int (*skip_child) (int depth, int index, void *data),
+				   void *data);
+
+int lisp_enter_list (lisp_stream_t *in);
+lisp_object_t* lisp_read_element_with_allocator (allocator_t *allocator, lisp_stream_t *in);
+lisp_object_t* lisp_read_element (lisp_stream_t *in);
+
+int lisp_validate (lisp_stream_t *in, lisp_validate_stats_t *stats);
+
+int lisp_skip (lisp_stream_t *in);
+int lisp_skip_space (lisp_stream_t *in);
+
+lisp_path_t* lisp_path_compile (const char *spec);
+void lisp_path_free (lisp_path_t *path);
+
+lisp_object_t* lisp_read_path_with_allocator (allocator_t *allocator, lisp_stream_t *in, lisp_path_t *path);
+lisp_object_t* lisp_read_path (lisp_stream_t *in, lisp_path_t *path);
+int lisp_path_apply (lisp_path_t *path, lisp_object_t *obj, lisp_object_t **result);
+
 void lisp_free_with_allocator (allocator_t *allocator, lisp_object_t *obj);
 void lisp_free (lisp_object_t *obj);
 
@@ -124,6 +285,8 @@ lisp_object_t* lisp_read_from_string (const char *buf);
 
 int lisp_compile_pattern (lisp_object_t **obj, int *num_subs);
 int lisp_match_pattern (lisp_object_t *pattern, lisp_object_t *obj, lisp_object_t **vars, int num_subs);
+int lisp_match_pattern_bind (lisp_object_t *pattern, lisp_object_t *obj,
+			     const lisp_binding_t *bindings, int num_bindings, void *record);
 int lisp_match_string (const char *pattern_string, lisp_object_t *obj, lisp_object_t **vars);
 
 int lisp_type (lisp_object_t *obj);
@@ -155,6 +318,9 @@ int lisp_list_length (lisp_object_t *obj);
 lisp_object_t* lisp_list_nth_cdr (lisp_object_t *obj, int index);
 lisp_object_t* lisp_list_nth (lisp_object_t *obj, int index);
 
+uint64_t lisp_hash (lisp_object_t *obj);
+int lisp_equal (lisp_object_t *a, lisp_object_t *b);
+
 int lisp_print_nil (FILE *out);
 int lisp_print_open_paren (FILE *out);
 int lisp_print_close_paren (FILE *out);
@@ -169,6 +335,21 @@ void lisp_dump (lisp_object_t *obj, FILE *out);
 
 lisp_object_t* lisp_proplist_lookup_symbol (lisp_object_t *list, const char *key);
 
+lisp_proplist_index_t* lisp_proplist_index_with_allocator (allocator_t *allocator, lisp_object_t *list);
+lisp_proplist_index_t* lisp_proplist_index (lisp_object_t *list);
+lisp_proplist_index_t* lisp_alist_index_with_allocator (allocator_t *allocator, lisp_object_t *list);
+lisp_proplist_index_t* lisp_alist_index (lisp_object_t *list);
+lisp_object_t* lisp_proplist_index_lookup (const lisp_proplist_index_t *index, const char *key);
+void lisp_proplist_index_free_with_allocator (allocator_t *allocator, lisp_proplist_index_t *index);
+void lisp_proplist_index_free (lisp_proplist_index_t *index);
+
+lisp_hashcons_t* lisp_hashcons_new_with_allocator (allocator_t *allocator);
+lisp_hashcons_t* lisp_hashcons_new (void);
+void lisp_hashcons_free (lisp_hashcons_t *table);
+size_t lisp_hashcons_count (lisp_hashcons_t *table);
+lisp_object_t* lisp_read_hashconsed (lisp_hashcons_t *table, lisp_stream_t *in);
+lisp_object_t* lisp_hashcons (lisp_hashcons_t *table, lisp_object_t *obj);
+
 #define lisp_nil()           ((lisp_object_t*)0)
 
 #define lisp_nil_p(obj)      (obj == 0)
@@ -180,4 +361,8 @@ lisp_object_t* lisp_proplist_lookup_symbol (lisp_object_t *list, const char *key
 #define lisp_cons_p(obj)     (lisp_type((obj)) == LISP_TYPE_CONS)
 #define lisp_boolean_p(obj)  (lisp_type((obj)) == LISP_TYPE_BOOLEAN)
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
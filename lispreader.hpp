@@ -0,0 +1,1013 @@
+/*
+ * lispreader.hpp
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Header-only C++ (C++20) interface to lispreader.  Everything in here
+   is resolved at compile time or inlined; the only run-time dependency
+   is the C library. */
+
+#ifndef __LISPREADER_HPP__
+#define __LISPREADER_HPP__
+
+#include <cassert>
+#include <cstddef>
+#include <tuple>
+#include <utility>
+
+#include "lispreader.h"
+
+namespace lisp
+{
+
+/* A string literal usable as a template argument. */
+template <std::size_t N>
+struct fixed_string
+{
+    char data[N];
+
+    constexpr fixed_string (const char (&str)[N])
+    {
+	for (std::size_t i = 0; i < N; ++i)
+	    data[i] = str[i];
+    }
+
+    static constexpr std::size_t length = N - 1;
+};
+
+namespace detail
+{
+
+/* Not constexpr, so reaching it while evaluating a constant expression
+   makes the program ill-formed.  This is how syntax errors in pattern
+   literals are reported. */
+void syntax_error (const char *message);
+
+constexpr bool
+is_space (char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+constexpr bool
+is_digit (char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+constexpr bool
+is_number (const char *str, std::size_t length)
+{
+    for (std::size_t i = 0; i < length; ++i)
+	if (!is_digit(str[i]))
+	    return false;
+    return true;
+}
+
+inline bool
+is_cons (lisp_object_t *obj)
+{
+    return obj != 0 && (obj->type == LISP_TYPE_CONS || obj->type == LISP_TYPE_PATTERN_CONS);
+}
+
+/* Compares the symbol name str to the length bytes at key, which are
+   known at compile time. */
+template <std::size_t Length>
+inline bool
+symbol_equals (const char *str, const char *key)
+{
+    for (std::size_t i = 0; i < Length; ++i)
+	if (str[i] != key[i])
+	    return false;
+    return str[Length] == '\0';
+}
+
+enum path_op { PATH_CAR, PATH_CDR, PATH_NTH, PATH_KEY };
+
+struct path_step
+{
+    path_op op;
+    int n;
+    std::size_t key_start;
+    std::size_t key_length;
+};
+
+template <std::size_t Max>
+struct path_program
+{
+    path_step steps[Max] = {};
+    int num_steps = 0;
+};
+
+/* The same syntax and peephole merging as lisp_path_compile. */
+template <fixed_string Spec>
+constexpr auto
+compile_path ()
+{
+    path_program<Spec.length / 2 + 1> program;
+    std::size_t p = 0;
+
+    for (;;)
+    {
+	std::size_t start, length;
+	path_step step = { PATH_CAR, 0, 0, 0 };
+
+	while (p < Spec.length && is_space(Spec.data[p]))
+	    ++p;
+	if (p == Spec.length)
+	    break;
+
+	start = p;
+	while (p < Spec.length && !is_space(Spec.data[p]))
+	    ++p;
+	length = p - start;
+
+	if (length == 1 && Spec.data[start] == 'a')
+	{
+	    if (program.num_steps > 0 && program.steps[program.num_steps - 1].op == PATH_CDR)
+	    {
+		program.steps[program.num_steps - 1].op = PATH_NTH;
+		continue;
+	    }
+	    step.op = PATH_CAR;
+	}
+	else if (length == 1 && Spec.data[start] == 'd')
+	{
+	    if (program.num_steps > 0 && program.steps[program.num_steps - 1].op == PATH_CDR)
+	    {
+		++program.steps[program.num_steps - 1].n;
+		continue;
+	    }
+	    step.op = PATH_CDR;
+	    step.n = 1;
+	}
+	else if (is_number(Spec.data + start, length))
+	{
+	    step.op = PATH_NTH;
+	    for (std::size_t i = start; i < p; ++i)
+		step.n = step.n * 10 + (Spec.data[i] - '0');
+	}
+	else
+	{
+	    step.op = PATH_KEY;
+	    step.key_start = start;
+	    step.key_length = length;
+	}
+
+	program.steps[program.num_steps++] = step;
+    }
+
+    return program;
+}
+
+}
+
+/* A path query compiled at compile time.  path<"d a :id">::apply
+   behaves like lisp_path_apply with the path "d a :id", but compiles
+   to a sequence of loads and type tests. */
+template <fixed_string Spec>
+struct path
+{
+    static constexpr auto program = detail::compile_path<Spec>();
+
+    template <int I>
+    static inline bool
+    apply_from (lisp_object_t *obj, lisp_object_t *&result)
+    {
+	if constexpr (I == program.num_steps)
+	{
+	    result = obj;
+	    return true;
+	}
+	else
+	{
+	    constexpr detail::path_step step = program.steps[I];
+
+	    if constexpr (step.op == detail::PATH_CAR)
+	    {
+		if (!detail::is_cons(obj))
+		    return false;
+		obj = obj->v.cons.car;
+	    }
+	    else if constexpr (step.op == detail::PATH_KEY)
+	    {
+		for (;;)
+		{
+		    lisp_object_t *key;
+
+		    if (!detail::is_cons(obj) || !detail::is_cons(obj->v.cons.cdr))
+			return false;
+
+		    key = obj->v.cons.car;
+		    if (key != 0 && key->type == LISP_TYPE_SYMBOL
+			&& detail::symbol_equals<step.key_length>(key->v.string, Spec.data + step.key_start))
+		    {
+			obj = obj->v.cons.cdr->v.cons.car;
+			break;
+		    }
+
+		    obj = obj->v.cons.cdr->v.cons.cdr;
+		}
+	    }
+	    else
+	    {
+		for (int n = 0; n < step.n; ++n)
+		{
+		    if (!detail::is_cons(obj))
+			return false;
+		    obj = obj->v.cons.cdr;
+		}
+		if constexpr (step.op == detail::PATH_NTH)
+		{
+		    if (!detail::is_cons(obj))
+			return false;
+		    obj = obj->v.cons.car;
+		}
+	    }
+
+	    return apply_from<I + 1>(obj, result);
+	}
+    }
+
+    static inline bool
+    apply (lisp_object_t *obj, lisp_object_t *&result)
+    {
+	return apply_from<0>(obj, result);
+    }
+};
+
+namespace detail
+{
+
+inline int
+integer_value (lisp_object_t *obj)
+{
+    int flags = __atomic_load_n(&obj->flags, __ATOMIC_ACQUIRE);
+
+    if (flags & LISP_OBJECT_LAZY)
+    {
+	int value;
+
+	if (!(flags & LISP_OBJECT_DECODED))
+	    return lisp_integer(obj);
+	__atomic_load(&obj->v.number.value.integer, &value, __ATOMIC_RELAXED);
+	return value;
+    }
+    return obj->v.integer;
+}
+
+inline float
+real_value (lisp_object_t *obj)
+{
+    int flags = __atomic_load_n(&obj->flags, __ATOMIC_ACQUIRE);
+
+    if (flags & LISP_OBJECT_LAZY)
+    {
+	float value;
+
+	if (!(flags & LISP_OBJECT_DECODED))
+	    return lisp_real(obj);
+	__atomic_load(&obj->v.number.value.real, &value, __ATOMIC_RELAXED);
+	return value;
+    }
+    return obj->v.real;
+}
+
+/* The C++ type a pattern variable of the given LISP_PATTERN_* type
+   binds its capture to. */
+template <int Type>
+struct capture_type
+{
+    typedef lisp_object_t *type;
+    static inline type get (lisp_object_t *obj) { return obj; }
+};
+
+template <>
+struct capture_type<LISP_PATTERN_SYMBOL>
+{
+    typedef const char *type;
+    static inline type get (lisp_object_t *obj) { return obj->v.string; }
+};
+
+template <>
+struct capture_type<LISP_PATTERN_STRING>
+{
+    typedef const char *type;
+    static inline type get (lisp_object_t *obj) { return obj->v.string; }
+};
+
+template <>
+struct capture_type<LISP_PATTERN_INTEGER>
+{
+    typedef int type;
+    static inline type get (lisp_object_t *obj) { return integer_value(obj); }
+};
+
+template <>
+struct capture_type<LISP_PATTERN_REAL>
+{
+    typedef float type;
+    static inline type get (lisp_object_t *obj) { return real_value(obj); }
+};
+
+template <>
+struct capture_type<LISP_PATTERN_BOOLEAN>
+{
+    typedef bool type;
+    static inline type get (lisp_object_t *obj) { return obj->v.integer != 0; }
+};
+
+enum pattern_token
+{
+    TOKEN_ERROR, TOKEN_EOF, TOKEN_OPEN_PAREN, TOKEN_CLOSE_PAREN, TOKEN_SYMBOL,
+    TOKEN_STRING, TOKEN_INTEGER, TOKEN_REAL, TOKEN_DOT, TOKEN_TRUE, TOKEN_FALSE,
+    TOKEN_PATTERN_OPEN_PAREN
+};
+
+enum node_kind { NODE_NIL, NODE_CONS, NODE_SYMBOL, NODE_STRING, NODE_INTEGER, NODE_REAL, NODE_BOOLEAN, NODE_VAR };
+
+struct pattern_node
+{
+    node_kind kind;
+    int car, cdr;		/* of conses, and the alternatives of or variables */
+    int type;			/* LISP_PATTERN_* of variables */
+    int index;			/* the capture of variables */
+    int first_capture;		/* the captures within the node */
+    int end_capture;
+    int integer;		/* also the value of booleans */
+    float real;
+    std::size_t text_start;	/* symbols and strings, in the text buffer */
+    std::size_t text_length;
+};
+
+template <std::size_t N>
+struct pattern_program
+{
+    pattern_node nodes[N] = {};
+    int num_nodes = 0;
+    int root = 0;
+    int num_captures = 0;
+    int capture_types[N] = {};
+    char text[N] = {};
+    std::size_t text_length = 0;
+};
+
+constexpr bool
+is_delimiter (char c)
+{
+    return is_space(c) || c == '"' || c == '(' || c == ')' || c == ';';
+}
+
+/* Parses pattern literals, following the scanner in lispscan.h and
+   the pattern compiler in lispreader.c. */
+template <std::size_t N>
+struct pattern_parser
+{
+    const char *str;
+    std::size_t length;
+    std::size_t pos = 0;
+    pattern_program<N> program;
+
+    pattern_token token = TOKEN_ERROR;
+    std::size_t token_start = 0;	/* the lexeme of numbers */
+    std::size_t token_length = 0;
+
+    constexpr pattern_parser (const char *_str, std::size_t _length)
+	: str(_str), length(_length)
+    {
+    }
+
+    constexpr int
+    next_char ()
+    {
+	return pos < length ? (unsigned char)str[pos++] : -1;
+    }
+
+    constexpr void
+    text_append (char c)
+    {
+	program.text[program.text_length++] = c;
+    }
+
+    constexpr pattern_token
+    scan ()
+    {
+	int c;
+
+	do
+	{
+	    c = next_char();
+	    if (c == ';')
+		while (c != -1 && c != '\n')
+		    c = next_char();
+	    if (c == -1)
+		return token = TOKEN_EOF;
+	} while (is_space(c));
+
+	switch (c)
+	{
+	    case '(' :
+		return token = TOKEN_OPEN_PAREN;
+
+	    case ')' :
+		return token = TOKEN_CLOSE_PAREN;
+
+	    case '"' :
+		token_start = program.text_length;
+		for (;;)
+		{
+		    c = next_char();
+		    if (c == -1)
+			return token = TOKEN_ERROR;
+		    if (c == '"')
+			break;
+		    if (c == '\\')
+		    {
+			c = next_char();
+			if (c == -1)
+			    return token = TOKEN_ERROR;
+			if (c == 'n')
+			    c = '\n';
+			else if (c == 't')
+			    c = '\t';
+		    }
+		    text_append(c);
+		}
+		token_length = program.text_length - token_start;
+		return token = TOKEN_STRING;
+
+	    case '#' :
+		c = next_char();
+		if (c == 't')
+		    return token = TOKEN_TRUE;
+		if (c == 'f')
+		    return token = TOKEN_FALSE;
+		if (c == '?' && next_char() == '(')
+		    return token = TOKEN_PATTERN_OPEN_PAREN;
+		return token = TOKEN_ERROR;
+	}
+
+	token_start = pos - 1;
+	if (c == '.' && (pos == length || is_delimiter(str[pos])))
+	    return token = TOKEN_DOT;
+	while (pos < length && !is_delimiter(str[pos]))
+	    ++pos;
+	token_length = pos - token_start;
+
+	token = TOKEN_SYMBOL;
+	if (is_digit(c) || c == '-')
+	{
+	    int have_digits = 0, have_nondigits = 0, have_floating_point = 0;
+
+	    for (std::size_t i = token_start; i < pos; ++i)
+	    {
+		if (is_digit(str[i]))
+		    have_digits = 1;
+		else if (str[i] == '.')
+		    ++have_floating_point;
+		else if (i > token_start)
+		    have_nondigits = 1;
+	    }
+
+	    if (!have_nondigits && have_digits && have_floating_point <= 1)
+		token = have_floating_point ? TOKEN_REAL : TOKEN_INTEGER;
+	}
+
+	if (token == TOKEN_SYMBOL)
+	{
+	    std::size_t start = token_start;
+
+	    token_start = program.text_length;
+	    for (std::size_t i = start; i < pos; ++i)
+		text_append(str[i]);
+	}
+
+	return token;
+    }
+
+    constexpr int
+    make_node (node_kind kind)
+    {
+	pattern_node &node = program.nodes[program.num_nodes];
+
+	node.kind = kind;
+	node.first_capture = node.end_capture = program.num_captures;
+
+	return program.num_nodes++;
+    }
+
+    constexpr int
+    parse_integer ()
+    {
+	unsigned int value = 0;
+	std::size_t i = token_start;
+	bool negative = str[i] == '-';
+
+	for (i += negative; i < token_start + token_length; ++i)
+	    value = value * 10 + (str[i] - '0');
+
+	return (int)(negative ? 0u - value : value);
+    }
+
+    constexpr float
+    parse_real ()
+    {
+	double mantissa = 0, scale = 1;
+	std::size_t i = token_start;
+	bool negative = str[i] == '-', fraction = false;
+
+	for (i += negative; i < token_start + token_length; ++i)
+	{
+	    if (str[i] == '.')
+		fraction = true;
+	    else
+	    {
+		mantissa = mantissa * 10 + (str[i] - '0');
+		if (fraction)
+		    scale *= 10;
+	    }
+	}
+
+	return (float)((negative ? -mantissa : mantissa) / scale);
+    }
+
+    /* Parses the expression starting with the current token. */
+    constexpr int
+    parse ()
+    {
+	int first_capture = program.num_captures;
+	int node = 0;
+
+	switch (token)
+	{
+	    case TOKEN_OPEN_PAREN :
+		node = parse_list(false);
+		break;
+
+	    case TOKEN_PATTERN_OPEN_PAREN :
+		node = parse_variable();
+		break;
+
+	    case TOKEN_SYMBOL :
+	    case TOKEN_STRING :
+		node = make_node(token == TOKEN_SYMBOL ? NODE_SYMBOL : NODE_STRING);
+		program.nodes[node].text_start = token_start;
+		program.nodes[node].text_length = token_length;
+		break;
+
+	    case TOKEN_INTEGER :
+		node = make_node(NODE_INTEGER);
+		program.nodes[node].integer = parse_integer();
+		break;
+
+	    case TOKEN_REAL :
+		node = make_node(NODE_REAL);
+		program.nodes[node].real = parse_real();
+		break;
+
+	    case TOKEN_TRUE :
+	    case TOKEN_FALSE :
+		node = make_node(NODE_BOOLEAN);
+		program.nodes[node].integer = token == TOKEN_TRUE;
+		break;
+
+	    case TOKEN_EOF :
+		syntax_error("unexpected end of pattern");
+		break;
+
+	    default :
+		syntax_error("unexpected token in pattern");
+	}
+
+	program.nodes[node].first_capture = first_capture;
+	program.nodes[node].end_capture = program.num_captures;
+
+	return node;
+    }
+
+    /* Parses the rest of a list after its opening parenthesis.  The
+       alternatives of or patterns cannot have a dotted tail. */
+    constexpr int
+    parse_list (bool alternatives)
+    {
+	int first = -1, last = -1;
+
+	for (;;)
+	{
+	    int cons;
+
+	    scan();
+	    if (token == TOKEN_CLOSE_PAREN)
+		break;
+
+	    if (token == TOKEN_DOT && last >= 0 && !alternatives)
+	    {
+		scan();
+		program.nodes[last].cdr = parse();
+		if (scan() != TOKEN_CLOSE_PAREN)
+		    syntax_error("expected ) after dotted tail of pattern");
+		return first;
+	    }
+
+	    cons = make_node(NODE_CONS);
+	    program.nodes[cons].car = parse();
+	    if (last >= 0)
+		program.nodes[last].cdr = cons;
+	    else
+		first = cons;
+	    last = cons;
+	}
+
+	if (last >= 0)
+	    program.nodes[last].cdr = make_node(NODE_NIL);
+	else
+	    first = make_node(NODE_NIL);
+
+	return first;
+    }
+
+    constexpr bool
+    symbol_is (const char *name)
+    {
+	std::size_t i;
+
+	for (i = 0; name[i] != '\0'; ++i)
+	    if (i == token_length || program.text[token_start + i] != name[i])
+		return false;
+	return i == token_length;
+    }
+
+    constexpr int
+    parse_variable ()
+    {
+	struct { const char *name; int type; } types[] =
+	    {
+		{ "any", LISP_PATTERN_ANY },
+		{ "symbol", LISP_PATTERN_SYMBOL },
+		{ "string", LISP_PATTERN_STRING },
+		{ "integer", LISP_PATTERN_INTEGER },
+		{ "real", LISP_PATTERN_REAL },
+		{ "boolean", LISP_PATTERN_BOOLEAN },
+		{ "list", LISP_PATTERN_LIST },
+		{ "or", LISP_PATTERN_OR },
+		{ "number", LISP_PATTERN_NUMBER }
+	    };
+	int node, type = 0;
+
+	if (scan() != TOKEN_SYMBOL)
+	    syntax_error("expected pattern type");
+	for (const auto &t : types)
+	    if (symbol_is(t.name))
+		type = t.type;
+	if (type == 0)
+	    syntax_error("unknown pattern type");
+
+	node = make_node(NODE_VAR);
+	program.nodes[node].type = type;
+	program.nodes[node].index = program.num_captures;
+	program.capture_types[program.num_captures++] = type;
+
+	if (type == LISP_PATTERN_OR)
+	    program.nodes[node].car = parse_list(true);
+	else if (scan() != TOKEN_CLOSE_PAREN)
+	    syntax_error("only or patterns take arguments");
+
+	return node;
+    }
+};
+
+template <fixed_string Spec>
+constexpr auto
+compile_pattern ()
+{
+    pattern_parser<2 * Spec.length + 2> parser(Spec.data, Spec.length);
+
+    parser.scan();
+    parser.program.root = parser.parse();
+    if (parser.scan() != TOKEN_EOF)
+	syntax_error("garbage after pattern");
+
+    return parser.program;
+}
+
+}
+
+/* A pattern with the syntax of lisp_compile_pattern, given as a string
+   literal and compiled at compile time.  The captures are bound into
+   the tuple type captures, in the order the variables appear in the
+   literal.  Variables of type integer, real, string, symbol and
+   boolean bind int, float, const char* and bool, respectively, all
+   others bind the matched lisp_object_t*. */
+template <fixed_string Spec>
+struct pattern
+{
+    static constexpr auto program = detail::compile_pattern<Spec>();
+
+    template <std::size_t... I>
+    static auto make_captures (std::index_sequence<I...>)
+	-> std::tuple<typename detail::capture_type<program.capture_types[I]>::type...>;
+
+    typedef decltype(make_captures(std::make_index_sequence<program.num_captures>())) captures;
+
+    template <int First, int End>
+    static inline void
+    clear_captures (captures &caps)
+    {
+	if constexpr (First < End)
+	{
+	    std::get<First>(caps) = {};
+	    clear_captures<First + 1, End>(caps);
+	}
+    }
+
+    template <int Node>
+    static inline bool
+    match_alternatives (lisp_object_t *obj, captures &caps)
+    {
+	constexpr detail::pattern_node node = program.nodes[Node];
+
+	if constexpr (node.kind == detail::NODE_NIL)
+	    return false;
+	else
+	{
+	    constexpr detail::pattern_node alternative = program.nodes[node.car];
+
+	    if (match_node<node.car>(obj, caps))
+		return true;
+	    clear_captures<alternative.first_capture, alternative.end_capture>(caps);
+
+	    return match_alternatives<node.cdr>(obj, caps);
+	}
+    }
+
+    template <int Node>
+    static inline bool
+    match_node (lisp_object_t *obj, captures &caps)
+    {
+	constexpr detail::pattern_node node = program.nodes[Node];
+
+	if constexpr (node.kind == detail::NODE_NIL)
+	    return obj == 0;
+	else if constexpr (node.kind == detail::NODE_CONS)
+	    return obj != 0 && obj->type == LISP_TYPE_CONS
+		&& match_node<node.car>(obj->v.cons.car, caps)
+		&& match_node<node.cdr>(obj->v.cons.cdr, caps);
+	else if constexpr (node.kind == detail::NODE_SYMBOL || node.kind == detail::NODE_STRING)
+	    return obj != 0
+		&& obj->type == (node.kind == detail::NODE_SYMBOL ? LISP_TYPE_SYMBOL : LISP_TYPE_STRING)
+		&& detail::symbol_equals<node.text_length>(obj->v.string, program.text + node.text_start);
+	else if constexpr (node.kind == detail::NODE_INTEGER)
+	    return obj != 0 && obj->type == LISP_TYPE_INTEGER && detail::integer_value(obj) == node.integer;
+	else if constexpr (node.kind == detail::NODE_REAL)
+	    return obj != 0 && obj->type == LISP_TYPE_REAL && detail::real_value(obj) == node.real;
+	else if constexpr (node.kind == detail::NODE_BOOLEAN)
+	    return obj != 0 && obj->type == LISP_TYPE_BOOLEAN && (obj->v.integer != 0) == (node.integer != 0);
+	else
+	{
+	    if constexpr (node.type == LISP_PATTERN_SYMBOL)
+	    {
+		if (obj == 0 || obj->type != LISP_TYPE_SYMBOL)
+		    return false;
+	    }
+	    else if constexpr (node.type == LISP_PATTERN_STRING)
+	    {
+		if (obj == 0 || obj->type != LISP_TYPE_STRING)
+		    return false;
+	    }
+	    else if constexpr (node.type == LISP_PATTERN_INTEGER)
+	    {
+		if (obj == 0 || obj->type != LISP_TYPE_INTEGER)
+		    return false;
+	    }
+	    else if constexpr (node.type == LISP_PATTERN_REAL)
+	    {
+		if (obj == 0 || obj->type != LISP_TYPE_REAL)
+		    return false;
+	    }
+	    else if constexpr (node.type == LISP_PATTERN_BOOLEAN)
+	    {
+		if (obj == 0 || obj->type != LISP_TYPE_BOOLEAN)
+		    return false;
+	    }
+	    else if constexpr (node.type == LISP_PATTERN_LIST)
+	    {
+		if (obj != 0 && obj->type != LISP_TYPE_CONS)
+		    return false;
+	    }
+	    else if constexpr (node.type == LISP_PATTERN_NUMBER)
+	    {
+		if (obj == 0 || (obj->type != LISP_TYPE_INTEGER && obj->type != LISP_TYPE_REAL))
+		    return false;
+	    }
+	    else if constexpr (node.type == LISP_PATTERN_OR)
+	    {
+		if (!match_alternatives<node.car>(obj, caps))
+		    return false;
+	    }
+
+	    std::get<node.index>(caps) = detail::capture_type<node.type>::get(obj);
+
+	    return true;
+	}
+    }
+
+    /* Matches obj against the pattern.  Captures which were not bound,
+       because they are part of alternatives of or patterns that did
+       not match, are set to zero. */
+    static inline bool
+    match (lisp_object_t *obj, captures &caps)
+    {
+	caps = captures();
+
+	return match_node<program.root>(obj, caps);
+    }
+
+    static inline bool
+    match (lisp_object_t *obj)
+    {
+	captures caps;
+
+	return match_node<program.root>(obj, caps);
+    }
+};
+
+class list_iterator;
+struct list_end {};
+
+/* A reference to an expression which does not own it.  The accessors
+   assert the type of the expression like their C counterparts, the
+   _unchecked variants do not check at all. */
+class view
+{
+public:
+    view (lisp_object_t *_obj = 0) : obj(_obj) {}
+
+    lisp_object_t *get () const { return obj; }
+    operator lisp_object_t* () const { return obj; }
+
+    int type () const { return obj == 0 ? LISP_TYPE_NIL : obj->type; }
+
+    bool nil_p () const { return obj == 0; }
+    bool symbol_p () const { return obj != 0 && obj->type == LISP_TYPE_SYMBOL; }
+    bool string_p () const { return obj != 0 && obj->type == LISP_TYPE_STRING; }
+    bool integer_p () const { return obj != 0 && obj->type == LISP_TYPE_INTEGER; }
+    bool real_p () const { return obj != 0 && obj->type == LISP_TYPE_REAL; }
+    bool number_p () const { return integer_p() || real_p(); }
+    bool boolean_p () const { return obj != 0 && obj->type == LISP_TYPE_BOOLEAN; }
+    bool cons_p () const { return obj != 0 && obj->type == LISP_TYPE_CONS; }
+    bool list_p () const { return obj == 0 || obj->type == LISP_TYPE_CONS; }
+
+    view car () const { assert(detail::is_cons(obj)); return obj->v.cons.car; }
+    view cdr () const { assert(detail::is_cons(obj)); return obj->v.cons.cdr; }
+    const char *symbol () const { assert(symbol_p()); return obj->v.string; }
+    const char *string () const { assert(string_p()); return obj->v.string; }
+    int integer () const { assert(integer_p()); return detail::integer_value(obj); }
+    float real () const { assert(number_p()); return real_unchecked(); }
+    bool boolean () const { assert(boolean_p()); return obj->v.integer != 0; }
+
+    view car_unchecked () const { return obj->v.cons.car; }
+    view cdr_unchecked () const { return obj->v.cons.cdr; }
+    const char *symbol_unchecked () const { return obj->v.string; }
+    const char *string_unchecked () const { return obj->v.string; }
+    int integer_unchecked () const { return detail::integer_value(obj); }
+    float real_unchecked () const
+    {
+	return obj->type == LISP_TYPE_INTEGER ? (float)detail::integer_value(obj) : detail::real_value(obj);
+    }
+    bool boolean_unchecked () const { return obj->v.integer != 0; }
+
+    /* Iterates over the elements of a list.  Iteration stops at the
+       first cdr which is not a cons, so the tail of a dotted list is
+       not visited. */
+    inline list_iterator begin () const;
+    list_end end () const { return list_end(); }
+
+private:
+    lisp_object_t *obj;
+};
+
+class list_iterator
+{
+public:
+    explicit list_iterator (lisp_object_t *_cons) : cons(_cons) {}
+
+    view operator* () const { return cons->v.cons.car; }
+    list_iterator &operator++ () { cons = cons->v.cons.cdr; return *this; }
+
+    bool operator== (list_end) const { return !detail::is_cons(cons); }
+    bool operator!= (list_end) const { return detail::is_cons(cons); }
+
+    /* The rest of the list, starting with the current element. */
+    view rest () const { return cons; }
+
+private:
+    lisp_object_t *cons;
+};
+
+inline list_iterator
+view::begin () const
+{
+    return list_iterator(obj);
+}
+
+/* Owns an expression and frees it with the allocator it was created
+   with when destroyed. */
+class object
+{
+public:
+    object () : obj(0), allocator(&malloc_allocator) {}
+    explicit object (lisp_object_t *_obj, allocator_t *_allocator = &malloc_allocator)
+	: obj(_obj), allocator(_allocator) {}
+
+    object (object &&other) noexcept : obj(other.obj), allocator(other.allocator) { other.obj = 0; }
+
+    object &
+    operator= (object &&other) noexcept
+    {
+	if (this != &other)
+	{
+	    lisp_free_with_allocator(allocator, obj);
+	    obj = other.obj;
+	    allocator = other.allocator;
+	    other.obj = 0;
+	}
+	return *this;
+    }
+
+    object (const object&) = delete;
+    object &operator= (const object&) = delete;
+
+    ~object () { lisp_free_with_allocator(allocator, obj); }
+
+    lisp::view view () const { return obj; }
+    lisp_object_t *get () const { return obj; }
+
+    lisp_object_t*
+    release ()
+    {
+	lisp_object_t *result = obj;
+
+	obj = 0;
+	return result;
+    }
+
+private:
+    lisp_object_t *obj;
+    allocator_t *allocator;
+};
+
+/* Reads the next expression from in.  End-of-file and parse errors
+   are reported through the type of the result, like by lisp_read. */
+inline object
+read (lisp_stream_t *in)
+{
+    return object(lisp_read(in));
+}
+
+/* Owns pools and an allocator using them.  Expressions read into an
+   arena are not freed individually but all at once when the arena is
+   reset or destroyed.  Arenas cannot be moved, because the allocator
+   refers to the pools. */
+class arena
+{
+public:
+    arena () { valid = init_pools(&pools); init_pools_allocator(&allocator, &pools); }
+    ~arena () { free_pools(&pools); }
+
+    arena (const arena&) = delete;
+    arena &operator= (const arena&) = delete;
+
+    /* Whether the pools could be allocated. */
+    bool ok () const { return valid; }
+
+    allocator_t *get_allocator () { return &allocator; }
+
+    view read (lisp_stream_t *in) { return lisp_read_with_allocator(&allocator, in); }
+
+    void reset () { reset_pools(&pools); }
+
+private:
+    pools_t pools;
+    allocator_t allocator;
+    bool valid;
+};
+
+}
+
+#endif
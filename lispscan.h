@@ -1,30 +1,32 @@
 static int
 SCAN_FUNC_NAME (lisp_stream_t *stream)
 {
-    static char *delims = "\"();";
-
     SCAN_DECLS
 
-    int c;
+    int c, cls;
 
-    do
+    for (;;)
     {
 	c = NEXT_CHAR;
+	cls = CHAR_CLASS(c);
+	if (cls & CHAR_SPACE)
+	    continue;
+	if (!(cls & CHAR_COMMENT))
+	    break;
+	do
+	    c = NEXT_CHAR;
+	while (c != '\n' && c != EOF);
 	if (c == EOF)
-	    RETURN(TOKEN_EOF);
-	else if (c == ';')     	 /* comment start */
-	    while (1)
-	    {	
-		c = NEXT_CHAR;
-		if (c == EOF)		
-		    RETURN(TOKEN_EOF);
-		else if (c == '\n')   	
-		    break;
-	    }
-    } while (isspace(c));
+	    break;
+    }
+
+    TOKEN_BEGIN;
 
     switch (c)
     {
+	case EOF :
+	    RETURN(END_TOKEN);
+
 	case '(' :
 	    RETURN(TOKEN_OPEN_PAREN);
 
@@ -35,6 +37,9 @@ SCAN_FUNC_NAME (lisp_stream_t *stream)
 	    _token_clear();
 	    while (1)
 	    {
+		/* everything up to the next quote or escape is copied in one go */
+		STRING_RUN;
+
 		c = NEXT_CHAR;
 		if (c == EOF)
 		    RETURN(TOKEN_ERROR);
@@ -59,104 +64,63 @@ SCAN_FUNC_NAME (lisp_stream_t *stream)
 		    }
 		}
 
-		_token_append(c);
+		if (!_token_append(c))
+		    RETURN(TOKEN_ERROR);
 	    }
 	    RETURN(TOKEN_STRING);
 
 	case '#' :
 	    c = NEXT_CHAR;
-	    if (c == EOF)
-		RETURN(TOKEN_ERROR);
-
-	    switch (c)
-	    {
-		case 't' :
-		    RETURN(TOKEN_TRUE);
-
-		case 'f' :
-		    RETURN(TOKEN_FALSE);
-
-		case '?' :
-		    c = NEXT_CHAR;
-		    if (c == EOF)
-			RETURN(TOKEN_ERROR);
-
-		    if (c == '(')
-			RETURN(TOKEN_PATTERN_OPEN_PAREN);
-		    else
-			RETURN(TOKEN_ERROR);
-	    }
+	    if (c == 't')
+		RETURN(TOKEN_TRUE);
+	    if (c == 'f')
+		RETURN(TOKEN_FALSE);
+	    if (c == '?' && NEXT_CHAR == '(')
+		RETURN(TOKEN_PATTERN_OPEN_PAREN);
 	    RETURN(TOKEN_ERROR);
 
 	default :
-	    if (isdigit(c) || c == '-')
-	    {
-		int have_nondigits = 0;
-		int have_digits = 0;
-		int have_floating_point = 0;
-
-		TOKEN_START(1);
-
-		do
-		{
-		    if (isdigit(c))
-		        have_digits = 1;
-		    else if (c == '.')
-		        have_floating_point++;
-		    TOKEN_APPEND(c);
-
-		    c = NEXT_CHAR;
-
-		    if (c != EOF && !isdigit(c) && !isspace(c) && c != '.' && !strchr(delims, c))
-			have_nondigits = 1;
-		} while (c != EOF && !isspace(c) && !strchr(delims, c));
+	{
+	    /* symbols and numbers are scanned by the same loop, which
+	       collects the classes of their characters, from which the
+	       kind of token is decided at the end */
+	    int first = cls, seen = cls, nonnumeric = 0, dots = 0;
 
-		if (c != EOF)
-		    UNGET_CHAR(c);
-
-		TOKEN_STOP;
-
-		if (have_nondigits || !have_digits || have_floating_point > 1)
-		    RETURN(TOKEN_SYMBOL);
-		else if (have_floating_point == 1)
-		    RETURN(TOKEN_REAL);
-		else
-		    RETURN(TOKEN_INTEGER);
-	    }
-	    else
+	    if (c == '.')
 	    {
-		if (c == '.')
+		c = NEXT_CHAR;
+		if (CHAR_CLASS(c) & CHAR_TERMINATOR)
 		{
-		    c = NEXT_CHAR;
-		    if (c != EOF && !isspace(c) && !strchr(delims, c))
-		    {
-			TOKEN_START(2);
-			TOKEN_APPEND('.');
-		    }
-		    else
-		    {
+		    if (c != EOF)
 			UNGET_CHAR(c);
-			RETURN(TOKEN_DOT);
-		    }
+		    RETURN(TOKEN_DOT);
 		}
-		else
-		{
-		    TOKEN_START(1);
-		}
-		do
-		{
-		    TOKEN_APPEND(c);
-		    c = NEXT_CHAR;
-		} while (c != EOF && !isspace(c) && !strchr(delims, c));
-		if (c != EOF)
-		    UNGET_CHAR(c);
+		TOKEN_START(2);
+		TOKEN_APPEND('.');
+	    }
+	    else
+		TOKEN_START(1);
+
+	    for (;;)
+	    {
+		TOKEN_APPEND(c);
+		c = NEXT_CHAR;
+		cls = CHAR_CLASS(c);
+		if (cls & CHAR_TERMINATOR)
+		    break;
+		seen |= cls;
+		nonnumeric |= !(cls & CHAR_NUMERIC);
+		dots += c == '.';
+	    }
 
-		TOKEN_STOP;
+	    if (c != EOF)
+		UNGET_CHAR(c);
 
+	    TOKEN_STOP;
+
+	    if (!(first & CHAR_NUMBER_START) || nonnumeric || !(seen & CHAR_DIGIT) || dots > 1)
 		RETURN(TOKEN_SYMBOL);
-	    }
+	    RETURN(dots == 0 ? TOKEN_INTEGER : TOKEN_REAL);
+	}
     }
-
-    assert(0);
-    RETURN(TOKEN_ERROR);
 }
@@ -1,6 +1,670 @@
 /* $Id: lisptest.c 191 2004-07-02 21:20:49Z schani $ */
 
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include "lispreader.h"
+#include "reload.h"
+#include "load.h"
+
+static int num_failures = 0;
+
+#define CHECK(c)        ({ if (!(c)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+			       ++num_failures; } })
+
+/* a block stream over a string that is split into blocks of the given
+   size */
+typedef struct
+{
+    char *buf;
+    size_t length;
+    size_t pos;
+    size_t block_size;
+} blocks_t;
+
+static int
+blocks_fill (void *data, char **buf, size_t *length)
+{
+    blocks_t *blocks = (blocks_t*)data;
+
+    if (blocks->pos == blocks->length)
+	return 0;
+
+    *buf = blocks->buf + blocks->pos;
+    *length = blocks->length - blocks->pos < blocks->block_size ? blocks->length - blocks->pos : blocks->block_size;
+    blocks->pos += *length;
+
+    return 1;
+}
+
+/* the kinds of streams the tests read from */
+#define STREAM_STRING   0
+#define STREAM_FILE     1
+#define STREAM_BLOCKS   2	/* blocks of 1, 2, 3, ... bytes */
+
+static void
+count_error (long offset, void *data)
+{
+    ++*(int*)data;
+}
+
+/* a stream of the given kind over a copy of a string */
+typedef struct
+{
+    char *copy;
+    FILE *file;
+    blocks_t blocks;
+    lisp_stream_t stream;
+} test_stream_t;
+
+static lisp_stream_t*
+open_test_stream (test_stream_t *test, const char *input, int kind, size_t block_size)
+{
+    test->copy = strdup(input);
+    test->file = 0;
+    test->blocks.buf = test->copy;
+    test->blocks.length = strlen(input);
+    test->blocks.pos = 0;
+    test->blocks.block_size = block_size;
+
+    switch (kind)
+    {
+	case STREAM_STRING :
+	    lisp_stream_init_string(&test->stream, test->copy);
+	    break;
+
+	case STREAM_FILE :
+	    test->file = fmemopen(test->copy, strlen(input), "r");
+	    lisp_stream_init_file(&test->stream, test->file);
+	    break;
+
+	case STREAM_BLOCKS :
+	    lisp_stream_init_blocks(&test->stream, &test->blocks, blocks_fill, 0);
+	    break;
+    }
+
+    return &test->stream;
+}
+
+static void
+close_test_stream (test_stream_t *test)
+{
+    if (test->file != 0)
+	fclose(test->file);
+    free(test->copy);
+}
+
+/* Reads all expressions of input with lisp_read_recovering from the
+   given kind of stream and returns them dumped one per line, with the
+   number of errors in *num_errors. */
+static char*
+read_recovering (const char *input, int kind, size_t block_size, int *num_errors)
+{
+    test_stream_t test;
+    lisp_stream_t *stream = open_test_stream(&test, input, kind, block_size);
+    char *result;
+    size_t result_length;
+    FILE *out = open_memstream(&result, &result_length);
+    lisp_object_t *obj;
+
+    *num_errors = 0;
+    while (lisp_type(obj = lisp_read_recovering(stream, count_error, num_errors)) != LISP_TYPE_EOF)
+    {
+	lisp_dump(obj, out);
+	fputc('\n', out);
+	lisp_free(obj);
+    }
+
+    fclose(out);
+    close_test_stream(&test);
+
+    return result;
+}
+
+/* Checks lisp_read_recovering on input, which must give expected and
+   the given number of errors on memory mapped streams, and
+   streamed and streamed_errors on the others. */
+static void
+check_recovering (const char *input, const char *expected, int num_errors,
+		  const char *streamed, int streamed_errors)
+{
+    int kind;
+    size_t block_size;
+
+    for (kind = STREAM_STRING; kind <= STREAM_BLOCKS; ++kind)
+	for (block_size = 1; block_size <= (kind == STREAM_BLOCKS ? 4 : 1); ++block_size)
+	{
+	    int errors;
+	    char *result = read_recovering(input, kind, block_size, &errors);
+
+	    if (kind == STREAM_STRING)
+	    {
+		CHECK(strcmp(result, expected) == 0);
+		CHECK(errors == num_errors);
+	    }
+	    else
+	    {
+		CHECK(strcmp(result, streamed) == 0);
+		CHECK(errors == streamed_errors);
+	    }
+
+	    free(result);
+	}
+}
+
+static void
+recovering_test (void)
+{
+    /* valid input */
+    check_recovering("(a 1)\n(b \"c\")\n", "(a 1 )\n(b \"c\" )\n", 0, "(a 1 )\n(b \"c\" )\n", 0);
+    /* broken atoms are skipped by themselves */
+    check_recovering("(a) ) (b) #x (c)\n(d)\n", "(a )\n(b )\n(c )\n(d )\n", 2, "(a )\n(b )\n(c )\n(d )\n", 2);
+    /* broken lists are skipped up to the next line starting with a
+       parenthesis */
+    check_recovering("(a #\n(b)\n(c)\n", "(b )\n(c )\n", 1, "(b )\n(c )\n", 1);
+    check_recovering("(a (b\n(c)\n(d)\n", "(c )\n(d )\n", 1, "(c )\n(d )\n", 1);
+    check_recovering("(a\n(b)\n(c\n(d)\n", "(b )\n(d )\n", 2, "(b )\n(d )\n", 2);
+    /* unterminated strings */
+    check_recovering("(a \"unterminated\n(b)\n(c \"x\")\n", "(b )\n(c \"x\" )\n", 1, "(b )\n(c \"x\" )\n", 1);
+    check_recovering("\"unterminated\n(b)\n", "(b )\n", 1, "(b )\n", 1);
+    /* memory mapped streams read expressions that go on after a line
+       starting with a parenthesis as a whole */
+    check_recovering("(define x\n(foo 1))\n(bar)\n", "(define x (foo 1 ))\n(bar )\n", 0,
+		     "(foo 1 )\n(bar )\n", 2);
+    check_recovering("\"a\n(b)\"\n(c)\n", "\"a\n(b)\" \n(c )\n", 0, "(b )\n(c )\n", 2);
+    /* and skip such an expression as a whole if it is broken */
+    check_recovering("(a\n(b #x)\n(c))\n(d)\n", "(d )\n", 1, "(c )\n(d )\n", 3);
+}
+
+/* Prints the elements of the list entered last, entering the lists
+   among them.  Returns 0 on a parse error. */
+static int
+dump_elements (lisp_stream_t *stream, FILE *out)
+{
+    for (;;)
+    {
+	lisp_object_t *obj;
+
+	if (lisp_enter_list(stream) == 1)
+	{
+	    fputc('[', out);
+	    if (!dump_elements(stream, out))
+		return 0;
+	    fputs("] ", out);
+	    continue;
+	}
+
+	obj = lisp_read_element(stream);
+	if (lisp_type(obj) == LISP_TYPE_EOF)
+	    return 1;
+	if (lisp_type(obj) == LISP_TYPE_PARSE_ERROR)
+	{
+	    fputs("error", out);
+	    return 0;
+	}
+	lisp_dump(obj, out);
+	lisp_free(obj);
+    }
+}
+
+static void
+check_enter (const char *input, const char *expected)
+{
+    int kind;
+    size_t block_size;
+
+    for (kind = STREAM_STRING; kind <= STREAM_BLOCKS; ++kind)
+	for (block_size = 1; block_size <= (kind == STREAM_BLOCKS ? 4 : 1); ++block_size)
+	{
+	    test_stream_t test;
+	    lisp_stream_t *stream = open_test_stream(&test, input, kind, block_size);
+	    char *result;
+	    size_t result_length;
+	    FILE *out = open_memstream(&result, &result_length);
+
+	    CHECK(lisp_enter_list(stream) == 1);
+	    if (dump_elements(stream, out))
+		CHECK(lisp_enter_list(stream) == 0);
+	    fclose(out);
+
+	    CHECK(strcmp(result, expected) == 0);
+
+	    free(result);
+	    close_test_stream(&test);
+	}
+}
+
+static void
+enter_test (void)
+{
+    /* atoms are not consumed by lisp_enter_list */
+    check_enter("(a (b c) \"s\" ; comment\n (d) e)", "a [b c ] \"s\" [d ] e ");
+    check_enter(" ( () x #t 12 (()) #?(list))", "[] x #t 12 [[] ] #?(list )");
+    check_enter("(a . b)", "a error");
+    check_enter("(a (b", "a [b error");
+}
+
+/* Checks that lisp_validate gives result and error_offset for input
+   on all kinds of streams. */
+static void
+check_validate (const char *input, int result, long error_offset)
+{
+    int kind;
+    size_t block_size;
+
+    for (kind = STREAM_STRING; kind <= STREAM_BLOCKS; ++kind)
+	for (block_size = 1; block_size <= (kind == STREAM_BLOCKS ? 4 : 1); ++block_size)
+	{
+	    test_stream_t test;
+	    lisp_validate_stats_t stats;
+
+	    CHECK(lisp_validate(open_test_stream(&test, input, kind, block_size), &stats) == result);
+	    CHECK(stats.error_offset == error_offset);
+
+	    close_test_stream(&test);
+	}
+}
+
+static void
+validate_test (void)
+{
+    check_validate("(a \"b\" (c . d))\n#t", 1, -1);
+    /* errors are reported at the start of the offending token */
+    check_validate("(a \"unterminated\n(b)\n", 0, 3);
+    check_validate("(a \"x\\\"y", 0, 3);
+    check_validate("(a) ; comment\n)", 0, 14);
+    check_validate("(a . b c)", 0, 7);
+    check_validate("(a #x b)", 0, 3);
+    check_validate("(. a)", 0, 1);
+    /* or at the end of the input within a list */
+    check_validate("(a (b)", 0, 6);
+
+    lisp_set_max_token_length(8);
+    check_validate("(abcdefgh \"abcdefgh\")", 1, -1);
+    check_validate("(a abcdefghi)", 0, 3);
+    check_validate("(a \"abcdef\\\"g\" \"abcdefghi\")", 0, 15);
+    lisp_set_max_token_length(LISP_DEFAULT_MAX_TOKEN_LENGTH);
+}
+
+typedef struct
+{
+    int id;
+    float weight;
+    char *name;
+} user_t;
+
+/* Matches input against pattern, binding the variables 0, 1 and 2 to
+   the fields of user, which is reset first. */
+static int
+match_user (const char *pattern_string, const char *input, int name_index, user_t *user)
+{
+    lisp_binding_t bindings[] = {
+	LISP_BINDING(0, LISP_BIND_INTEGER, user_t, id),
+	LISP_BINDING(1, LISP_BIND_REAL, user_t, weight),
+	LISP_BINDING(name_index, LISP_BIND_STRING, user_t, name)
+    };
+    lisp_object_t *pattern = lisp_read_from_string(pattern_string);
+    lisp_object_t *obj = lisp_read_from_string(input);
+    int result;
+
+    CHECK(lisp_compile_pattern(&pattern, 0));
+
+    user->id = -1;
+    user->weight = -1;
+    user->name = 0;
+    result = lisp_match_pattern_bind(pattern, obj, bindings, 3, user);
+
+    /* the name points into obj */
+    if (user->name != 0)
+	user->name = strdup(user->name);
+
+    lisp_free(obj);
+    lisp_free(pattern);
+
+    return result;
+}
+
+static void
+bind_test (void)
+{
+    user_t user;
+
+    CHECK(match_user("(user #?(integer) #?(number) #?(string))", "(user 7 2 \"x\")", 2, &user));
+    CHECK(user.id == 7 && user.weight == 2 && user.name != 0 && strcmp(user.name, "x") == 0);
+    free(user.name);
+
+    /* reals are not truncated into integer fields */
+    CHECK(!match_user("(user #?(number) #?(number) #?(string))", "(user 7.5 2 \"x\")", 2, &user));
+    CHECK(user.id == -1 && user.weight == -1 && user.name == 0);
+
+    /* a failed match leaves the record alone */
+    CHECK(!match_user("(user #?(integer) #?(number) #?(string))", "(user 7 2 x)", 2, &user));
+    CHECK(user.id == -1 && user.weight == -1 && user.name == 0);
+
+    /* indices of variables which cannot be bound */
+    CHECK(!match_user("(user #?(integer) #?(number) #?(string))", "(user 7 2 \"x\")", -1, &user));
+    CHECK(!match_user("(user #?(integer) #?(number) #?(string))", "(user 7 2 \"x\")",
+		      LISP_MAX_BIND_VARS, &user));
+    CHECK(user.id == -1 && user.weight == -1 && user.name == 0);
+
+    /* variables without a match are left alone */
+    CHECK(match_user("(user #?(integer) #?(number))", "(user 7 2)", 2, &user));
+    CHECK(user.id == 7 && user.weight == 2 && user.name == 0);
+}
+
+static void
+check_path (const char *spec, const char *input, const char *expected, int applies)
+{
+    lisp_path_t *path = lisp_path_compile(spec);
+    lisp_object_t *obj = lisp_read_from_string(input);
+    lisp_object_t *result = 0;
+    char *dump;
+    size_t dump_length;
+    FILE *out;
+    int kind;
+    size_t block_size;
+
+    CHECK(path != 0);
+
+    /* applied to an expression */
+    out = open_memstream(&dump, &dump_length);
+    CHECK(lisp_path_apply(path, obj, &result) == applies);
+    if (applies)
+	lisp_dump(result, out);
+    fclose(out);
+    CHECK(strcmp(dump, applies ? expected : "") == 0);
+    free(dump);
+    lisp_free(obj);
+
+    /* and while reading, which must stop after the whole expression */
+    for (kind = STREAM_STRING; kind <= STREAM_BLOCKS; ++kind)
+	for (block_size = 1; block_size <= (kind == STREAM_BLOCKS ? 4 : 1); ++block_size)
+	{
+	    test_stream_t test;
+	    char *input_and_next = (char*)malloc(strlen(input) + 8);
+	    lisp_stream_t *stream;
+
+	    sprintf(input_and_next, "%s (next)", input);
+	    stream = open_test_stream(&test, input_and_next, kind, block_size);
+
+	    out = open_memstream(&dump, &dump_length);
+	    result = lisp_read_path(stream, path);
+	    lisp_dump(result, out);
+	    lisp_free(result);
+	    result = lisp_read(stream);
+	    lisp_dump(result, out);
+	    lisp_free(result);
+	    fclose(out);
+
+	    CHECK(strncmp(dump, applies ? expected : "()", strlen(applies ? expected : "()")) == 0);
+	    CHECK(strcmp(dump + strlen(applies ? expected : "()"), "(next )") == 0);
+
+	    free(dump);
+	    free(input_and_next);
+	    close_test_stream(&test);
+	}
+
+    lisp_path_free(path);
+}
+
+static void
+path_test (void)
+{
+    check_path("a", "(x y)", "x ", 1);
+    check_path("d", "(x y)", "(y )", 1);
+    check_path("2", "(x (y) \"z\" w)", "\"z\" ", 1);
+    check_path("d a :timestamp", "(event (:id 1 :timestamp 42) (:timestamp 0))", "42 ", 1);
+    check_path(":b 0", "(:a (1) :b ((2 3) 4))", "(2 3 )", 1);
+    /* steps which do not apply */
+    check_path("a", "x", 0, 0);
+    check_path("5", "(x y)", 0, 0);
+    check_path(":missing", "(:a 1 :b 2)", 0, 0);
+    check_path("d d a a", "(x y)", 0, 0);
+}
+
+/* Replaces the contents of the file path with text. */
+static void
+write_file (const char *path, const char *text)
+{
+    FILE *file = fopen(path, "w");
+
+    CHECK(file != 0);
+    if (file == 0)
+	return;
+    CHECK(fwrite(text, 1, strlen(text), file) == strlen(text));
+    fclose(file);
+}
+
+static void
+log_change (int change, long index, lisp_object_t *old_form, lisp_object_t *new_form, void *data)
+{
+    FILE *out = (FILE*)data;
+
+    fprintf(out, "%c%ld ", change == LISP_FORM_ADDED ? 'A' : change == LISP_FORM_REMOVED ? 'R' : 'M', index);
+    CHECK((old_form != 0) == (change != LISP_FORM_ADDED));
+    CHECK((new_form != 0) == (change != LISP_FORM_REMOVED));
+}
+
+static char*
+dump_forms (lisp_forms_t *forms)
+{
+    char *result;
+    size_t result_length;
+    FILE *out = open_memstream(&result, &result_length);
+    long i;
+
+    for (i = 0; i < lisp_forms_length(forms); ++i)
+    {
+	lisp_dump(lisp_forms_nth(forms, i), out);
+	fputc('\n', out);
+    }
+    fclose(out);
+
+    return result;
+}
+
+/* Loads the file path with the contents before, reloads it after
+   changing them to after and checks the changes reported, and that the
+   forms are the same as when loading after from scratch. */
+static void
+check_reload (const char *path, const char *before, const char *after, const char *changes)
+{
+    lisp_forms_t *forms, *fresh;
+    char *log, *result, *expected;
+    size_t log_length;
+    FILE *out;
+
+    write_file(path, before);
+    forms = lisp_forms_load(path);
+    CHECK(forms != 0);
+    if (forms == 0)
+	return;
+
+    write_file(path, after);
+    out = open_memstream(&log, &log_length);
+    CHECK(lisp_forms_reload(forms, log_change, out));
+    fclose(out);
+    CHECK(strcmp(log, changes) == 0);
+
+    fresh = lisp_forms_load(path);
+    CHECK(fresh != 0);
+    if (fresh != 0)
+    {
+	result = dump_forms(forms);
+	expected = dump_forms(fresh);
+	CHECK(strcmp(result, expected) == 0);
+	free(result);
+	free(expected);
+	lisp_forms_free(fresh);
+    }
+
+    free(log);
+    lisp_forms_free(forms);
+}
+
+static void
+reload_test (void)
+{
+    char path[] = "/tmp/lisptestXXXXXX";
+    const char *forms = "(a 1)\n(b \"x\")\n(c (d))\n(e)\n";
+    int fd = mkstemp(path);
+
+    CHECK(fd != -1);
+    if (fd == -1)
+	return;
+    close(fd);
+
+    check_reload(path, forms, forms, "");
+    /* edits */
+    check_reload(path, forms, "(a 1)\n(b \"y\")\n(c (d))\n(e)\n", "M1 ");
+    check_reload(path, forms, "(a 2)\n(b \"x\")\n(c (d))\n(e 3)\n", "M0 M1 M2 M3 ");
+    check_reload(path, forms, "(a 1)\n  (b \"x\") ; comment\n(c (d))\n(e)\n", "");
+    /* inserted and removed forms */
+    check_reload(path, forms, "(a 1)\n(b \"x\")\n(new)\n(c (d))\n(e)\n", "A2 ");
+    check_reload(path, forms, "(a 1)\n(c (d))\n(e)\n", "R1 ");
+    check_reload(path, forms, "(a 1)\n(b \"x\")\n(c (d))\n(e)\n(f)\n", "A4 ");
+    check_reload(path, forms, "", "R0 R1 R2 R3 ");
+    check_reload(path, "", forms, "A0 A1 A2 A3 ");
+    /* atoms which continue or precede unchanged text */
+    check_reload(path, forms, "x (a 1)\n(b \"x\")\n(c (d))\n(e)\n", "A0 ");
+    check_reload(path, "a (b) c", "a (b) cd", "M2 ");
+    check_reload(path, "ab (b) c", "a (b) c", "M0 ");
+    /* a string which swallows the forms after it */
+    check_reload(path, forms, "(a 1)\n(b \"x)\n(c (d))\n(e \")\n", "M1 R2 R3 ");
+
+    /* a parse error leaves the forms alone */
+    {
+	lisp_forms_t *loaded;
+	char *before, *after;
+
+	write_file(path, forms);
+	loaded = lisp_forms_load(path);
+	CHECK(loaded != 0);
+	if (loaded != 0)
+	{
+	    before = dump_forms(loaded);
+	    write_file(path, "(a 1)\n(b \"x\"\n(c (d))\n(e)\n");
+	    CHECK(!lisp_forms_reload(loaded, 0, 0));
+	    after = dump_forms(loaded);
+	    CHECK(strcmp(before, after) == 0);
+	    free(before);
+	    free(after);
+	    lisp_forms_free(loaded);
+	}
+    }
+
+    unlink(path);
+}
+
+/* Loads a file which lisp_load_many splits into chunks, with strings
+   containing lines which start with open parens, some nested more
+   deeply than chunks are read, and checks that it gives the same forms
+   as reading the file in one go. */
+static void
+check_load_many (const char *path, const char *text)
+{
+    lisp_load_result_t result;
+    lisp_load_t *load;
+    lisp_stream_t stream;
+    lisp_object_t *list, *obj;
+    int status = LISP_LOAD_OK;
+
+    write_file(path, text);
+
+    load = lisp_load_many(&path, 1, 2, &result);
+    CHECK(load != 0);
+    if (load == 0)
+	return;
+
+    lisp_stream_init_string(&stream, (char*)text);
+    list = result.forms;
+    for (;;)
+    {
+	obj = lisp_read(&stream);
+	if (lisp_type(obj) == LISP_TYPE_EOF)
+	    break;
+	if (lisp_type(obj) == LISP_TYPE_PARSE_ERROR)
+	{
+	    status = LISP_LOAD_PARSE_ERROR;
+	    break;
+	}
+	if (result.status == LISP_LOAD_OK)
+	{
+	    CHECK(lisp_type(list) == LISP_TYPE_CONS && lisp_equal(lisp_car(list), obj));
+	    if (lisp_type(list) == LISP_TYPE_CONS)
+		list = lisp_cdr(list);
+	}
+	lisp_free(obj);
+    }
+    CHECK(result.status == status);
+    if (status == LISP_LOAD_OK)
+	CHECK(lisp_type(list) == LISP_TYPE_NIL);
+
+    lisp_load_free(load);
+}
+
+static void
+load_many_test (void)
+{
+    char path[] = "/tmp/lisptestXXXXXX";
+    size_t length = 5 * 1024 * 1024, used = 0;
+    char *text = (char*)malloc(length + 1024);
+    int fd = mkstemp(path);
+    int i = 0;
+
+    CHECK(fd != -1);
+    if (fd == -1)
+	return;
+    close(fd);
+
+    /* most of the text is within strings, so the chunks mostly start
+       within them */
+    while (used < length)
+    {
+	int j;
+
+	used += sprintf(text + used, "(doc %d \"", i);
+	for (j = 0; j < 2000 && used < length; ++j)
+	{
+	    if (j % 500 == 250)
+	    {
+		/* deeper than chunks are read */
+		memcpy(text + used, "\n(", 2);
+		used += 1;
+		memset(text + used, '(', 300);
+		used += 300;
+	    }
+	    else
+		used += sprintf(text + used, "\n(fake %d (%d", i, j);
+	}
+	used += sprintf(text + used, "\")\n(rec %d (a \"b\") 1.5)\n", i);
+	++i;
+    }
+    text[used] = '\0';
+
+    check_load_many(path, text);
+
+    /* a parse error in the last chunk */
+    strcpy(text + used, "(broken \"x\n");
+    check_load_many(path, text);
+
+    /* chunks which start at expressions nested too deeply */
+    for (used = 0, i = 0; used < length; ++i)
+    {
+	used += sprintf(text + used, "(deep %d ", i);
+	memset(text + used, '(', 300);
+	used += 300;
+	memset(text + used, ')', 301);
+	used += 301;
+	text[used++] = '\n';
+    }
+    text[used] = '\0';
+    check_load_many(path, text);
+
+    unlink(path);
+    free(text);
+}
 
 static lisp_object_t*
 make_fib_tree (int n)
@@ -34,6 +698,13 @@ main (void)
     printf("\n");
 
     free_test();
+    recovering_test();
+    bind_test();
+    enter_test();
+    validate_test();
+    path_test();
+    reload_test();
+    load_many_test();
 
     lisp_stream_init_file(&stream, stdin);
 
@@ -68,5 +739,11 @@ main (void)
 	    break;
     }
 
+    if (num_failures > 0)
+    {
+	fprintf(stderr, "%d checks failed\n", num_failures);
+	return 1;
+    }
+
     return 0;
 }
@@ -0,0 +1,996 @@
+/*
+ * load.c
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <pools.h>
+#include <chunks.h>
+#include <load.h>
+
+#define FIRST_READ_SIZE     (64 * 1024)
+
+/* Reads all top-level expressions from the length bytes at buf into a
+   list. */
+static int
+parse_buffer (allocator_t *allocator, const char *buf, size_t length, lisp_object_t **forms)
+{
+    lisp_stream_t stream;
+    lisp_object_t *list = lisp_nil(), *last = 0;
+
+    lisp_stream_init_buffer(&stream, buf, length);
+
+    for (;;)
+    {
+	lisp_object_t *obj = lisp_read_with_allocator(allocator, &stream), *cons;
+
+	if (lisp_type(obj) == LISP_TYPE_EOF)
+	    break;
+	if (lisp_type(obj) == LISP_TYPE_PARSE_ERROR)
+	{
+	    lisp_free_with_allocator(allocator, list);
+	    *forms = lisp_nil();
+	    return LISP_LOAD_PARSE_ERROR;
+	}
+
+	cons = lisp_make_cons_with_allocator(allocator, obj, lisp_nil());
+	if (last == 0)
+	    list = cons;
+	else
+	    last->v.cons.cdr = cons;
+	last = cons;
+    }
+
+    *forms = list;
+
+    return LISP_LOAD_OK;
+}
+
+/* Reads the whole file at path into a newly allocated buffer. */
+static int
+read_file (const char *path, char **buf, size_t *length)
+{
+    struct stat sb;
+    size_t size = 0, capacity;
+    char *data;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1)
+	return 0;
+
+    capacity = fstat(fd, &sb) == 0 && sb.st_size > 0 ? sb.st_size + 1 : FIRST_READ_SIZE;
+    data = (char*)malloc(capacity);
+
+    while (data != 0)
+    {
+	ssize_t n = read(fd, data + size, capacity - size);
+
+	if (n == 0)
+	    break;
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    free(data);
+	    data = 0;
+	    break;
+	}
+
+	size += n;
+	if (size == capacity)
+	{
+	    char *bigger = (char*)realloc(data, capacity *= 2);
+
+	    if (bigger == 0)
+		free(data);
+	    data = bigger;
+	}
+    }
+
+    close(fd);
+
+    *buf = data;
+    *length = size;
+
+    return data != 0;
+}
+
+static void
+load_one (const char *path, lisp_load_result_t *result)
+{
+    char *buf;
+    size_t length;
+
+    result->forms = lisp_nil();
+
+    if (!read_file(path, &buf, &length))
+    {
+	result->status = LISP_LOAD_IO_ERROR;
+	return;
+    }
+
+    result->status = parse_buffer(&malloc_allocator, buf, length, &result->forms);
+    free(buf);
+}
+
+typedef struct
+{
+    const char **paths;
+    int n;
+    int next;
+    lisp_load_result_t *results;
+} batch_t;
+
+static void*
+batch_worker (void *data)
+{
+    batch_t *batch = (batch_t*)data;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&batch->next, 1)) < batch->n)
+	load_one(batch->paths[i], &batch->results[i]);
+
+    return 0;
+}
+
+/* Loads the files on a thread per processor. */
+static void
+load_batch_threads (const char **paths, int n, lisp_load_result_t *results)
+{
+    batch_t batch = { paths, n, 0, results };
+    pthread_t threads[64];
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, started = 0;
+
+    if (num_threads > 64)
+	num_threads = 64;
+    if (num_threads > n)
+	num_threads = n;
+
+    for (i = 1; i < num_threads; ++i)
+	if (pthread_create(&threads[started], 0, batch_worker, &batch) == 0)
+	    ++started;
+
+    batch_worker(&batch);
+
+    for (i = 0; i < started; ++i)
+	pthread_join(threads[i], 0);
+}
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING
+
+#define RING_FILES          64	/* files in flight */
+#define RING_ENTRIES        RING_FILES
+
+#define OP_OPEN             0
+#define OP_READ             1
+#define OP_CLOSE            2
+
+typedef struct
+{
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned num_sqes;
+    unsigned to_submit;
+} ring_t;
+
+typedef struct
+{
+    int index;			/* of the file, or -1 if the slot is free */
+    int fd;			/* -1 until the file is open */
+    int closing;		/* the file was read and its close is queued */
+    char *buf;
+    size_t length;
+    size_t capacity;
+} ring_file_t;
+
+/* Returns whether the kernel supports the operations used here.
+   Kernels before 5.6 set up rings, but neither support opening and
+   closing files nor the probe. */
+static int
+ring_probe (int fd)
+{
+    static const int ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+    struct io_uring_probe *probe;
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    int i, supported = 1;
+
+    probe = (struct io_uring_probe*)calloc(1, size);
+    if (probe == 0)
+	return 0;
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0)
+	supported = 0;
+    for (i = 0; supported && i < (int)(sizeof(ops) / sizeof(ops[0])); ++i)
+	if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+	    supported = 0;
+
+    free(probe);
+
+    return supported;
+}
+
+static int
+ring_init (ring_t *ring)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd < 0)
+	return 0;
+
+    if (!ring_probe(ring->fd))
+	goto error;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+	if (ring->cq_ring_size > ring->sq_ring_size)
+	    ring->sq_ring_size = ring->cq_ring_size;
+	ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+	goto error;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+	ring->cq_ring = ring->sq_ring;
+    else
+    {
+	ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			     ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+	{
+	    munmap(ring->sq_ring, ring->sq_ring_size);
+	    goto error;
+	}
+    }
+
+    ring->num_sqes = params.sq_entries;
+    ring->sqes = (struct io_uring_sqe*)mmap(0, params.sq_entries * sizeof(struct io_uring_sqe),
+					    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					    ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+	if (ring->cq_ring != ring->sq_ring)
+	    munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	goto error;
+    }
+
+    ring->sq_tail = (unsigned*)((char*)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned*)((char*)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned*)((char*)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+    ring->to_submit = 0;
+
+    return 1;
+
+ error:
+    close(ring->fd);
+    return 0;
+}
+
+static void
+ring_free (ring_t *ring)
+{
+    munmap(ring->sqes, ring->num_sqes * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring != ring->sq_ring)
+	munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/* Queues an operation for slot.  There is never more than one
+   operation per slot in flight, so the ring cannot overflow. */
+static void
+ring_queue (ring_t *ring, int op, int slot, int fd, const void *addr, unsigned length, unsigned long offset)
+{
+    unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = (unsigned long)slot * 4 + op;
+
+    switch (op)
+    {
+	case OP_OPEN :
+	    sqe->opcode = IORING_OP_OPENAT;
+	    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	    break;
+
+	case OP_READ :
+	    sqe->opcode = IORING_OP_READ;
+	    break;
+
+	case OP_CLOSE :
+	    sqe->opcode = IORING_OP_CLOSE;
+	    break;
+    }
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->to_submit;
+}
+
+static void
+ring_read (ring_t *ring, ring_file_t *file, int slot)
+{
+    ring_queue(ring, OP_READ, slot, file->fd, file->buf + file->length,
+	       file->capacity - file->length, file->length);
+}
+
+/* Handles the completion of the operation op for slot.  Returns 1 if
+   the slot has become free. */
+static int
+ring_complete (ring_t *ring, ring_file_t *file, int slot, int op, int res,
+	       lisp_load_result_t *results)
+{
+    lisp_load_result_t *result = &results[file->index];
+
+    switch (op)
+    {
+	case OP_OPEN :
+	    if (res < 0)
+	    {
+		result->status = LISP_LOAD_IO_ERROR;
+		return 1;
+	    }
+	    file->fd = res;
+	    file->length = 0;
+	    file->capacity = FIRST_READ_SIZE;
+	    file->buf = (char*)malloc(file->capacity);
+	    if (file->buf == 0)
+		break;
+	    ring_read(ring, file, slot);
+	    return 0;
+
+	case OP_READ :
+	    if (res < 0)
+		break;
+
+	    file->length += res;
+	    if (file->length == file->capacity)
+	    {
+		char *bigger = (char*)realloc(file->buf, file->capacity *= 2);
+
+		if (bigger == 0)
+		    break;
+		file->buf = bigger;
+		ring_read(ring, file, slot);
+		return 0;
+	    }
+
+	    /* reads from regular files are only short at the end */
+	    ring_queue(ring, OP_CLOSE, slot, file->fd, 0, 0, 0);
+	    file->closing = 1;
+
+	    /* the file is parsed while the kernel works on the others */
+	    result->status = parse_buffer(&malloc_allocator, file->buf, file->length, &result->forms);
+	    free(file->buf);
+	    file->buf = 0;
+	    return 0;
+
+	case OP_CLOSE :
+	    return 1;
+    }
+
+    result->status = LISP_LOAD_IO_ERROR;
+    free(file->buf);
+    file->buf = 0;
+    ring_queue(ring, OP_CLOSE, slot, file->fd, 0, 0, 0);
+    file->closing = 1;
+
+    return 0;
+}
+
+/* Loads the files through an io_uring.  Returns 0 if io_uring is not
+   available. */
+static int
+load_batch_ring (const char **paths, int n, lisp_load_result_t *results)
+{
+    ring_t ring;
+    ring_file_t files[RING_FILES];
+    int next = 0, active = 0, failed = 0, slot;
+
+    if (!ring_init(&ring))
+	return 0;
+
+    for (slot = 0; slot < RING_FILES; ++slot)
+	files[slot].index = -1;
+
+    while (next < n || active > 0)
+    {
+	unsigned head, tail;
+	long submitted;
+
+	for (slot = 0; slot < RING_FILES && next < n; ++slot)
+	{
+	    if (files[slot].index >= 0)
+		continue;
+
+	    files[slot].index = next;
+	    files[slot].fd = -1;
+	    files[slot].closing = 0;
+	    files[slot].buf = 0;
+	    results[next].forms = lisp_nil();
+	    ring_queue(&ring, OP_OPEN, slot, AT_FDCWD, paths[next], 0, 0);
+	    ++next;
+	    ++active;
+	}
+
+	submitted = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 1, IORING_ENTER_GETEVENTS, 0, 0);
+	if (submitted < 0)
+	{
+	    if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+		continue;
+
+	    /* the queued closes which were not submitted are done
+	       here, the other files are loaded again below */
+	    for (; ring.to_submit > 0; --ring.to_submit)
+	    {
+		unsigned index = ring.sq_array[(*ring.sq_tail - ring.to_submit) & *ring.sq_mask];
+
+		if (ring.sqes[index].opcode == IORING_OP_CLOSE)
+		    close(ring.sqes[index].fd);
+	    }
+	    failed = 1;
+	    break;
+	}
+	ring.to_submit -= submitted;
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head)
+	{
+	    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+	    int slot = cqe->user_data / 4, op = cqe->user_data % 4;
+
+	    if (ring_complete(&ring, &files[slot], slot, op, cqe->res, results))
+	    {
+		files[slot].index = -1;
+		--active;
+	    }
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    ring_free(&ring);
+
+    if (failed)
+    {
+	/* the files still in flight, unless they have already been
+	   read, are loaded again like those not submitted yet */
+	for (slot = 0; slot < RING_FILES; ++slot)
+	{
+	    ring_file_t *file = &files[slot];
+
+	    if (file->index < 0 || file->closing)
+		continue;
+
+	    if (file->fd >= 0)
+		close(file->fd);
+	    free(file->buf);
+	    load_one(paths[file->index], &results[file->index]);
+	}
+	for (; next < n; ++next)
+	    load_one(paths[next], &results[next]);
+    }
+
+    return 1;
+}
+#endif
+
+int
+lisp_load_batch (const char **paths, int n, lisp_load_result_t *results)
+{
+    int i, num_loaded = 0;
+
+    if (n <= 0)
+	return 0;
+
+#ifdef HAVE_IO_URING
+    if (!load_batch_ring(paths, n, results))
+#endif
+	load_batch_threads(paths, n, results);
+
+    for (i = 0; i < n; ++i)
+	if (results[i].status == LISP_LOAD_OK)
+	    ++num_loaded;
+
+    return num_loaded;
+}
+
+/* lisp_load_many distributes the files over per-worker deques.  A
+   worker takes tasks from the bottom of its own deque and, when it has
+   run out, steals from the top of the others'.  Large files are split
+   into chunks, as described in chunks.c, each of which is parsed by a
+   task of its own. */
+
+#define TASK_FILE           0
+#define TASK_CHUNK          1
+
+typedef struct
+{
+    int kind;
+    int file;
+    int chunk;
+} task_t;
+
+/* A list of forms being built with allocator. */
+typedef struct
+{
+    allocator_t *allocator;
+    lisp_object_t *head;
+    lisp_object_t *tail;
+} forms_t;
+
+typedef struct
+{
+    char *buf;
+    size_t length;
+    int num_chunks;
+    int remaining;
+    lisp_chunk_t *chunks;
+    forms_t *forms;		/* the expressions read from each chunk */
+} split_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    task_t *tasks;
+    int top;
+    int bottom;
+    int capacity;
+    pools_t pools;
+    allocator_t allocator;
+    lisp_load_t *load;
+    pthread_t thread;
+} worker_t;
+
+struct _lisp_load_t
+{
+    const char **paths;
+    lisp_load_result_t *results;
+    split_t **splits;
+    int num_workers;
+    worker_t *workers;
+    long outstanding;		/* tasks not finished yet */
+    long queued;		/* tasks in the deques */
+
+    /* idle workers sleep until tasks are queued or all are finished */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int sleepers;
+};
+
+/* Wakes the idle workers, if there are any. */
+static void
+wake_workers (lisp_load_t *load)
+{
+    /* pairs with the fence in wait_for_task */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&load->sleepers, __ATOMIC_RELAXED) == 0)
+	return;
+
+    pthread_mutex_lock(&load->idle_lock);
+    pthread_cond_broadcast(&load->idle_cond);
+    pthread_mutex_unlock(&load->idle_lock);
+}
+
+static void
+wait_for_task (lisp_load_t *load)
+{
+    pthread_mutex_lock(&load->idle_lock);
+    __atomic_add_fetch(&load->sleepers, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&load->queued, __ATOMIC_ACQUIRE) == 0
+	   && __atomic_load_n(&load->outstanding, __ATOMIC_ACQUIRE) > 0)
+	pthread_cond_wait(&load->idle_cond, &load->idle_lock);
+    __atomic_sub_fetch(&load->sleepers, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&load->idle_lock);
+}
+
+static int
+worker_push (worker_t *worker, task_t *task)
+{
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->bottom == worker->capacity)
+    {
+	if (worker->top > 0)
+	{
+	    memmove(worker->tasks, worker->tasks + worker->top, (worker->bottom - worker->top) * sizeof(task_t));
+	    worker->bottom -= worker->top;
+	    worker->top = 0;
+	}
+	else
+	{
+	    int capacity = worker->capacity == 0 ? 64 : 2 * worker->capacity;
+	    task_t *tasks = (task_t*)realloc(worker->tasks, capacity * sizeof(task_t));
+
+	    if (tasks == 0)
+	    {
+		pthread_mutex_unlock(&worker->lock);
+		return 0;
+	    }
+	    worker->tasks = tasks;
+	    worker->capacity = capacity;
+	}
+    }
+
+    worker->tasks[worker->bottom++] = *task;
+    __atomic_add_fetch(&worker->load->queued, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&worker->lock);
+
+    wake_workers(worker->load);
+
+    return 1;
+}
+
+static int
+worker_pop (worker_t *worker, task_t *task, int steal)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->top < worker->bottom)
+    {
+	*task = steal ? worker->tasks[worker->top++] : worker->tasks[--worker->bottom];
+	__atomic_sub_fetch(&worker->load->queued, 1, __ATOMIC_RELAXED);
+	found = 1;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return found;
+}
+
+static void
+append_form (lisp_object_t *obj, void *data)
+{
+    forms_t *forms = (forms_t*)data;
+    lisp_object_t *cons = lisp_make_cons_with_allocator(forms->allocator, obj, lisp_nil());
+
+    if (forms->tail == 0)
+	forms->head = cons;
+    else
+	forms->tail->v.cons.cdr = cons;
+    forms->tail = cons;
+}
+
+typedef struct
+{
+    forms_t forms;
+    split_t *split;
+} merge_t;
+
+static void
+take_chunk (int index, void *data)
+{
+    merge_t *merge = (merge_t*)data;
+    forms_t *chunk = &merge->split->forms[index];
+
+    if (chunk->head == lisp_nil())
+	return;
+
+    if (merge->forms.tail == 0)
+	merge->forms.head = chunk->head;
+    else
+	merge->forms.tail->v.cons.cdr = chunk->head;
+    merge->forms.tail = chunk->tail;
+}
+
+static void
+append_merged (lisp_object_t *obj, void *data)
+{
+    append_form(obj, &((merge_t*)data)->forms);
+}
+
+static const lisp_chunk_funcs_t merge_funcs = { append_merged, 0, take_chunk, 0 };
+
+/* Puts the chunks of a split file together, once all are parsed. */
+static void
+merge_chunks (worker_t *worker, int file, split_t *split)
+{
+    lisp_load_result_t *result = &worker->load->results[file];
+    merge_t merge;
+    long error;
+
+    merge.forms.allocator = &worker->allocator;
+    merge.forms.head = lisp_nil();
+    merge.forms.tail = 0;
+    merge.split = split;
+
+    if (lisp_chunks_merge(split->buf, split->length, split->chunks, split->num_chunks,
+			  &worker->allocator, &merge_funcs, &merge, &error) == LISP_CHUNK_OK)
+    {
+	result->status = LISP_LOAD_OK;
+	result->forms = merge.forms.head;
+    }
+    else
+    {
+	result->status = LISP_LOAD_PARSE_ERROR;
+	result->forms = lisp_nil();
+    }
+
+    free(split->forms);
+    free(split->chunks);
+    free(split->buf);
+    free(split);
+}
+
+/* Splits the file into chunks and queues them.  Returns 0 if the file
+   is too small to be split. */
+static int
+split_file (worker_t *worker, int file, char *buf, size_t length)
+{
+    split_t *split;
+    int i;
+
+    if (worker->load->num_workers < 2)
+	return 0;
+
+    split = (split_t*)malloc(sizeof(split_t));
+    if (split == 0)
+	return 0;
+    split->num_chunks = lisp_chunks_split(buf, length, &split->chunks);
+    if (split->num_chunks == 0)
+    {
+	free(split);
+	return 0;
+    }
+    split->forms = (forms_t*)malloc(split->num_chunks * sizeof(forms_t));
+    if (split->forms == 0)
+    {
+	free(split->chunks);
+	free(split);
+	return 0;
+    }
+
+    split->buf = buf;
+    split->length = length;
+    split->remaining = split->num_chunks;
+    worker->load->splits[file] = split;
+
+    __sync_add_and_fetch(&worker->load->outstanding, split->num_chunks);
+    for (i = split->num_chunks - 1; i >= 0; --i)
+    {
+	task_t task = { TASK_CHUNK, file, i };
+
+	if (!worker_push(worker, &task))
+	{
+	    /* the chunks which cannot be queued are left unread, so
+	       that the merge reads their text */
+	    for (; i >= 0; --i)
+	    {
+		if (__sync_sub_and_fetch(&split->remaining, 1) == 0)
+		    merge_chunks(worker, file, split);
+		__sync_sub_and_fetch(&worker->load->outstanding, 1);
+	    }
+	    break;
+	}
+    }
+
+    return 1;
+}
+
+static void
+run_task (worker_t *worker, task_t *task)
+{
+    lisp_load_t *load = worker->load;
+
+    if (task->kind == TASK_FILE)
+    {
+	lisp_load_result_t *result = &load->results[task->file];
+	char *buf;
+	size_t length;
+
+	result->forms = lisp_nil();
+
+	if (!read_file(load->paths[task->file], &buf, &length))
+	    result->status = LISP_LOAD_IO_ERROR;
+	else if (!split_file(worker, task->file, buf, length))
+	{
+	    result->status = parse_buffer(&worker->allocator, buf, length, &result->forms);
+	    free(buf);
+	}
+    }
+    else
+    {
+	split_t *split = load->splits[task->file];
+	lisp_chunk_t *chunk = &split->chunks[task->chunk];
+	forms_t *forms = &split->forms[task->chunk];
+	lisp_stream_t stream;
+
+	forms->allocator = &worker->allocator;
+	forms->head = lisp_nil();
+	forms->tail = 0;
+	lisp_stream_init_buffer(&stream, split->buf, split->length);
+	lisp_stream_seek(&stream, chunk->start);
+	chunk->status = lisp_chunks_read(&worker->allocator, &stream, chunk->end, 1,
+					 append_form, forms, &chunk->stop);
+
+	if (__sync_sub_and_fetch(&split->remaining, 1) == 0)
+	    merge_chunks(worker, task->file, split);
+    }
+
+    /* the idle workers return once everything is finished */
+    if (__sync_sub_and_fetch(&load->outstanding, 1) == 0)
+	wake_workers(load);
+}
+
+static void*
+load_worker (void *data)
+{
+    worker_t *worker = (worker_t*)data;
+    lisp_load_t *load = worker->load;
+    int self = worker - load->workers;
+    int spins = 0;
+    task_t task;
+
+    while (__atomic_load_n(&load->outstanding, __ATOMIC_ACQUIRE) > 0)
+    {
+	int i;
+
+	if (worker_pop(worker, &task, 0))
+	{
+	    run_task(worker, &task);
+	    spins = 0;
+	    continue;
+	}
+
+	for (i = 1; i < load->num_workers; ++i)
+	    if (worker_pop(&load->workers[(self + i) % load->num_workers], &task, 1))
+		break;
+
+	if (i < load->num_workers)
+	{
+	    run_task(worker, &task);
+	    spins = 0;
+	}
+	else if (++spins < 16)
+	    sched_yield();
+	else
+	    wait_for_task(load);
+    }
+
+    return 0;
+}
+
+lisp_load_t*
+lisp_load_many (const char **paths, int n, int nthreads, lisp_load_result_t *results)
+{
+    lisp_load_t *load;
+    int i, started;
+
+    if (nthreads <= 0)
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+	nthreads = 1;
+
+    load = (lisp_load_t*)malloc(sizeof(lisp_load_t));
+    if (load == 0)
+	return 0;
+
+    load->paths = paths;
+    load->results = results;
+    load->num_workers = 0;
+    load->outstanding = n;
+    load->queued = 0;
+    load->sleepers = 0;
+    pthread_mutex_init(&load->idle_lock, 0);
+    pthread_cond_init(&load->idle_cond, 0);
+    load->splits = (split_t**)calloc(n > 0 ? n : 1, sizeof(split_t*));
+    load->workers = (worker_t*)calloc(nthreads, sizeof(worker_t));
+    if (load->splits == 0 || load->workers == 0)
+	goto error;
+
+    for (; load->num_workers < nthreads; ++load->num_workers)
+    {
+	worker_t *worker = &load->workers[load->num_workers];
+
+	if (!init_pools(&worker->pools))
+	    goto error;
+	init_pools_allocator(&worker->allocator, &worker->pools);
+	pthread_mutex_init(&worker->lock, 0);
+	worker->load = load;
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+	task_t task = { TASK_FILE, i, 0 };
+
+	if (!worker_push(&load->workers[i % nthreads], &task))
+	    goto error;
+    }
+
+    /* the calling thread is the first worker */
+    for (started = 1; started < nthreads; ++started)
+	if (pthread_create(&load->workers[started].thread, 0, load_worker, &load->workers[started]) != 0)
+	    break;
+
+    load_worker(&load->workers[0]);
+
+    for (i = 1; i < started; ++i)
+	pthread_join(load->workers[i].thread, 0);
+
+    free(load->splits);
+    load->splits = 0;
+
+    return load;
+
+ error:
+    lisp_load_free(load);
+
+    return 0;
+}
+
+void
+lisp_load_free (lisp_load_t *load)
+{
+    int i;
+
+    for (i = 0; i < load->num_workers; ++i)
+    {
+	free_pools(&load->workers[i].pools);
+	free(load->workers[i].tasks);
+	pthread_mutex_destroy(&load->workers[i].lock);
+    }
+
+    pthread_cond_destroy(&load->idle_cond);
+    pthread_mutex_destroy(&load->idle_lock);
+    free(load->workers);
+    free(load->splits);
+    free(load);
+}
@@ -0,0 +1,54 @@
+/*
+ * load.h
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LOAD_H__
+#define __LOAD_H__
+
+#include "lispreader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LISP_LOAD_OK             0
+#define LISP_LOAD_IO_ERROR       1
+#define LISP_LOAD_PARSE_ERROR    2
+
+typedef struct
+{
+    int status;
+    lisp_object_t *forms;	/* the list of the top-level expressions */
+} lisp_load_result_t;
+
+typedef struct _lisp_load_t lisp_load_t;
+
+int lisp_load_batch (const char **paths, int n, lisp_load_result_t *results);
+
+lisp_load_t* lisp_load_many (const char **paths, int n, int nthreads, lisp_load_result_t *results);
+void lisp_load_free (lisp_load_t *load);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
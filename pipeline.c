@@ -0,0 +1,366 @@
+/*
+ * pipeline.c
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <pools.h>
+#include <pipeline.h>
+
+/* A producer thread reads the top-level expressions into a number of
+   arenas, which it uses in turn, and passes them to the consumers
+   through a bounded lock-free queue.  An arena is only reset and
+   reused once all its expressions have been released, which bounds the
+   memory in use.  Threads which have to wait spin for a short while
+   and then sleep on a condition variable, which is only signalled
+   when there are sleepers. */
+
+#define QUEUE_SIZE      1024	/* a power of 2 */
+
+typedef struct
+{
+    long sequence;
+    lisp_object_t *obj;
+    int arena;
+} queue_slot_t;
+
+typedef struct
+{
+    pools_t pools;
+    allocator_t allocator;
+    /* the number of expressions not released yet, plus one while the
+       producer is reading into the arena */
+    int references;
+} arena_t;
+
+struct _lisp_pipeline_t
+{
+    /* each position counter is on a cache line of its own */
+    long enqueue_pos __attribute__ ((aligned(64)));
+    long dequeue_pos __attribute__ ((aligned(64)));
+    queue_slot_t slots[QUEUE_SIZE] __attribute__ ((aligned(64)));
+
+    lisp_stream_t *stream;
+    int num_arenas;
+    int forms_per_arena;
+    arena_t *arenas;
+
+    lisp_object_t *end;		/* the EOF or parse error which ended the stream */
+    int done;
+    int stop;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int sleepers;
+};
+
+typedef int (*ready_func_t) (lisp_pipeline_t *pipeline, void *data);
+
+/* Waits until ready returns non-zero, which is checked again by the
+   caller after backoff returns. */
+static void
+backoff (lisp_pipeline_t *pipeline, int *spins, ready_func_t ready, void *data)
+{
+    if (++*spins < 64)
+    {
+	__asm__ __volatile__ ("" ::: "memory");
+	return;
+    }
+    if (*spins < 128)
+    {
+	sched_yield();
+	return;
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    __atomic_add_fetch(&pipeline->sleepers, 1, __ATOMIC_SEQ_CST);
+    /* pairs with the fence in wake, so that either the waker sees the
+       sleeper or the sleeper sees the change */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (!ready(pipeline, data))
+	pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    __atomic_sub_fetch(&pipeline->sleepers, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+/* Wakes the sleeping threads after a change they might wait for. */
+static void
+wake (lisp_pipeline_t *pipeline)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pipeline->sleepers, __ATOMIC_RELAXED) == 0)
+	return;
+
+    pthread_mutex_lock(&pipeline->lock);
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+/* The queue is the bounded multi-producer multi-consumer queue by
+   Dmitry Vyukov.  Each slot carries a sequence number, which tells
+   whether it is ready to be written or read at a given position. */
+static int
+queue_push (lisp_pipeline_t *pipeline, lisp_object_t *obj, int arena)
+{
+    long pos = __atomic_load_n(&pipeline->enqueue_pos, __ATOMIC_RELAXED);
+    queue_slot_t *slot;
+
+    for (;;)
+    {
+	long diff;
+
+	slot = &pipeline->slots[pos & (QUEUE_SIZE - 1)];
+	diff = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos;
+
+	if (diff == 0)
+	{
+	    if (__atomic_compare_exchange_n(&pipeline->enqueue_pos, &pos, pos + 1, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	}
+	else if (diff < 0)
+	    return 0;
+	else
+	    pos = __atomic_load_n(&pipeline->enqueue_pos, __ATOMIC_RELAXED);
+    }
+
+    slot->obj = obj;
+    slot->arena = arena;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    wake(pipeline);
+
+    return 1;
+}
+
+static int
+queue_pop (lisp_pipeline_t *pipeline, lisp_object_t **obj, int *arena)
+{
+    long pos = __atomic_load_n(&pipeline->dequeue_pos, __ATOMIC_RELAXED);
+    queue_slot_t *slot;
+
+    for (;;)
+    {
+	long diff;
+
+	slot = &pipeline->slots[pos & (QUEUE_SIZE - 1)];
+	diff = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (pos + 1);
+
+	if (diff == 0)
+	{
+	    if (__atomic_compare_exchange_n(&pipeline->dequeue_pos, &pos, pos + 1, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	}
+	else if (diff < 0)
+	    return 0;
+	else
+	    pos = __atomic_load_n(&pipeline->dequeue_pos, __ATOMIC_RELAXED);
+    }
+
+    *obj = slot->obj;
+    *arena = slot->arena;
+    __atomic_store_n(&slot->sequence, pos + QUEUE_SIZE, __ATOMIC_RELEASE);
+
+    wake(pipeline);
+
+    return 1;
+}
+
+static int
+can_push (lisp_pipeline_t *pipeline, void *data)
+{
+    long pos = __atomic_load_n(&pipeline->enqueue_pos, __ATOMIC_RELAXED);
+
+    return __atomic_load_n(&pipeline->slots[pos & (QUEUE_SIZE - 1)].sequence, __ATOMIC_ACQUIRE) == pos
+	|| __atomic_load_n(&pipeline->stop, __ATOMIC_RELAXED);
+}
+
+static int
+can_pop (lisp_pipeline_t *pipeline, void *data)
+{
+    long pos = __atomic_load_n(&pipeline->dequeue_pos, __ATOMIC_RELAXED);
+
+    return __atomic_load_n(&pipeline->slots[pos & (QUEUE_SIZE - 1)].sequence, __ATOMIC_ACQUIRE) == pos + 1
+	|| __atomic_load_n(&pipeline->done, __ATOMIC_ACQUIRE);
+}
+
+static int
+can_reuse (lisp_pipeline_t *pipeline, void *data)
+{
+    return __atomic_load_n(&((arena_t*)data)->references, __ATOMIC_ACQUIRE) == 0
+	|| __atomic_load_n(&pipeline->stop, __ATOMIC_RELAXED);
+}
+
+static void*
+produce (void *data)
+{
+    lisp_pipeline_t *pipeline = (lisp_pipeline_t*)data;
+    int index = 0;
+
+    for (;;)
+    {
+	arena_t *arena = &pipeline->arenas[index];
+	int i, spins = 0;
+
+	/* wait until the consumers are done with the arena */
+	while (__atomic_load_n(&arena->references, __ATOMIC_ACQUIRE) > 0)
+	{
+	    if (__atomic_load_n(&pipeline->stop, __ATOMIC_RELAXED))
+		return 0;
+	    backoff(pipeline, &spins, can_reuse, arena);
+	}
+
+	reset_pools(&arena->pools);
+	__atomic_store_n(&arena->references, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < pipeline->forms_per_arena; ++i)
+	{
+	    lisp_object_t *obj = lisp_read_with_allocator(&arena->allocator, pipeline->stream);
+
+	    if (lisp_type(obj) == LISP_TYPE_EOF || lisp_type(obj) == LISP_TYPE_PARSE_ERROR)
+	    {
+		lisp_pipeline_release(pipeline, index);
+		pipeline->end = obj;
+		__atomic_store_n(&pipeline->done, 1, __ATOMIC_RELEASE);
+		wake(pipeline);
+		return 0;
+	    }
+
+	    __atomic_add_fetch(&arena->references, 1, __ATOMIC_RELAXED);
+
+	    spins = 0;
+	    while (!queue_push(pipeline, obj, index))
+	    {
+		if (__atomic_load_n(&pipeline->stop, __ATOMIC_RELAXED))
+		    return 0;
+		backoff(pipeline, &spins, can_push, 0);
+	    }
+	}
+
+	lisp_pipeline_release(pipeline, index);
+	index = (index + 1) % pipeline->num_arenas;
+    }
+}
+
+lisp_pipeline_t*
+lisp_pipeline_new (lisp_stream_t *stream, int num_arenas, int forms_per_arena)
+{
+    lisp_pipeline_t *pipeline;
+    int i;
+
+    if (num_arenas < 2 || forms_per_arena < 1)
+	return 0;
+
+    if (posix_memalign((void**)&pipeline, 64, sizeof(lisp_pipeline_t)) != 0)
+	return 0;
+
+    memset(pipeline, 0, sizeof(lisp_pipeline_t));
+    for (i = 0; i < QUEUE_SIZE; ++i)
+	pipeline->slots[i].sequence = i;
+
+    pipeline->stream = stream;
+    pipeline->forms_per_arena = forms_per_arena;
+    pthread_mutex_init(&pipeline->lock, 0);
+    pthread_cond_init(&pipeline->cond, 0);
+    pipeline->arenas = (arena_t*)calloc(num_arenas, sizeof(arena_t));
+    if (pipeline->arenas == 0)
+	goto error;
+
+    for (; pipeline->num_arenas < num_arenas; ++pipeline->num_arenas)
+    {
+	arena_t *arena = &pipeline->arenas[pipeline->num_arenas];
+
+	if (!init_pools(&arena->pools))
+	    goto error;
+	init_pools_allocator(&arena->allocator, &arena->pools);
+    }
+
+    if (pthread_create(&pipeline->thread, 0, produce, pipeline) != 0)
+	goto error;
+
+    return pipeline;
+
+ error:
+    for (i = 0; i < pipeline->num_arenas; ++i)
+	free_pools(&pipeline->arenas[i].pools);
+    free(pipeline->arenas);
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline);
+
+    return 0;
+}
+
+lisp_object_t*
+lisp_pipeline_next (lisp_pipeline_t *pipeline, int *arena)
+{
+    lisp_object_t *obj;
+    int spins = 0;
+
+    for (;;)
+    {
+	if (queue_pop(pipeline, &obj, arena))
+	    return obj;
+
+	if (__atomic_load_n(&pipeline->done, __ATOMIC_ACQUIRE))
+	{
+	    /* the last expressions might have been queued just before */
+	    if (queue_pop(pipeline, &obj, arena))
+		return obj;
+
+	    *arena = -1;
+	    return pipeline->end;
+	}
+
+	backoff(pipeline, &spins, can_pop, 0);
+    }
+}
+
+void
+lisp_pipeline_release (lisp_pipeline_t *pipeline, int arena)
+{
+    if (arena >= 0 && __atomic_sub_fetch(&pipeline->arenas[arena].references, 1, __ATOMIC_RELEASE) == 0)
+	wake(pipeline);
+}
+
+void
+lisp_pipeline_free (lisp_pipeline_t *pipeline)
+{
+    int i;
+
+    __atomic_store_n(&pipeline->stop, 1, __ATOMIC_RELAXED);
+    wake(pipeline);
+    pthread_join(pipeline->thread, 0);
+
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->lock);
+
+    for (i = 0; i < pipeline->num_arenas; ++i)
+	free_pools(&pipeline->arenas[i].pools);
+    free(pipeline->arenas);
+    free(pipeline);
+}
@@ -0,0 +1,44 @@
+/*
+ * pipeline.h
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "lispreader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _lisp_pipeline_t lisp_pipeline_t;
+
+lisp_pipeline_t* lisp_pipeline_new (lisp_stream_t *stream, int num_arenas, int forms_per_arena);
+lisp_object_t* lisp_pipeline_next (lisp_pipeline_t *pipeline, int *arena);
+void lisp_pipeline_release (lisp_pipeline_t *pipeline, int arena);
+void lisp_pipeline_free (lisp_pipeline_t *pipeline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
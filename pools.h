@@ -25,6 +25,10 @@
 
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* these settings allow a pools to grow to up to 16 GB (last pool 8GB) */
 #define GRANULARITY                sizeof(long)
 #define FIRST_POOL_SIZE            ((size_t)2048)
@@ -72,4 +76,8 @@ reset_pools (pools_t *pools)
 void reset_pools (pools_t *pools);
 #endif
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
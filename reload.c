@@ -0,0 +1,484 @@
+/*
+ * reload.c
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+
+#include <reload.h>
+
+/* Each top-level form owns the chunk of the file from the end of the
+   previous form to its own end, i.e., the space and comments before
+   it and its text.  The chunks of all forms together with the tail
+   after the last form make up the whole file. */
+typedef struct
+{
+    long chunk_start;
+    long start;
+    long end;
+    uint64_t chunk_hash;
+    uint64_t hash;		/* of the text of the form alone */
+    lisp_object_t *obj;
+} form_t;
+
+typedef struct
+{
+    form_t *forms;
+    long num_forms;
+    long capacity;
+} form_array_t;
+
+struct _lisp_forms_t
+{
+    char *path;
+    long size;
+    uint64_t tail_hash;
+    form_array_t array;
+};
+
+typedef struct
+{
+    char *buf;
+    size_t size;
+    int is_mapped;
+} file_buffer_t;
+
+#define IS_DELIMITER(c)   (isspace((unsigned char)(c)) || (c) == '"' || (c) == '(' || (c) == ')' || (c) == ';')
+
+static int
+buffer_load (file_buffer_t *buffer, const char *path)
+{
+    struct stat sb;
+    int fd;
+
+    fd = open(path, O_RDONLY, 0);
+    if (fd == -1)
+	return 0;
+
+    if (fstat(fd, &sb) == -1)
+    {
+	close(fd);
+	return 0;
+    }
+
+    buffer->buf = 0;
+    buffer->size = sb.st_size;
+    buffer->is_mapped = 0;
+
+    if (buffer->size > 0)
+    {
+#ifndef __MINGW32__
+	void *buf = mmap(0, buffer->size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (buf != (void*)-1)
+	{
+	    buffer->buf = (char*)buf;
+	    buffer->is_mapped = 1;
+	}
+	else
+#endif
+	{
+	    buffer->buf = (char*)malloc(buffer->size);
+	    if (buffer->buf == 0
+		|| read(fd, buffer->buf, buffer->size) != (ssize_t)buffer->size)
+	    {
+		free(buffer->buf);
+		close(fd);
+		return 0;
+	    }
+	}
+    }
+
+    close(fd);
+
+    return 1;
+}
+
+static void
+buffer_free (file_buffer_t *buffer)
+{
+#ifndef __MINGW32__
+    if (buffer->is_mapped)
+	munmap(buffer->buf, buffer->size);
+    else
+#endif
+	free(buffer->buf);
+}
+
+/* A fast hash of the bytes at p, which works on 8 bytes at a time. */
+static uint64_t
+hash_bytes (const char *p, size_t length)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ length, w;
+
+    while (length >= 8)
+    {
+	memcpy(&w, p, 8);
+	h = (h ^ w) * 0xff51afd7ed558ccdULL;
+	h ^= h >> 29;
+	p += 8;
+	length -= 8;
+    }
+
+    w = 0;
+    if (length > 0)
+	memcpy(&w, p, length);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+
+    return h ^ (h >> 29);
+}
+
+static int
+form_array_append (form_array_t *array, form_t *form)
+{
+    if (array->num_forms == array->capacity)
+    {
+	long capacity = array->capacity == 0 ? 64 : 2 * array->capacity;
+	form_t *forms = (form_t*)realloc(array->forms, capacity * sizeof(form_t));
+
+	if (forms == 0)
+	    return 0;
+
+	array->forms = forms;
+	array->capacity = capacity;
+    }
+
+    array->forms[array->num_forms++] = *form;
+
+    return 1;
+}
+
+static void
+form_set_hashes (form_t *form, const char *buf)
+{
+    form->chunk_hash = hash_bytes(buf + form->chunk_start, form->end - form->chunk_start);
+    form->hash = hash_bytes(buf + form->start, form->end - form->start);
+}
+
+/* Finds the top-level forms of buf from offset pos on and appends them
+   to array.  They are only read if do_read is non-zero.  If stop is
+   non-negative, the text from offset stop on is known, and scanning
+   must end at offset stop_form, where the first known form starts, or
+   at the end of buf if stop_form is the size of buf.  Returns 1 on
+   success, 0 on a parse error, and -1 if a form or comment reaches
+   into the known text. */
+static int
+scan_forms (const char *buf, size_t size, long pos, long stop, long stop_form, int do_read,
+	    form_array_t *array)
+{
+    lisp_stream_t stream;
+
+    lisp_stream_init_buffer(&stream, buf, size);
+    lisp_stream_seek(&stream, pos);
+
+    for (;;)
+    {
+	form_t form;
+	int more = lisp_skip_space(&stream);
+
+	form.chunk_start = pos;
+	form.start = lisp_stream_tell(&stream);
+	form.obj = 0;
+
+	if (stop >= 0 && form.start == stop_form)
+	    return 1;
+	if (!more)
+	    return stop < 0 ? 1 : -1;
+	if (stop >= 0 && form.start >= stop)
+	    return -1;
+
+	if (do_read)
+	{
+	    form.obj = lisp_read(&stream);
+	    if (lisp_type(form.obj) == LISP_TYPE_EOF || lisp_type(form.obj) == LISP_TYPE_PARSE_ERROR)
+		return 0;
+	}
+	else if (lisp_skip(&stream) <= 0)
+	    return 0;
+
+	form.end = lisp_stream_tell(&stream);
+	if (stop >= 0 && form.end > stop)
+	{
+	    lisp_free(form.obj);
+	    return -1;
+	}
+
+	form_set_hashes(&form, buf);
+	if (!form_array_append(array, &form))
+	{
+	    lisp_free(form.obj);
+	    return 0;
+	}
+
+	pos = form.end;
+    }
+}
+
+static int
+read_form (const char *buf, size_t size, form_t *form)
+{
+    lisp_stream_t stream;
+
+    lisp_stream_init_buffer(&stream, buf, size);
+    lisp_stream_seek(&stream, form->start);
+
+    form->obj = lisp_read(&stream);
+    if (lisp_type(form->obj) == LISP_TYPE_EOF || lisp_type(form->obj) == LISP_TYPE_PARSE_ERROR)
+	return 0;
+
+    return 1;
+}
+
+lisp_forms_t*
+lisp_forms_load (const char *path)
+{
+    lisp_forms_t *forms;
+    file_buffer_t buffer;
+    long i, tail_start;
+
+    forms = (lisp_forms_t*)malloc(sizeof(lisp_forms_t));
+    if (forms == 0)
+	return 0;
+    memset(forms, 0, sizeof(lisp_forms_t));
+
+    forms->path = strdup(path);
+    if (forms->path == 0 || !buffer_load(&buffer, path))
+    {
+	lisp_forms_free(forms);
+	return 0;
+    }
+
+    if (scan_forms(buffer.buf, buffer.size, 0, -1, -1, 1, &forms->array) <= 0)
+    {
+	buffer_free(&buffer);
+	lisp_forms_free(forms);
+	return 0;
+    }
+
+    i = forms->array.num_forms;
+    tail_start = i > 0 ? forms->array.forms[i - 1].end : 0;
+    forms->size = buffer.size;
+    forms->tail_hash = hash_bytes(buffer.buf + tail_start, buffer.size - tail_start);
+
+    buffer_free(&buffer);
+
+    return forms;
+}
+
+static int
+same_text (form_t *a, form_t *b)
+{
+    return a->hash == b->hash && a->end - a->start == b->end - b->start;
+}
+
+int
+lisp_forms_reload (lisp_forms_t *forms, lisp_forms_change_func_t func, void *data)
+{
+    file_buffer_t buffer;
+    form_array_t middle = { 0, 0, 0 }, result = { 0, 0, 0 };
+    form_t *old = forms->array.forms;
+    long n = forms->array.num_forms;
+    long prefix, suffix, prefix_end, tail_start, delta, size;
+    long stop = -1, stop_form = -1;
+    long head, tail, num_old, num_new, i;
+    const char *buf;
+    int status;
+
+    if (!buffer_load(&buffer, forms->path))
+	return 0;
+
+    buf = buffer.buf;
+    size = buffer.size;
+    delta = size - forms->size;
+
+    /* the forms at the start of the file whose chunks are unchanged */
+    for (prefix = 0; prefix < n; ++prefix)
+    {
+	form_t *form = &old[prefix];
+
+	if (form->end > size
+	    || hash_bytes(buf + form->chunk_start, form->end - form->chunk_start) != form->chunk_hash)
+	    break;
+
+	/* an atom might continue in the new text */
+	if (form->end < size && buf[form->end - 1] != ')' && buf[form->end - 1] != '"'
+	    && !IS_DELIMITER(buf[form->end]))
+	    break;
+    }
+    prefix_end = prefix > 0 ? old[prefix - 1].end : 0;
+
+    /* the forms at the end of the file whose chunks are unchanged,
+       but moved by delta */
+    suffix = n;
+    tail_start = n > 0 ? old[n - 1].end : 0;
+    if (tail_start + delta >= prefix_end
+	&& hash_bytes(buf + tail_start + delta, forms->size - tail_start) == forms->tail_hash)
+    {
+	stop = tail_start + delta;
+	stop_form = size;
+
+	while (suffix > prefix)
+	{
+	    form_t *form = &old[suffix - 1];
+
+	    if (form->chunk_start + delta < prefix_end
+		|| hash_bytes(buf + form->chunk_start + delta, form->end - form->chunk_start) != form->chunk_hash)
+		break;
+
+	    --suffix;
+	    stop = form->chunk_start + delta;
+	    stop_form = form->start + delta;
+	}
+    }
+
+    /* scan the changed text in between */
+    status = scan_forms(buf, size, prefix_end, stop, stop_form, 0, &middle);
+    if (status < 0)
+    {
+	/* the changed text reaches into the suffix, which is thus
+	   scanned again */
+	middle.num_forms = 0;
+	suffix = n;
+	status = scan_forms(buf, size, prefix_end, -1, -1, 0, &middle);
+    }
+    if (status == 0)
+	goto error;
+
+    /* reuse the forms at both ends of the changed text whose text is
+       the same and read the others */
+    num_old = suffix - prefix;
+    num_new = middle.num_forms;
+    for (head = 0; head < num_old && head < num_new && same_text(&old[prefix + head], &middle.forms[head]); ++head)
+	middle.forms[head].obj = old[prefix + head].obj;
+    for (tail = 0;
+	 tail < num_old - head && tail < num_new - head
+	     && same_text(&old[suffix - 1 - tail], &middle.forms[num_new - 1 - tail]);
+	 ++tail)
+	middle.forms[num_new - 1 - tail].obj = old[suffix - 1 - tail].obj;
+
+    for (i = head; i < num_new - tail; ++i)
+    {
+	if (!read_form(buf, size, &middle.forms[i]))
+	{
+	    while (--i >= head)
+		lisp_free(middle.forms[i].obj);
+	    goto error;
+	}
+    }
+
+    /* put together the new forms */
+    for (i = 0; i < prefix; ++i)
+	if (!form_array_append(&result, &old[i]))
+	    goto error_read;
+    for (i = 0; i < num_new; ++i)
+	if (!form_array_append(&result, &middle.forms[i]))
+	    goto error_read;
+    for (i = suffix; i < n; ++i)
+    {
+	form_t form = old[i];
+
+	form.chunk_start += delta;
+	form.start += delta;
+	form.end += delta;
+	if (i == suffix)
+	{
+	    /* the changed text might end before the chunk did */
+	    form.chunk_start = result.num_forms > 0 ? result.forms[result.num_forms - 1].end : 0;
+	    form_set_hashes(&form, buf);
+	}
+	if (!form_array_append(&result, &form))
+	    goto error_read;
+    }
+
+    tail_start = result.num_forms > 0 ? result.forms[result.num_forms - 1].end : 0;
+    forms->array = result;
+    forms->size = size;
+    forms->tail_hash = hash_bytes(buf + tail_start, size - tail_start);
+
+    buffer_free(&buffer);
+
+    /* report the changes, pairing the changed forms in order */
+    for (i = 0; i < num_old - head - tail || i < num_new - head - tail; ++i)
+    {
+	int has_old = i < num_old - head - tail, has_new = i < num_new - head - tail;
+	lisp_object_t *old_form = has_old ? old[prefix + head + i].obj : 0;
+	lisp_object_t *new_form = has_new ? middle.forms[head + i].obj : 0;
+
+	if (func != 0)
+	    func(has_old && has_new ? LISP_FORM_MODIFIED : has_new ? LISP_FORM_ADDED : LISP_FORM_REMOVED,
+		 prefix + head + i, old_form, new_form, data);
+
+	lisp_free(old_form);
+    }
+
+    free(old);
+    free(middle.forms);
+
+    return 1;
+
+ error_read:
+    for (i = head; i < num_new - tail; ++i)
+	lisp_free(middle.forms[i].obj);
+
+ error:
+    free(result.forms);
+    free(middle.forms);
+    buffer_free(&buffer);
+
+    return 0;
+}
+
+void
+lisp_forms_free (lisp_forms_t *forms)
+{
+    long i;
+
+    for (i = 0; i < forms->array.num_forms; ++i)
+	lisp_free(forms->array.forms[i].obj);
+
+    free(forms->array.forms);
+    free(forms->path);
+    free(forms);
+}
+
+long
+lisp_forms_length (lisp_forms_t *forms)
+{
+    return forms->array.num_forms;
+}
+
+lisp_object_t*
+lisp_forms_nth (lisp_forms_t *forms, long n)
+{
+    if (n < 0 || n >= forms->array.num_forms)
+	return lisp_nil();
+
+    return forms->array.forms[n].obj;
+}
@@ -0,0 +1,54 @@
+/*
+ * reload.h
+ *
+ * lispreader
+ *
+ * Copyright (C) 2026 Mark Probst
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __RELOAD_H__
+#define __RELOAD_H__
+
+#include "lispreader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LISP_FORM_ADDED        1
+#define LISP_FORM_REMOVED      2
+#define LISP_FORM_MODIFIED     3
+
+typedef struct _lisp_forms_t lisp_forms_t;
+
+typedef void (*lisp_forms_change_func_t) (int change, long index,
+					  lisp_object_t *old_form, lisp_object_t *new_form,
+					  void *data);
+
+lisp_forms_t* lisp_forms_load (const char *path);
+int lisp_forms_reload (lisp_forms_t *forms, lisp_forms_change_func_t func, void *data);
+void lisp_forms_free (lisp_forms_t *forms);
+
+long lisp_forms_length (lisp_forms_t *forms);
+lisp_object_t* lisp_forms_nth (lisp_forms_t *forms, long n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif